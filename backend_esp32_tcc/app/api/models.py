@@ -4,6 +4,10 @@ from app import db
 
 class Sensores(db.Model):
     __tablename__ = 'sensors'
+    __table_args__ = (
+        db.UniqueConstraint('id_placa', 'data', name='uq_sensors_id_placa_data'),
+        db.Index('ix_sensors_id_placa_seq', 'id_placa', 'seq'),
+    )
     id = db.Column(db.Integer, primary_key=True)
     id_placa = db.Column(db.String(40))
     temperature = db.Column(db.Float, nullable=True)
@@ -11,6 +15,13 @@ class Sensores(db.Model):
     ph = db.Column(db.Float, nullable=True)
     tds = db.Column(db.Float, nullable=True)
     data = db.Column(db.DateTime)
+    seq = db.Column(db.BigInteger, nullable=True)
+    # Extremos amostrados pelo ULP desde a medição anterior
+    ulp_samples = db.Column(db.Integer, nullable=True)
+    turbidity_min = db.Column(db.Integer, nullable=True)
+    turbidity_max = db.Column(db.Integer, nullable=True)
+    tds_min = db.Column(db.Float, nullable=True)
+    tds_max = db.Column(db.Float, nullable=True)
 
 
 class Placas(db.Model):
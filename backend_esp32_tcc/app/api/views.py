@@ -126,6 +126,59 @@ def calibrate_sensors():
 
     return jsonify({'message': 'Dados enviados corretamente.'}), 200
 
+@api_bp.route('/api/placas/lote', methods=['POST'])
+@jwt_required()
+def configure_batching():
+    batch_json = request.get_json()
+
+    # Verifica se as chaves da requisição existem
+    threshold_keys = ["temperature_min", "temperature_max", "tds_max", "ph_min", "ph_max", "turbidity_max"]
+    received_keys = set(batch_json.keys())
+    invalid_keys = received_keys - set(["id_placa", "upload_every"] + threshold_keys)
+    if invalid_keys:
+        return jsonify({'error': f'Chave(s) inválida(s) detectada(s): {", ".join(invalid_keys)}'}), 400
+
+    id_placa = batch_json.get('id_placa')
+    if id_placa is None:
+        return jsonify({'error': 'A chave id_placa é obrigatória.'}), 400
+
+    entries = []
+    upload_every = batch_json.get('upload_every')
+    if upload_every is not None:
+        if not isinstance(upload_every, int) or not 1 <= upload_every <= 16:
+            return jsonify({'error': 'upload_every deve ser um inteiro entre 1 e 16.'}), 400
+        entries.append(f"upload_every={upload_every}")
+
+    # null desativa o limite na placa
+    for key in threshold_keys:
+        if key in batch_json:
+            value = batch_json[key]
+            entries.append(f"{key}={'nan' if value is None else float(value)}")
+
+    if not entries:
+        return jsonify({'error': 'Nenhuma configuração enviada.'}), 400
+
+    # QoS 1 para que o broker guarde a mensagem enquanto a placa dorme
+    topic = f"devices/{id_placa}/batch_config"
+    mqtt_client.publish(topic, ",".join(entries), qos=1)
+
+    return jsonify({'message': 'Dados enviados corretamente.'}), 200
+
+
+@api_bp.route('/api/placas/sondas', methods=['POST'])
+@jwt_required()
+def rescan_probes():
+    data = request.get_json()
+
+    id_placa = data.get('id_placa')
+    if id_placa is None:
+        return jsonify({'error': 'A chave id_placa é obrigatória.'}), 400
+
+    # A placa procura de novo os sensores de temperatura no barramento 1-Wire
+    topic = f"devices/{id_placa}/rescan_probes"
+    mqtt_client.publish(topic, "1", qos=1)
+
+    return jsonify({'message': 'Busca de sondas solicitada.'}), 200
 
 @api_bp.route('/api/dados/sensores', methods=['GET'])
 @jwt_required()
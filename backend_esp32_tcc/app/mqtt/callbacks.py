@@ -3,7 +3,13 @@ from ..db import db
 from ..api.models import Sensores, Placas, Users
 from flask import current_app
 from ..socketio.sockets import socketio
+from sqlalchemy.dialects.postgresql import insert
+from .telemetry import decode_snapshot, decode_batch, SNAPSHOT_VERSION, BATCH_VERSION
 import json
+import time
+
+SNAPSHOT_FIELDS = ('temperature', 'tds', 'ph', 'turbidity',
+                   'ulp_samples', 'turbidity_min', 'turbidity_max', 'tds_min', 'tds_max')
 
 @mqtt_client.on_connect()
 def handle_connect(client, userdata, flags, rc):
@@ -11,23 +17,61 @@ def handle_connect(client, userdata, flags, rc):
     mqtt_client.subscribe('devices/+/status')
     mqtt_client.subscribe('devices/+/ph_calibration_response')
     mqtt_client.subscribe('devices/+/tds_calibration_response')
+    mqtt_client.subscribe('devices/+/rescan_probes_response')
     mqtt_client.subscribe('sensors/+/temperature')
     mqtt_client.subscribe('sensors/+/tds')
     mqtt_client.subscribe('sensors/+/ph')
     mqtt_client.subscribe('sensors/+/turbidity')
+    mqtt_client.subscribe('sensors/+/snapshot')
+    mqtt_client.subscribe('sensors/+/snapshot/bin')
+    mqtt_client.subscribe('sensors/+/snapshot/batch')
+
+def message_schema(message):
+    # Versão do formato enviada pelo firmware como user property no MQTT 5;
+    # None no MQTT 3.1.1, onde a versão só vem no próprio payload
+    properties = getattr(message, 'properties', None)
+    for name, value in getattr(properties, 'UserProperty', None) or []:
+        if name == 'schema':
+            return int(value)
+    return None
+
+def schema_supported(topic, message, version):
+    schema = message_schema(message)
+    if schema is not None and schema != version:
+        print(f"[ERRO] Versão {schema} não suportada em {topic}, esperada {version}")
+        return False
+    return True
 
 @mqtt_client.on_message()
 def handle_mqtt_message(client, userdata, message):
+    # O broker resolve os topic aliases do MQTT 5, aqui o tópico chega sempre completo
+    topic = message.topic
+
+    # Payload binário, não pode ser decodificado como texto
+    if topic.endswith("/snapshot/bin"):
+        print('Received message on topic {}: {}'.format(topic, message.payload.hex()))
+        if schema_supported(topic, message, SNAPSHOT_VERSION):
+            handle_snapshot_bin(topic, message.payload)
+        return
+    if topic.endswith("/snapshot/batch"):
+        print('Received message on topic {}: {} bytes'.format(topic, len(message.payload)))
+        if schema_supported(topic, message, BATCH_VERSION):
+            handle_snapshot_batch(topic, message.payload)
+        return
+
     print('Received message on topic {}: {}'.format(
         message.topic, message.payload.decode()))
 
-    topic = message.topic
     payload = message.payload.decode()
 
     if "devices" in topic and "status" in topic:
         handle_devices(topic, payload)
+    elif "sensors" in topic and topic.endswith("/snapshot"):
+        handle_snapshot(topic, payload)
     elif "sensors" in topic:
         handle_sensors(topic, payload)
+    elif topic.endswith("/rescan_probes_response"):
+        handle_probes_response(topic, payload)
     else:
         handle_calibration_response(topic, payload)
 
@@ -58,6 +102,10 @@ def handle_devices(topic, payload):
         db.session.add(device)
         db.session.commit()
 
+        if status and current_app.config.get('MQTT_PUBLISH_TIME'):
+            # QoS 0: uma hora atrasada na fila é pior que nenhuma
+            mqtt_client.publish(f'devices/{device_id}/time', f'{time.time():.3f}')
+
         socketio.emit('message', 'New data')
         
 def handle_sensors(topic, payload):
@@ -88,6 +136,85 @@ def handle_sensors(topic, payload):
 
         socketio.emit('message', 'New data')
 
+def upsert_snapshot(device_id, timestamp, values, seq=None):
+    stmt = insert(Sensores).values(id_placa=device_id, data=timestamp, seq=seq, **values)
+    if values:
+        set_ = {field: stmt.excluded[field] for field in values}
+        if seq is not None:
+            set_['seq'] = stmt.excluded.seq
+        stmt = stmt.on_conflict_do_update(index_elements=['id_placa', 'data'], set_=set_)
+    else:
+        stmt = stmt.on_conflict_do_nothing(index_elements=['id_placa', 'data'])
+    db.session.execute(stmt)
+
+def store_snapshot(device_id, timestamp, values):
+    # Uma única transação por ciclo de medição, mesmo que a medição já exista
+    upsert_snapshot(device_id, timestamp, values)
+    db.session.commit()
+    print(f"[INFO] Snapshot recebido: {device_id} - {timestamp}")
+
+    socketio.emit('message', 'New data')
+
+def handle_snapshot(topic, payload):
+    with mqtt_client.app.app_context():
+        device_id = topic.split('/')[1]
+
+        payload_json = json.loads(payload)
+        timestamp = payload_json["timestamp"]
+        values = {field: payload_json[field] for field in SNAPSHOT_FIELDS if field in payload_json}
+
+        store_snapshot(device_id, timestamp, values)
+
+def handle_snapshot_bin(topic, payload):
+    with mqtt_client.app.app_context():
+        device_id = topic.split('/')[1]
+
+        try:
+            snapshot = decode_snapshot(payload)
+        except ValueError as e:
+            print(f"[ERRO] Snapshot inválido de {device_id}: {e}")
+            return
+
+        if snapshot['device_id'] != device_id:
+            print(f"[AVISO] Snapshot publicado por {device_id} contém o id {snapshot['device_id']}")
+
+        store_snapshot(device_id, snapshot['timestamp'], snapshot['values'])
+
+def handle_snapshot_batch(topic, payload):
+    with mqtt_client.app.app_context():
+        device_id = topic.split('/')[1]
+
+        try:
+            records = decode_batch(payload)
+        except ValueError as e:
+            print(f"[ERRO] Lote inválido de {device_id}: {e}")
+            return
+
+        # O firmware reenvia lotes sem confirmação (PUBACK), então o mesmo número de
+        # sequência pode chegar mais de uma vez
+        seqs = [seq for seq, _ in records]
+        received = {seq for (seq,) in db.session.query(Sensores.seq).filter(
+            Sensores.id_placa == device_id, Sensores.seq.in_(seqs))}
+
+        stored = 0
+        for seq, snapshot in records:
+            if seq in received:
+                continue
+            if snapshot['device_id'] != device_id:
+                print(f"[AVISO] Snapshot publicado por {device_id} contém o id {snapshot['device_id']}")
+            upsert_snapshot(device_id, snapshot['timestamp'], snapshot['values'], seq)
+            received.add(seq)
+            stored += 1
+        db.session.commit()
+        print(f"[INFO] Lote recebido: {device_id} - {stored} de {len(records)} snapshots novos")
+
+        if stored:
+            socketio.emit('message', 'New data')
+
 def handle_calibration_response(topic, payload):
     with mqtt_client.app.app_context():
         socketio.emit('calibration_response', payload)
+
+def handle_probes_response(topic, payload):
+    with mqtt_client.app.app_context():
+        socketio.emit('probes_response', payload)
@@ -0,0 +1,92 @@
+import struct
+from datetime import datetime, timedelta, timezone
+
+# Formato binário do snapshot (firmware: components/telemetry/telemetry.c)
+SNAPSHOT_VERSION = 1
+SNAPSHOT_HEADER = struct.Struct('<BBBxIh6shHHB')
+SNAPSHOT_PROBE = struct.Struct('<h')
+# Valor de uma sonda que falhou na leitura
+SNAPSHOT_PROBE_INVALID = -32768
+# Mínimos e máximos amostrados pelo ULP durante o deep sleep, depois das sondas
+SNAPSHOT_ULP = struct.Struct('<HBBHH')
+
+# Lote de snapshots reenviados do log em flash (firmware: telemetry_encode_batch)
+BATCH_VERSION = 1
+BATCH_HEADER = struct.Struct('<BB')
+BATCH_RECORD = struct.Struct('<IB')
+
+HAS_TEMPERATURE = 0x01
+HAS_TDS = 0x02
+HAS_PH = 0x04
+HAS_TURBIDITY = 0x08
+HAS_ULP = 0x10
+
+
+def decode_snapshot(payload):
+    if len(payload) < SNAPSHOT_HEADER.size:
+        raise ValueError(f"Snapshot com {len(payload)} bytes, esperado pelo menos {SNAPSHOT_HEADER.size}")
+
+    (version, valid, probe_count, epoch, tz_offset, mac,
+     temperature, tds, ph, turbidity) = SNAPSHOT_HEADER.unpack_from(payload)
+
+    if version != SNAPSHOT_VERSION:
+        raise ValueError(f"Versão de snapshot não suportada: {version}")
+
+    probes_end = SNAPSHOT_HEADER.size + probe_count * SNAPSHOT_PROBE.size
+    if len(payload) < probes_end:
+        raise ValueError(f"Snapshot truncado: {len(payload)} bytes, esperado {probes_end}")
+
+    probes = [None if value == SNAPSHOT_PROBE_INVALID else value / 100 for (value,) in SNAPSHOT_PROBE.iter_unpack(payload[SNAPSHOT_HEADER.size:probes_end])]
+
+    # Hora local sem fuso horário, como as mensagens JSON são armazenadas
+    timestamp = datetime.fromtimestamp(epoch, timezone.utc).replace(tzinfo=None) + timedelta(minutes=tz_offset)
+
+    values = {}
+    if valid & HAS_TEMPERATURE:
+        values['temperature'] = temperature / 100
+    if valid & HAS_TDS:
+        values['tds'] = tds / 10
+    if valid & HAS_PH:
+        values['ph'] = ph / 100
+    if valid & HAS_TURBIDITY:
+        values['turbidity'] = turbidity
+    if valid & HAS_ULP:
+        if len(payload) < probes_end + SNAPSHOT_ULP.size:
+            raise ValueError(f"Snapshot truncado: {len(payload)} bytes, esperado {probes_end + SNAPSHOT_ULP.size}")
+        (samples, turbidity_min, turbidity_max,
+         tds_min, tds_max) = SNAPSHOT_ULP.unpack_from(payload, probes_end)
+        values['ulp_samples'] = samples
+        values['turbidity_min'] = turbidity_min
+        values['turbidity_max'] = turbidity_max
+        values['tds_min'] = tds_min / 10
+        values['tds_max'] = tds_max / 10
+
+    return {
+        'device_id': ':'.join(f'{byte:02X}' for byte in mac),
+        'timestamp': timestamp,
+        'values': values,
+        'probes': probes,
+    }
+
+
+def decode_batch(payload):
+    if len(payload) < BATCH_HEADER.size:
+        raise ValueError(f"Lote com {len(payload)} bytes, esperado pelo menos {BATCH_HEADER.size}")
+
+    version, count = BATCH_HEADER.unpack_from(payload)
+    if version != BATCH_VERSION:
+        raise ValueError(f"Versão de lote não suportada: {version}")
+
+    records = []
+    offset = BATCH_HEADER.size
+    for _ in range(count):
+        if len(payload) < offset + BATCH_RECORD.size:
+            raise ValueError(f"Lote truncado: {len(payload)} bytes")
+        seq, length = BATCH_RECORD.unpack_from(payload, offset)
+        offset += BATCH_RECORD.size
+        if len(payload) < offset + length:
+            raise ValueError(f"Lote truncado: {len(payload)} bytes")
+        records.append((seq, decode_snapshot(payload[offset:offset + length])))
+        offset += length
+
+    return records
@@ -21,6 +21,11 @@ class Config:
     MQTT_USERNAME = ''
     MQTT_PASSWORD = ''
     MQTT_KEEPALIVE = 5
+    # 4 = MQTT 3.1.1, 5 = MQTT 5 (Flask-MQTT >= 1.1), use 5 with MQTT_PROTOCOL_V5 in the firmware
+    MQTT_PROTOCOL_VERSION = 4
+    # Send the server time on devices/<id>/time when a board comes online,
+    # used by boards that can't reach an NTP server (TIME_SYNC_BROKER_TIME)
+    MQTT_PUBLISH_TIME = True
 
     # ip config
     LOCAL_IP = "192.168.0.110"
\ No newline at end of file
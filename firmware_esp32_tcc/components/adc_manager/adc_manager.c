@@ -1,26 +1,57 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "esp_adc/adc_oneshot.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_adc/adc_continuous.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 #include "esp_log.h"
 
 #include "adc_manager.h"
 
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define ADC_GET_CHANNEL(p_data) ((p_data)->type1.channel)
+#define ADC_GET_DATA(p_data) ((p_data)->type1.data)
+#else
+#define ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define ADC_GET_CHANNEL(p_data) ((p_data)->type2.channel)
+#define ADC_GET_DATA(p_data) ((p_data)->type2.data)
+#endif
+
 const static char *TAG = "adc_manager";
 
 static const adc_channel_t sensor_adc_channels[] = {
-    ADC_CHANNEL_0,
-    ADC_CHANNEL_3,
-    ADC_CHANNEL_4,
-    ADC_CHANNEL_5
+    [TEMPERATURE_SENSOR] = TEMPERATURE_SENSOR_ADC_CHANNEL,
+    [TDS_SENSOR] = TDS_SENSOR_ADC_CHANNEL,
+    [PH_SENSOR] = PH_SENSOR_ADC_CHANNEL,
+    [TURBIDITY_SENSOR] = TURBIDITY_SENSOR_ADC_CHANNEL
 };
 
-adc_oneshot_unit_handle_t adc1_handle;
+adc_continuous_handle_t adc1_handle;
 sensor_adc_config_t sensor_adc_map[SENSOR_LENGTH];
 
-static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle)
+// Session state
+static SemaphoreHandle_t adc_session_lock;
+static SemaphoreHandle_t adc_capture_lock;
+static SemaphoreHandle_t adc_channel_leases[SENSOR_LENGTH];
+static TaskHandle_t adc_lease_owners[SENSOR_LENGTH];
+static esp_timer_handle_t adc_idle_timer;
+static int adc_session_users = 0;
+static bool adc_unit_ready = false;
+
+static uint8_t adc_frame[ADC_CONV_FRAME_SIZE];
+static uint16_t adc_samples[ADC_CAPTURE_MAX_SAMPLES * SENSOR_LENGTH];
+static int32_t adc_window[ADC_CAPTURE_MAX_SAMPLES];
+static int32_t adc_scratch[ADC_CAPTURE_MAX_SAMPLES];
+
+static adc_cali_entry_t adc_cali_registry[ADC_CALI_REGISTRY_SIZE];
+static int adc_cali_registry_count = 0;
+
+static bool adc_calibration_init(adc_unit_t unit, adc_atten_t atten, adc_cali_handle_t *out_handle)
 {
     adc_cali_handle_t handle = NULL;
     esp_err_t ret = ESP_FAIL;
@@ -51,97 +82,397 @@ static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_att
     return calibrated;
 }
 
-static void adc_calibration_deinit(adc_cali_handle_t handle)
+static adc_cali_entry_t *adc_calibration_register(adc_unit_t unit, adc_atten_t atten)
+{
+    if (adc_cali_registry_count >= ADC_CALI_REGISTRY_SIZE) {
+        ESP_LOGE(TAG, "Calibration registry is full");
+        return NULL;
+    }
+
+    uint16_t *lut = malloc(ADC_CALI_LUT_SIZE * sizeof(uint16_t));
+    if (lut == NULL) {
+        ESP_LOGE(TAG, "No memory for calibration table");
+        return NULL;
+    }
+
+    adc_cali_entry_t *entry = &adc_cali_registry[adc_cali_registry_count];
+    entry->unit = unit;
+    entry->atten = atten;
+    entry->lut = lut;
+
+    // Resolve every raw code once so the hot path is a plain table lookup.
+    // Without eFuse calibration fall back to the nominal full scale range.
+    if (adc_calibration_init(unit, atten, &entry->handle)) {
+        int voltage = 0;
+        for (int raw = 0; raw < ADC_CALI_LUT_SIZE; raw++) {
+            adc_cali_raw_to_voltage(entry->handle, raw, &voltage);
+            lut[raw] = voltage;
+        }
+    } else {
+        for (int raw = 0; raw < ADC_CALI_LUT_SIZE; raw++) {
+            lut[raw] = (uint16_t)(raw * (V_MAX * 1000) / D_MAX + 0.5);
+        }
+    }
+
+    adc_cali_registry_count++;
+    ESP_LOGI(TAG, "Calibration table ready for unit %d, atten %d (full scale %d mV)", unit + 1, atten, lut[D_MAX]);
+
+    return entry;
+}
+
+esp_err_t adc_calibration_registry_init(void)
 {
-    ESP_LOGI(TAG, "deregister %s calibration scheme", "Line Fitting");
-    ESP_ERROR_CHECK(adc_cali_delete_scheme_line_fitting(handle));
+    if (adc_calibration_get_lut(ADC_UNIT_1, ADC_ATTEN_DB_12) == NULL) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+const uint16_t *adc_calibration_get_lut(adc_unit_t unit, adc_atten_t atten)
+{
+    for (int i = 0; i < adc_cali_registry_count; i++) {
+        if (adc_cali_registry[i].unit == unit && adc_cali_registry[i].atten == atten) {
+            return adc_cali_registry[i].lut;
+        }
+    }
+
+    adc_cali_entry_t *entry = adc_calibration_register(unit, atten);
+    return entry ? entry->lut : NULL;
+}
+
+void adc_raw_to_mv(const uint16_t *lut, const uint16_t *raw, uint16_t *mv, int n)
+{
+    for (int i = 0; i < n; i++) {
+        mv[i] = lut[raw[i] & D_MAX];
+    }
+}
+
+static int sensor_index_from_channel(uint32_t channel)
+{
+    for (int i = 0; i < SENSOR_LENGTH; i++) {
+        if (sensor_adc_channels[i] == channel) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-void adc_init(void) {
+static void adc_init(void) {
     ESP_LOGI(TAG, "Initializing ADC1...");
 
-    adc_oneshot_unit_init_cfg_t init_config1 = {
-        .unit_id = ADC_UNIT_1,
+    adc_continuous_handle_cfg_t handle_config = {
+        .max_store_buf_size = ADC_CONV_FRAME_SIZE * 4,
+        .conv_frame_size = ADC_CONV_FRAME_SIZE,
+        .flags.flush_pool = 1,
     };
 
-    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &adc1_handle));
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_config, &adc1_handle));
+    adc_unit_ready = true;
+}
 
-    adc_oneshot_chan_cfg_t config = {
-        .atten = ADC_ATTEN_DB_12,
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-    };
+static void adc_deinit(void) {
+    ESP_LOGI(TAG, "Deinitializing ADC1...");
+    ESP_ERROR_CHECK(adc_continuous_deinit(adc1_handle));
+    adc_unit_ready = false;
+}
+
+// Runs in the esp_timer task, which must not block: if a session is being
+// opened or closed right now, try again later
+static void adc_idle_timer_callback(void *arg) {
+    if (xSemaphoreTake(adc_session_lock, 0) != pdTRUE) {
+        esp_timer_start_once(adc_idle_timer, ADC_SESSION_IDLE_TIMEOUT_MS * 1000ULL);
+        return;
+    }
+    if (adc_session_users == 0 && adc_unit_ready) {
+        adc_deinit();
+    }
+    xSemaphoreGive(adc_session_lock);
+}
+
+static void adc_leases_give(uint32_t sensor_mask) {
+    for (int i = 0; i < SENSOR_LENGTH; i++) {
+        if (sensor_mask & ADC_SENSOR_BIT(i)) {
+            adc_lease_owners[i] = NULL;
+            xSemaphoreGive(adc_channel_leases[i]);
+        }
+    }
+}
+
+// True when the calling task holds the lease of every sensor in sensor_mask
+static bool adc_leases_held(uint32_t sensor_mask) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < SENSOR_LENGTH; i++) {
+        if ((sensor_mask & ADC_SENSOR_BIT(i)) && adc_lease_owners[i] != self) {
+            return false;
+        }
+    }
+    return true;
+}
 
+void adc_manager_init(void) {
+    adc_session_lock = xSemaphoreCreateMutex();
+    adc_capture_lock = xSemaphoreCreateMutex();
     for (int i = 0; i < SENSOR_LENGTH; i++) {
         sensor_adc_map[i].channel = sensor_adc_channels[i];
-        ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, sensor_adc_channels[i], &config));
-        ESP_LOGI(TAG, "Channel %d successfully configured!", sensor_adc_channels[i]);
+        adc_channel_leases[i] = xSemaphoreCreateBinary();
+        xSemaphoreGive(adc_channel_leases[i]);
     }
+
+    const esp_timer_create_args_t idle_timer_args = {
+        .callback = adc_idle_timer_callback,
+        .name = "adc_idle",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&idle_timer_args, &adc_idle_timer));
+
+    adc_calibration_registry_init();
 }
 
-void adc_deinit(void) {
-    ESP_LOGI(TAG, "Deinitializing ADC1...");
-    ESP_ERROR_CHECK(adc_oneshot_del_unit(adc1_handle));
+// Leases every sensor in sensor_mask (taken in ascending order so that
+// overlapping masks cannot deadlock) and keeps ADC1 configured until the
+// last lease is released and the unit stays idle for a while.
+esp_err_t adc_session_acquire(uint32_t sensor_mask, TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+
+    for (int i = 0; i < SENSOR_LENGTH; i++) {
+        if (!(sensor_mask & ADC_SENSOR_BIT(i))) {
+            continue;
+        }
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        TickType_t remaining = (timeout == portMAX_DELAY) ? portMAX_DELAY : (elapsed < timeout ? timeout - elapsed : 0);
+        if (xSemaphoreTake(adc_channel_leases[i], remaining) != pdTRUE) {
+            ESP_LOGW(TAG, "Timeout waiting for the channel %d lease", sensor_adc_channels[i]);
+            adc_leases_give(sensor_mask & (ADC_SENSOR_BIT(i) - 1));
+            return ESP_ERR_TIMEOUT;
+        }
+        adc_lease_owners[i] = xTaskGetCurrentTaskHandle();
+    }
+
+    xSemaphoreTake(adc_session_lock, portMAX_DELAY);
+    adc_session_users++;
+    esp_timer_stop(adc_idle_timer);
+    if (!adc_unit_ready) {
+        adc_init();
+    }
+    xSemaphoreGive(adc_session_lock);
+
+    return ESP_OK;
 }
 
-void read_adc_value(sensor_type_t sensor_type, int *sensor) {
-    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+void adc_session_release(uint32_t sensor_mask) {
+    if (sensor_mask == 0) {
+        return;
+    }
 
-    vTaskDelay(pdMS_TO_TICKS(500));
-    adc_oneshot_read(adc1_handle, sensor_adc_channels[sensor_type], sensor);
+    adc_leases_give(sensor_mask);
+
+    xSemaphoreTake(adc_session_lock, portMAX_DELAY);
+    if (adc_session_users > 0 && --adc_session_users == 0) {
+        esp_timer_start_once(adc_idle_timer, ADC_SESSION_IDLE_TIMEOUT_MS * 1000ULL);
+    }
+    xSemaphoreGive(adc_session_lock);
 }
 
-void read_adc_voltage(sensor_type_t sensor_type, float *sensor) {
-    int adc_value;
-    int temp;
-    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+static esp_err_t adc_capture_locked(uint16_t *samples, int n, uint32_t sample_freq_hz) {
+    if (!adc_unit_ready) {
+        ESP_LOGE(TAG, "ADC capture without an active session");
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    adc_calibration_init(ADC_UNIT_1, sensor_adc_map[sensor_type].channel, ADC_ATTEN_DB_12, &sensor_adc_map[sensor_type].cali_handle);
+    adc_digi_pattern_config_t adc_pattern[SENSOR_LENGTH] = {0};
+    for (int i = 0; i < SENSOR_LENGTH; i++) {
+        adc_pattern[i].atten = ADC_ATTEN_DB_12;
+        adc_pattern[i].channel = sensor_adc_channels[i] & 0x7;
+        adc_pattern[i].unit = ADC_UNIT_1;
+        adc_pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+    }
 
-    vTaskDelay(pdMS_TO_TICKS(500));
-    adc_oneshot_read(adc1_handle, sensor_adc_channels[sensor_type], &adc_value);
+    adc_continuous_config_t dig_cfg = {
+        .pattern_num = SENSOR_LENGTH,
+        .adc_pattern = adc_pattern,
+        .sample_freq_hz = sample_freq_hz,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_OUTPUT_TYPE,
+    };
+
+    esp_err_t err = adc_continuous_config(adc1_handle, &dig_cfg);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Expected burst duration plus a generous margin for the first DMA frame
+    uint32_t timeout_ms = (uint32_t)((uint64_t)n * SENSOR_LENGTH * 1000 / sample_freq_hz) + 100;
+
+    int count[SENSOR_LENGTH] = {0};
+    int complete = 0;
+
+    adc_continuous_flush_pool(adc1_handle);
+    err = adc_continuous_start(adc1_handle);
+    if (err != ESP_OK) {
+        return err;
+    }
 
-    adc_cali_raw_to_voltage(sensor_adc_map[sensor_type].cali_handle, adc_value, &temp);
+    while (complete < SENSOR_LENGTH) {
+        uint32_t ret_num = 0;
+        err = adc_continuous_read(adc1_handle, adc_frame, ADC_CONV_FRAME_SIZE, &ret_num, timeout_ms);
+        if (err != ESP_OK) {
+            break;
+        }
 
-    adc_calibration_deinit(sensor_adc_map[sensor_type].cali_handle);
+        for (uint32_t i = 0; i < ret_num; i += SOC_ADC_DIGI_RESULT_BYTES) {
+            adc_digi_output_data_t *p = (adc_digi_output_data_t *)&adc_frame[i];
+            int sensor = sensor_index_from_channel(ADC_GET_CHANNEL(p));
+            if (sensor < 0 || count[sensor] >= n) {
+                continue;
+            }
+            samples[count[sensor] * SENSOR_LENGTH + sensor] = ADC_GET_DATA(p);
+            if (++count[sensor] == n) {
+                complete++;
+            }
+        }
+    }
 
-    *sensor = temp/(float)1000;
+    adc_continuous_stop(adc1_handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ADC capture failed: %s", esp_err_to_name(err));
+    }
+
+    return err;
 }
 
-void get_adc_avarage(sensor_type_t sensor_type, int *sensor, int n) {
-    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+// Fills samples[i * SENSOR_LENGTH + sensor_type] with n samples of every
+// sensor channel, taken in a single DMA burst at sample_freq_hz.
+esp_err_t adc_capture(uint16_t *samples, int n, uint32_t sample_freq_hz) {
+    if (samples == NULL || n <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (sample_freq_hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW || sample_freq_hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    int adc_value = 0;
-    int temp = 0;
+    xSemaphoreTake(adc_capture_lock, portMAX_DELAY);
+    esp_err_t err = adc_capture_locked(samples, n, sample_freq_hz);
+    xSemaphoreGive(adc_capture_lock);
 
-    for (int i = 0; i < n; i++) {
-        vTaskDelay(pdMS_TO_TICKS(100));
-        adc_oneshot_read(adc1_handle, sensor_adc_channels[sensor_type], &temp);
-        adc_value += temp;
+    return err;
+}
+
+// Captures n samples in a single burst and reduces each sensor in sensor_mask
+// to a robust estimate (outliers rejected, trimmed mean), both as a raw code
+// and as a calibrated voltage. The caller must hold the leases of sensor_mask.
+esp_err_t adc_read_sensors(uint32_t sensor_mask, adc_reading_t *readings, int n) {
+    const uint16_t *lut = adc_calibration_get_lut(ADC_UNIT_1, ADC_ATTEN_DB_12);
+
+    if (readings == NULL || n <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!adc_leases_held(sensor_mask)) {
+        ESP_LOGE(TAG, "Reading sensors 0x%" PRIx32 " without holding their leases", sensor_mask);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (n > ADC_CAPTURE_MAX_SAMPLES) {
+        ESP_LOGW(TAG, "Clamping %d samples to %d", n, ADC_CAPTURE_MAX_SAMPLES);
+        n = ADC_CAPTURE_MAX_SAMPLES;
+    }
+
+    xSemaphoreTake(adc_capture_lock, portMAX_DELAY);
+    esp_err_t err = adc_capture_locked(adc_samples, n, ADC_CAPTURE_FREQ_HZ);
+    if (err != ESP_OK) {
+        xSemaphoreGive(adc_capture_lock);
+        return err;
     }
 
-    *sensor = adc_value/n;
+    for (int sensor = 0; sensor < SENSOR_LENGTH; sensor++) {
+        if (!(sensor_mask & ADC_SENSOR_BIT(sensor))) {
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            adc_window[i] = adc_samples[i * SENSOR_LENGTH + sensor];
+        }
+        readings[sensor].raw = sample_filter_robust_mean(adc_window, n, adc_scratch);
+
+        readings[sensor].voltage = 0;
+        if (lut != NULL) {
+            for (int i = 0; i < n; i++) {
+                adc_window[i] = lut[adc_samples[i * SENSOR_LENGTH + sensor] & D_MAX];
+            }
+            readings[sensor].voltage = sample_filter_robust_mean(adc_window, n, adc_scratch)/(float)1000;
+        }
+    }
+    xSemaphoreGive(adc_capture_lock);
+
+    return ESP_OK;
 }
 
-void get_adc_avarage_voltage(sensor_type_t sensor_type, float *sensor, int n) {
-    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+// For probes that drift for a while after being dipped in a solution, such as
+// during calibration: repeats bursts of n samples until their EMA settles
+esp_err_t adc_read_settled_voltage(sensor_type_t sensor_type, float *voltage, int n) {
+    adc_reading_t readings[SENSOR_LENGTH] = {0};
+    sample_ema_t ema;
+    int32_t smoothed_mv = 0;
 
-    int voltage_value = 0;
-    float sum = 0;
-    int temp = 0;
+    sample_ema_init(&ema, ADC_SETTLE_ALPHA_Q16);
+    vTaskDelay(pdMS_TO_TICKS(ADC_SETTLING_TIME_MS));
 
-    adc_calibration_init(ADC_UNIT_1, sensor_adc_map[sensor_type].channel, ADC_ATTEN_DB_12, &sensor_adc_map[sensor_type].cali_handle);
+    for (int burst = 0; burst < ADC_SETTLE_MAX_BURSTS; burst++) {
+        esp_err_t err = adc_read_sensors(ADC_SENSOR_BIT(sensor_type), readings, n);
+        if (err != ESP_OK) {
+            return err;
+        }
 
-    for (int i = 0; i < n; i++) {
-        vTaskDelay(pdMS_TO_TICKS(100));
-        adc_oneshot_read(adc1_handle, sensor_adc_channels[sensor_type], &temp);
-        adc_cali_raw_to_voltage(sensor_adc_map[sensor_type].cali_handle, temp, &voltage_value);
-        sum += voltage_value/(float)1000;
+        int32_t previous_mv = smoothed_mv;
+        smoothed_mv = sample_ema_update(&ema, (int32_t)(readings[sensor_type].voltage * 1000 + 0.5f));
+        if (burst > 0 && abs(smoothed_mv - previous_mv) <= ADC_SETTLE_TOLERANCE_MV) {
+            ESP_LOGI(TAG, "Channel %d settled at %" PRId32 " mV after %d bursts", sensor_adc_channels[sensor_type], smoothed_mv, burst + 1);
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(ADC_SETTLE_INTERVAL_MS));
     }
 
-    adc_calibration_deinit(sensor_adc_map[sensor_type].cali_handle);
+    *voltage = smoothed_mv / (float)1000;
+    return ESP_OK;
+}
+
+void read_adc_value(sensor_type_t sensor_type, int *sensor) {
+    adc_reading_t readings[SENSOR_LENGTH] = {0};
+    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+
+    vTaskDelay(pdMS_TO_TICKS(500));
+    adc_read_sensors(ADC_SENSOR_BIT(sensor_type), readings, 1);
 
-    *sensor = sum/n;
+    *sensor = readings[sensor_type].raw;
 }
 
+void read_adc_voltage(sensor_type_t sensor_type, float *sensor) {
+    adc_reading_t readings[SENSOR_LENGTH] = {0};
+    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+
+    vTaskDelay(pdMS_TO_TICKS(500));
+    adc_read_sensors(ADC_SENSOR_BIT(sensor_type), readings, 1);
 
+    *sensor = readings[sensor_type].voltage;
+}
+
+void get_adc_avarage(sensor_type_t sensor_type, int *sensor, int n) {
+    adc_reading_t readings[SENSOR_LENGTH] = {0};
+    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
 
+    // Give the freshly powered sensor time to settle before the burst
+    vTaskDelay(pdMS_TO_TICKS(ADC_SETTLING_TIME_MS));
+    adc_read_sensors(ADC_SENSOR_BIT(sensor_type), readings, n);
+
+    *sensor = readings[sensor_type].raw;
+}
+
+void get_adc_avarage_voltage(sensor_type_t sensor_type, float *sensor, int n) {
+    adc_reading_t readings[SENSOR_LENGTH] = {0};
+    ESP_LOGI(TAG, "Starting to read the channel %d...", sensor_adc_channels[sensor_type]);
+
+    vTaskDelay(pdMS_TO_TICKS(ADC_SETTLING_TIME_MS));
+    adc_read_sensors(ADC_SENSOR_BIT(sensor_type), readings, n);
+
+    *sensor = readings[sensor_type].voltage;
+}
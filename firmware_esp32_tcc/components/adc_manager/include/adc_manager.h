@@ -1,6 +1,10 @@
 #pragma once
 
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
 #include "sensors_manager.h"
+#include "sample_filter.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 
@@ -8,13 +12,52 @@
 #define D_MAX 4095
 #define SENSOR_LENGTH 4
 
+// Continuous (DMA) acquisition settings
+#define ADC_CAPTURE_FREQ_HZ (20 * 1000)
+#define ADC_CONV_FRAME_SIZE 256
+#define ADC_CAPTURE_MAX_SAMPLES 64
+#define ADC_SETTLING_TIME_MS 100
+
+// adc_read_settled_voltage(): bursts are smoothed with an EMA (alpha in Q16)
+// until it moves less than the tolerance between two bursts
+#define ADC_SETTLE_ALPHA_Q16 (SAMPLE_FILTER_ONE / 4)
+#define ADC_SETTLE_TOLERANCE_MV 2
+#define ADC_SETTLE_INTERVAL_MS 250
+#define ADC_SETTLE_MAX_BURSTS 20
+
+// Session settings
+#define ADC_SESSION_IDLE_TIMEOUT_MS 5000
+#define ADC_SENSOR_BIT(sensor_type) (1U << (sensor_type))
+
+// Calibration registry settings
+#define ADC_CALI_REGISTRY_SIZE 2
+#define ADC_CALI_LUT_SIZE (D_MAX + 1)
+
 typedef struct {
     adc_channel_t channel;
-    adc_cali_handle_t cali_handle;
 } sensor_adc_config_t;
 
-void adc_init(void);
-void adc_deinit(void);
+typedef struct {
+    int raw;
+    float voltage;
+} adc_reading_t;
+
+typedef struct {
+    adc_unit_t unit;
+    adc_atten_t atten;
+    adc_cali_handle_t handle;
+    uint16_t *lut;
+} adc_cali_entry_t;
+
+void adc_manager_init(void);
+esp_err_t adc_session_acquire(uint32_t sensor_mask, TickType_t timeout);
+void adc_session_release(uint32_t sensor_mask);
+esp_err_t adc_calibration_registry_init(void);
+const uint16_t *adc_calibration_get_lut(adc_unit_t unit, adc_atten_t atten);
+void adc_raw_to_mv(const uint16_t *lut, const uint16_t *raw, uint16_t *mv, int n);
+esp_err_t adc_capture(uint16_t *samples, int n, uint32_t sample_freq_hz);
+esp_err_t adc_read_sensors(uint32_t sensor_mask, adc_reading_t *readings, int n);
+esp_err_t adc_read_settled_voltage(sensor_type_t sensor_type, float *voltage, int n);
 void read_adc_value(sensor_type_t sensor_type, int *sensor);
 void read_adc_voltage(sensor_type_t sensor_type, float *sensor);
 void get_adc_avarage(sensor_type_t sensor_type, int *sensor, int n);
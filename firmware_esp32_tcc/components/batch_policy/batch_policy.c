@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <math.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "nvs.h"
+
+#include "batch_policy.h"
+#include "telemetry_log.h"
+#include "mqtt_service.h"
+#include "sleep_manager.h"
+
+const static char *TAG = "batch_policy";
+
+RTC_DATA_ATTR static batch_policy_config_t config = {
+    .upload_every = BATCH_UPLOAD_EVERY_DEFAULT,
+    .temperature_min = NAN,
+    .temperature_max = NAN,
+    .tds_max = NAN,
+    .ph_min = NAN,
+    .ph_max = NAN,
+    .turbidity_max = NAN,
+};
+RTC_DATA_ATTR static bool config_loaded;
+RTC_DATA_ATTR static uint32_t readings_since_upload;
+
+static portMUX_TYPE config_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const struct {
+    const char *key;
+    size_t offset;
+} threshold_keys[] = {
+    {"temperature_min", offsetof(batch_policy_config_t, temperature_min)},
+    {"temperature_max", offsetof(batch_policy_config_t, temperature_max)},
+    {"tds_max", offsetof(batch_policy_config_t, tds_max)},
+    {"ph_min", offsetof(batch_policy_config_t, ph_min)},
+    {"ph_max", offsetof(batch_policy_config_t, ph_max)},
+    {"turbidity_max", offsetof(batch_policy_config_t, turbidity_max)},
+};
+
+static void load_config(void) {
+    batch_policy_config_t stored;
+    size_t len = sizeof(stored);
+    nvs_handle_t handle;
+
+    if (nvs_open(BATCH_POLICY_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, BATCH_POLICY_NVS_KEY, &stored, &len) == ESP_OK && len == sizeof(stored)) {
+        config = stored;
+    }
+    nvs_close(handle);
+}
+
+static esp_err_t store_config(const batch_policy_config_t *new_config) {
+    nvs_handle_t handle;
+
+    esp_err_t err = nvs_open(BATCH_POLICY_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, BATCH_POLICY_NVS_KEY, new_config, sizeof(*new_config));
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    return err;
+}
+
+static void handle_batch_config(const char *data, int len) {
+    char payload[BATCH_POLICY_PAYLOAD_MAX];
+    batch_policy_config_t new_config;
+    char *save, *end;
+
+    batch_policy_get_config(&new_config);
+    snprintf(payload, sizeof(payload), "%.*s", len, data);
+
+    for (char *key = strtok_r(payload, ", \r\n", &save); key; key = strtok_r(NULL, ", \r\n", &save)) {
+        char *value = strchr(key, '=');
+        bool valid = false;
+
+        if (value) {
+            *value++ = '\0';
+            if (strcmp(key, "upload_every") == 0) {
+                long n = strtol(value, &end, 10);
+                valid = *end == '\0' && n >= 1 && n <= BATCH_UPLOAD_EVERY_MAX;
+                new_config.upload_every = n;
+            } else {
+                for (int i = 0; i < sizeof(threshold_keys) / sizeof(threshold_keys[0]); i++) {
+                    if (strcmp(key, threshold_keys[i].key) == 0) {
+                        float threshold = strtof(value, &end);
+                        valid = *end == '\0' && end != value;
+                        *(float *)((uint8_t *)&new_config + threshold_keys[i].offset) = threshold;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (!valid) {
+            ESP_LOGW(TAG, "Invalid batch config entry '%s', nothing changed", key);
+            return;
+        }
+    }
+
+    esp_err_t err = store_config(&new_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store batch config: %s", esp_err_to_name(err));
+    }
+
+    portENTER_CRITICAL(&config_lock);
+    config = new_config;
+    portEXIT_CRITICAL(&config_lock);
+    ESP_LOGI(TAG, "Upload every %" PRIu32 " reading(s)", new_config.upload_every);
+}
+
+// Reads after a wake from deep sleep come from RTC memory
+void batch_policy_init(void) {
+    if (!config_loaded || !sleep_manager_woke_from_sleep()) {
+        load_config();
+        config_loaded = true;
+        readings_since_upload = 0;
+    }
+}
+
+// Must run after mqtt_app_start()
+void batch_policy_register_routes(void) {
+    mqtt_route_add(BATCH_POLICY_COMMAND, handle_batch_config);
+}
+
+static bool below(float value, float threshold) {
+    return !isnan(threshold) && value < threshold;
+}
+
+static bool above(float value, float threshold) {
+    return !isnan(threshold) && value > threshold;
+}
+
+static bool out_of_range(const telemetry_snapshot_t *snapshot, const batch_policy_config_t *cfg) {
+    return ((snapshot->valid & TELEMETRY_HAS_TEMPERATURE) &&
+            (below(snapshot->temperature, cfg->temperature_min) || above(snapshot->temperature, cfg->temperature_max))) ||
+           ((snapshot->valid & TELEMETRY_HAS_TDS) && above(snapshot->tds, cfg->tds_max)) ||
+           ((snapshot->valid & TELEMETRY_HAS_PH) && (below(snapshot->ph, cfg->ph_min) || above(snapshot->ph, cfg->ph_max))) ||
+           ((snapshot->valid & TELEMETRY_HAS_TURBIDITY) && above(snapshot->turbidity, cfg->turbidity_max));
+}
+
+// Decides whether the wake that took this reading needs the network
+bool batch_policy_should_upload(const telemetry_snapshot_t *snapshot) {
+    batch_policy_config_t cfg;
+    const char *reason = NULL;
+
+    batch_policy_get_config(&cfg);
+    readings_since_upload++;
+
+    if (!telemetry_can_batch()) {
+        reason = "no flash log";
+    } else if (snapshot->timestamp == 0) {
+        // Undated readings only wait in RAM, see telemetry_publish()
+        reason = "clock not set";
+    } else if (out_of_range(snapshot, &cfg)) {
+        reason = "threshold breach";
+    } else if (readings_since_upload >= cfg.upload_every) {
+        reason = "upload interval";
+    } else if (telemetry_log_pending() >= TELEMETRY_BATCH_MAX_RECORDS) {
+        reason = "batch full";
+    }
+
+    if (reason == NULL) {
+        ESP_LOGI(TAG, "Reading %" PRIu32 "/%" PRIu32 " kept for the next upload",
+                 readings_since_upload, cfg.upload_every);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Uploading %" PRIu32 " reading(s): %s", telemetry_log_pending(), reason);
+    readings_since_upload = 0;
+    return true;
+}
+
+void batch_policy_get_config(batch_policy_config_t *cfg) {
+    portENTER_CRITICAL(&config_lock);
+    *cfg = config;
+    portEXIT_CRITICAL(&config_lock);
+}
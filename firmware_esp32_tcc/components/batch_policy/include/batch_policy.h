@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "telemetry.h"
+
+// Deep sleep batching: timer wakes store the reading in the flash log and go
+// back to sleep with the radio off. Every upload_every-th wake, a full batch
+// or a reading outside the thresholds brings up Wi-Fi and MQTT, and the log
+// goes out in one batch message.
+#define BATCH_UPLOAD_EVERY_DEFAULT 1
+#define BATCH_UPLOAD_EVERY_MAX TELEMETRY_BATCH_MAX_RECORDS
+
+#define BATCH_POLICY_NVS_NAMESPACE "batch_policy"
+#define BATCH_POLICY_NVS_KEY "config"
+
+// devices/<id>/batch_config, key=value pairs separated by commas, e.g.
+// "upload_every=6,ph_min=6.5,ph_max=9.0". A threshold of nan is disabled.
+#define BATCH_POLICY_COMMAND "batch_config"
+#define BATCH_POLICY_PAYLOAD_MAX 192
+
+typedef struct {
+    uint32_t upload_every;
+    float temperature_min;
+    float temperature_max;
+    float tds_max;
+    float ph_min;
+    float ph_max;
+    float turbidity_max;
+} batch_policy_config_t;
+
+void batch_policy_init(void);
+void batch_policy_register_routes(void);
+bool batch_policy_should_upload(const telemetry_snapshot_t *snapshot);
+void batch_policy_get_config(batch_policy_config_t *config);
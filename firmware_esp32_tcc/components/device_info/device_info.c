@@ -3,21 +3,26 @@
 #include "esp_mac.h"
 #include "esp_ota_ops.h"
 #include <stdio.h>
+#include <string.h>
 
 static char device_id_str[18];
+static uint8_t device_mac[6];
 
 void device_info_init(void) {
-    uint8_t mac[6];
-    esp_efuse_mac_get_default(mac);
+    esp_efuse_mac_get_default(device_mac);
     snprintf(device_id_str, sizeof(device_id_str),
              "%02X:%02X:%02X:%02X:%02X:%02X",
-             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+             device_mac[0], device_mac[1], device_mac[2], device_mac[3], device_mac[4], device_mac[5]);
 }
 
 const char* device_info_get_id(void) {
     return device_id_str;
 }
 
+void device_info_get_mac(uint8_t mac[6]) {
+    memcpy(mac, device_mac, sizeof(device_mac));
+}
+
 const char* get_firmware_version(void) {
     const esp_app_desc_t* desc = esp_ota_get_app_description();
     return desc->version;
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+
 void device_info_init(void);
 const char* device_info_get_id(void);
+void device_info_get_mac(uint8_t mac[6]);
 const char* get_firmware_version(void);
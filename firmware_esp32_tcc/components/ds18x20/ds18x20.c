@@ -42,6 +42,7 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -64,7 +65,14 @@
 #define CHECK(x) do { esp_err_t __; if ((__ = x) != ESP_OK) return __; } while (0)
 #define CHECK_ARG(VAL) do { if (!(VAL)) return ESP_ERR_INVALID_ARG; } while (0)
 
-#if HELPER_TARGET_IS_ESP32
+#if !CONFIG_ONEWIRE_BACKEND_GPIO
+// Only the bit-banged backend depends on the CPU for slot timing. The RMT
+// backend waits on its driver for every transfer, so it must not be called
+// with interrupts masked.
+#define PORT_ENTER_CRITICAL
+#define PORT_EXIT_CRITICAL
+
+#elif HELPER_TARGET_IS_ESP32
 static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
 #define PORT_ENTER_CRITICAL portENTER_CRITICAL(&mux)
 #define PORT_EXIT_CRITICAL portEXIT_CRITICAL(&mux)
@@ -76,32 +84,225 @@ static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
 
 static const char *TAG = "ds18x20";
 
-esp_err_t ds18x20_measure(gpio_num_t pin, onewire_addr_t addr, bool wait)
-{
-    if (!onewire_reset(pin))
-        return ESP_ERR_INVALID_RESPONSE;
+static const uint32_t conversion_time_ms[] = {
+    [DS18X20_RESOLUTION_9_BIT]  = 94,
+    [DS18X20_RESOLUTION_10_BIT] = 188,
+    [DS18X20_RESOLUTION_11_BIT] = 375,
+    [DS18X20_RESOLUTION_12_BIT] = 750,
+};
 
+static void address_device(gpio_num_t pin, onewire_addr_t addr)
+{
     if (addr == DS18X20_ANY)
         onewire_skip_rom(pin);
     else
         onewire_select(pin, addr);
+}
+
+static esp_err_t start_conversion(gpio_num_t pin, onewire_addr_t addr, bool power)
+{
+    if (!onewire_reset(pin))
+        return ESP_ERR_INVALID_RESPONSE;
+
+    address_device(pin, addr);
 
     PORT_ENTER_CRITICAL;
     onewire_write(pin, ds18x20_CONVERT_T);
     // For parasitic devices, power must be applied within 10us after issuing
     // the convert command.
-    onewire_power(pin);
+    if (power)
+        onewire_power(pin);
     PORT_EXIT_CRITICAL;
 
-    if (wait)
+    return ESP_OK;
+}
+
+// Parasite powered devices pull the bus low during the read slot following
+// READ POWER SUPPLY
+static esp_err_t read_power_supply(gpio_num_t pin, onewire_addr_t addr, bool *parasite)
+{
+    if (!onewire_reset(pin))
+        return ESP_ERR_INVALID_RESPONSE;
+
+    address_device(pin, addr);
+    onewire_write(pin, ds18x20_READ_PWRSUPPLY);
+
+    int v = onewire_read(pin);
+    if (v < 0)
+        return ESP_ERR_INVALID_RESPONSE;
+    *parasite = !(v & 0x01);
+
+    return ESP_OK;
+}
+
+// Returns true once the conversion is over, either because the device(s)
+// reported it or because it timed out
+static bool conversion_finished(ds18x20_conversion_t *conv, esp_err_t *err)
+{
+    *err = ESP_OK;
+    if (ds18x20_conversion_done(conv))
+        return true;
+
+    if (esp_timer_get_time() > conv->deadline_us + DS18X20_CONVERSION_MARGIN_MS * 1000LL)
+    {
+        *err = ESP_ERR_TIMEOUT;
+        return true;
+    }
+
+    return false;
+}
+
+static void conversion_poll(void *arg)
+{
+    ds18x20_conversion_t *conv = arg;
+    esp_err_t err;
+
+    if (!conversion_finished(conv, &err))
+        return;
+
+    esp_timer_stop(conv->timer);
+    if (conv->parasite)
+        onewire_depower(conv->pin);
+    conv->cb(conv, err, conv->cb_arg);
+}
+
+uint32_t ds18x20_conversion_time_ms(ds18x20_resolution_t resolution)
+{
+    if (resolution > DS18X20_RESOLUTION_12_BIT)
+        resolution = DS18X20_RESOLUTION_12_BIT;
+    return conversion_time_ms[resolution];
+}
+
+esp_err_t ds18x20_measure_start(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t resolution, ds18x20_conversion_t *conv)
+{
+    CHECK_ARG(conv);
+
+    bool parasite;
+    CHECK(read_power_supply(pin, addr, &parasite));
+    CHECK(start_conversion(pin, addr, parasite));
+
+    conv->pin = pin;
+    conv->addr = addr;
+    conv->parasite = parasite;
+    conv->deadline_us = esp_timer_get_time() + ds18x20_conversion_time_ms(resolution) * 1000LL;
+
+    return ESP_OK;
+}
+
+esp_err_t ds18x20_measure_start_cb(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t resolution,
+        ds18x20_conversion_t *conv, ds18x20_conversion_cb_t cb, void *arg)
+{
+    CHECK_ARG(conv && cb);
+
+    if (!conv->timer)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = conversion_poll,
+            .arg = conv,
+            .name = "ds18x20",
+        };
+        CHECK(esp_timer_create(&timer_args, &conv->timer));
+    }
+    conv->cb = cb;
+    conv->cb_arg = arg;
+
+    CHECK(ds18x20_measure_start(pin, addr, resolution, conv));
+
+    // Nothing to poll on a parasite powered bus
+    if (conv->parasite)
+        return esp_timer_start_once(conv->timer, conv->deadline_us - esp_timer_get_time());
+    return esp_timer_start_periodic(conv->timer, DS18X20_POLL_INTERVAL_MS * 1000);
+}
+
+bool ds18x20_conversion_done(ds18x20_conversion_t *conv)
+{
+    if (conv->parasite)
+        return esp_timer_get_time() >= conv->deadline_us;
+
+    // The device answers read slots with 0 while converting and 1 once done;
+    // the last slot of the byte is the most recent answer.
+    int v = onewire_read(conv->pin);
+    return v >= 0 && (v & 0x80);
+}
+
+esp_err_t ds18x20_wait_conversion(ds18x20_conversion_t *conv)
+{
+    CHECK_ARG(conv);
+
+    esp_err_t err;
+    while (!conversion_finished(conv, &err))
     {
-        SLEEP_MS(750);
-        onewire_depower(pin);
+        int64_t remaining_us = conv->deadline_us - esp_timer_get_time();
+        if (conv->parasite && remaining_us > 0)
+            SLEEP_MS((remaining_us + 999) / 1000);
+        else
+            SLEEP_MS(DS18X20_POLL_INTERVAL_MS);
     }
 
+    if (conv->parasite)
+        onewire_depower(conv->pin);
+
+    return err;
+}
+
+void ds18x20_conversion_release(ds18x20_conversion_t *conv)
+{
+    if (!conv || !conv->timer)
+        return;
+
+    esp_timer_stop(conv->timer);
+    esp_timer_delete(conv->timer);
+    conv->timer = NULL;
+}
+
+esp_err_t ds18x20_get_resolution(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t *resolution)
+{
+    CHECK_ARG(resolution);
+
+    uint8_t scratchpad[8];
+    CHECK(ds18x20_read_scratchpad(pin, addr, scratchpad));
+
+    // Configuration register: 0 R1 R0 1 1 1 1 1
+    *resolution = (ds18x20_resolution_t)((scratchpad[4] >> 5) & 0x03);
+
     return ESP_OK;
 }
 
+esp_err_t ds18x20_set_resolution(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t resolution)
+{
+    CHECK_ARG(resolution <= DS18X20_RESOLUTION_12_BIT);
+
+    uint8_t family = (uint8_t)addr;
+    if (addr != DS18X20_ANY && family != DS18X20_FAMILY_DS18B20 && family != DS18X20_FAMILY_DS1822)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    uint8_t scratchpad[8];
+    CHECK(ds18x20_read_scratchpad(pin, addr, scratchpad));
+
+    uint8_t config = (scratchpad[4] & 0x9f) | (resolution << 5);
+    if (config == scratchpad[4])
+        return ESP_OK;
+
+    // TH and TL are written back unchanged
+    uint8_t data[3] = { scratchpad[2], scratchpad[3], config };
+    CHECK(ds18x20_write_scratchpad(pin, addr, data));
+    CHECK(ds18x20_copy_scratchpad(pin, addr));
+
+    ESP_LOGI(TAG, "Resolution set to %d bits", 9 + resolution);
+
+    return ESP_OK;
+}
+
+esp_err_t ds18x20_measure(gpio_num_t pin, onewire_addr_t addr, bool wait)
+{
+    if (!wait)
+        return start_conversion(pin, addr, true);
+
+    ds18x20_conversion_t conv = { 0 };
+    CHECK(ds18x20_measure_start(pin, addr, DS18X20_RESOLUTION_12_BIT, &conv));
+    return ds18x20_wait_conversion(&conv);
+}
+
 esp_err_t ds18x20_read_scratchpad(gpio_num_t pin, onewire_addr_t addr, uint8_t *buffer)
 {
     CHECK_ARG(buffer);
@@ -118,9 +319,11 @@ esp_err_t ds18x20_read_scratchpad(gpio_num_t pin, onewire_addr_t addr, uint8_t *
         onewire_select(pin, addr);
     onewire_write(pin, ds18x20_READ_SCRATCHPAD);
 
-    for (int i = 0; i < 8; i++)
-        buffer[i] = onewire_read(pin);
-    crc = onewire_read(pin);
+    uint8_t data[9];
+    if (!onewire_read_bytes(pin, data, sizeof(data)))
+        return ESP_ERR_INVALID_RESPONSE;
+    memcpy(buffer, data, 8);
+    crc = data[8];
 
     expected_crc = onewire_crc8(buffer, 8);
     if (crc != expected_crc)
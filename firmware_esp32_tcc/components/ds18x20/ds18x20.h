@@ -45,7 +45,9 @@
 #ifndef __DS18X20_H__
 #define __DS18X20_H__
 
+#include <stdint.h>
 #include <esp_err.h>
+#include <esp_timer.h>
 #include <onewire.h>
 
 #ifdef __cplusplus
@@ -65,6 +67,52 @@ typedef enum {
     DS18X20_FAMILY_MAX31850 = 0x3b, //!< MAX31850        14-bit +/-0.25°C
 } ds18x20_family_id_t;
 
+/** Conversion resolution of DS18B20/DS1822 sensors */
+typedef enum {
+    DS18X20_RESOLUTION_9_BIT  = 0, //!< 0.5°C,    93.75ms
+    DS18X20_RESOLUTION_10_BIT = 1, //!< 0.25°C,   187.5ms
+    DS18X20_RESOLUTION_11_BIT = 2, //!< 0.125°C,  375ms
+    DS18X20_RESOLUTION_12_BIT = 3, //!< 0.0625°C, 750ms
+} ds18x20_resolution_t;
+
+/** Interval between "conversion done" polls, in milliseconds */
+#define DS18X20_POLL_INTERVAL_MS 10
+
+/** Extra time allowed past the datasheet conversion time before giving up */
+#define DS18X20_CONVERSION_MARGIN_MS 50
+
+typedef struct ds18x20_conversion ds18x20_conversion_t;
+
+/**
+ * @brief Called once an asynchronous conversion is over.
+ *
+ * Runs in the esp_timer task, so it should only hand the result over (e.g.
+ * give a semaphore or post to a queue) and return.
+ *
+ * @param conv  The conversion that finished
+ * @param err   `ESP_OK` if the sensor reported completion, `ESP_ERR_TIMEOUT`
+ *              if the deadline plus margin passed first
+ * @param arg   The argument given to ds18x20_measure_start_cb()
+ */
+typedef void (*ds18x20_conversion_cb_t)(ds18x20_conversion_t *conv, esp_err_t err, void *arg);
+
+/**
+ * @brief State of a conversion started by ds18x20_measure_start().
+ *
+ * Zero-initialise it before first use. It may be reused for subsequent
+ * conversions; call ds18x20_conversion_release() when done with it if the
+ * callback variant was used.
+ */
+struct ds18x20_conversion {
+    gpio_num_t pin;
+    onewire_addr_t addr;
+    int64_t deadline_us;     //!< esp_timer time at which the datasheet conversion time elapses
+    bool parasite;           //!< At least one addressed device is parasite powered
+    esp_timer_handle_t timer;
+    ds18x20_conversion_cb_t cb;
+    void *cb_arg;
+};
+
 /**
  * @brief Find the addresses of all ds18x20 devices on the bus.
  *
@@ -92,27 +140,138 @@ esp_err_t ds18x20_scan_devices(gpio_num_t pin, onewire_addr_t *addr_list, size_t
  *
  * This operation can take up to 750ms to complete.
  *
- * If `wait=true`, this routine will automatically drive the pin high for the
- * necessary 750ms after issuing the command to ensure parasitically-powered
- * devices have enough power to perform the conversion operation (for
- * non-parasitically-powered devices, this is not necessary but does not
- * hurt). If `wait=false`, this routine will drive the pin high, but will
- * then return immediately. It is up to the caller to wait the requisite time
- * and then depower the bus using onewire_depower() or by issuing another
- * command once conversion is done.
+ * If `wait=true`, this routine waits for the conversion with
+ * ds18x20_wait_conversion(): externally powered devices are polled and the
+ * call returns as soon as they are done, while parasitically-powered devices
+ * get the pin driven high for the full 750ms. If `wait=false`, this routine
+ * will drive the pin high, but will then return immediately. It is up to the
+ * caller to wait the requisite time and then depower the bus using
+ * onewire_depower() or by issuing another command once conversion is done.
  *
  * @param pin   The GPIO pin connected to the DS18x20 device
  * @param addr  The 64-bit address of the device on the bus. This can be set
  *              to ::DS18X20_ANY to send the command to all devices on the bus
  *              at the same time.
- * @param wait  Whether to wait for the necessary 750ms for the ds18x20 to
- *              finish performing the conversion before returning to the
- *              caller (You will normally want to do this).
+ * @param wait  Whether to wait for the ds18x20 to finish performing the
+ *              conversion before returning to the caller (You will normally
+ *              want to do this).
  *
  * @returns `ESP_OK` if the command was successfully issued
  */
 esp_err_t ds18x20_measure(gpio_num_t pin, onewire_addr_t addr, bool wait);
 
+/**
+ * @brief Start a CONVERT_T operation without waiting for it.
+ *
+ * Fills `conv` with the bus, the addressed device(s) and the deadline after
+ * which the conversion is guaranteed to be over at `resolution`. The
+ * resolution is only used to compute the deadline; configure the sensor with
+ * ds18x20_set_resolution() beforehand.
+ *
+ * Externally powered devices hold the bus low during read time slots while
+ * converting, which ds18x20_conversion_done() uses to detect completion. If
+ * a parasite powered device is addressed the bus is driven high instead and
+ * completion can only be assumed once the deadline has passed.
+ *
+ * @param pin        The GPIO pin connected to the DS18x20 bus
+ * @param addr       The 64-bit address of the device, or ::DS18X20_ANY for
+ *                   all devices on the bus
+ * @param resolution Resolution the addressed device(s) are configured for
+ * @param conv       Conversion state to fill
+ *
+ * @returns `ESP_OK` if the command was successfully issued
+ */
+esp_err_t ds18x20_measure_start(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t resolution, ds18x20_conversion_t *conv);
+
+/**
+ * @brief Same as ds18x20_measure_start(), but call `cb` when it is over.
+ *
+ * The bus is polled every ::DS18X20_POLL_INTERVAL_MS from an esp_timer, so
+ * the callback fires as soon as the sensor is ready. No other transfer may
+ * be started on the bus until the callback has run.
+ *
+ * @param pin        The GPIO pin connected to the DS18x20 bus
+ * @param addr       The 64-bit address of the device, or ::DS18X20_ANY
+ * @param resolution Resolution the addressed device(s) are configured for
+ * @param conv       Conversion state to fill; must stay valid until `cb` runs
+ * @param cb         Completion callback
+ * @param arg        Argument passed to `cb`
+ *
+ * @returns `ESP_OK` if the command was issued and polling started
+ */
+esp_err_t ds18x20_measure_start_cb(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t resolution,
+        ds18x20_conversion_t *conv, ds18x20_conversion_cb_t cb, void *arg);
+
+/**
+ * @brief Check whether a conversion started with ds18x20_measure_start() is over.
+ *
+ * Generates read time slots on the bus for externally powered devices;
+ * only compares the current time against the deadline otherwise.
+ *
+ * @param conv  Conversion state
+ *
+ * @returns `true` if the result can be read
+ */
+bool ds18x20_conversion_done(ds18x20_conversion_t *conv);
+
+/**
+ * @brief Block until a conversion started with ds18x20_measure_start() is over.
+ *
+ * Externally powered devices are polled every ::DS18X20_POLL_INTERVAL_MS;
+ * for parasite powered ones this sleeps until the deadline and then removes
+ * the strong pull-up.
+ *
+ * @param conv  Conversion state
+ *
+ * @returns `ESP_OK` when the result can be read, `ESP_ERR_TIMEOUT` if the
+ *          device did not report completion in time
+ */
+esp_err_t ds18x20_wait_conversion(ds18x20_conversion_t *conv);
+
+/**
+ * @brief Free the resources used by the callback variant.
+ *
+ * @param conv  Conversion state, with no conversion in progress
+ */
+void ds18x20_conversion_release(ds18x20_conversion_t *conv);
+
+/**
+ * @brief Return the worst case conversion time for a resolution.
+ *
+ * @param resolution Sensor resolution
+ *
+ * @returns the conversion time in milliseconds, rounded up
+ */
+uint32_t ds18x20_conversion_time_ms(ds18x20_resolution_t resolution);
+
+/**
+ * @brief Read the configured resolution of a DS18B20/DS1822 sensor.
+ *
+ * @param pin        The GPIO pin connected to the DS18x20 device
+ * @param addr       The 64-bit address of the device
+ * @param resolution The current resolution
+ *
+ * @returns `ESP_OK` if the command was successfully issued
+ */
+esp_err_t ds18x20_get_resolution(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t *resolution);
+
+/**
+ * @brief Set the resolution of a DS18B20/DS1822 sensor.
+ *
+ * The configuration register is only written, and copied to the sensor's
+ * EEPROM, when it differs from the requested value, so this can be called
+ * on every boot without wearing the EEPROM. Alarm thresholds are preserved.
+ *
+ * @param pin        The GPIO pin connected to the DS18x20 device
+ * @param addr       The 64-bit address of the device. ::DS18X20_ANY is only
+ *                   valid with a single device on the bus
+ * @param resolution The requested resolution
+ *
+ * @returns `ESP_OK` if the sensor uses the requested resolution,
+ *          `ESP_ERR_NOT_SUPPORTED` for devices with a fixed resolution
+ */
+esp_err_t ds18x20_set_resolution(gpio_num_t pin, onewire_addr_t addr, ds18x20_resolution_t resolution);
+
 /**
  * @brief Read the value from the last CONVERT_T operation.
  *
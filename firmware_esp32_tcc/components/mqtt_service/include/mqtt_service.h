@@ -1,13 +1,83 @@
 #pragma once
 
+#include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "esp_err.h"
 
 #define MQTT_OTA_EVENT BIT0
-#define MQTT_SEND_DATA_EVENT BIT1
+#define MQTT_CONNECTED_EVENT BIT2
+
+#define MQTT_BROKER_URI "mqtt://192.168.0.110:1883"
+
+// Keep the session on the broker between connections: subscriptions survive
+// and QoS 1 commands sent while the device is offline are delivered on
+// reconnect. Needs a stable client id.
+#define MQTT_PERSISTENT_SESSION 1
+#define MQTT_CLIENT_ID_PREFIX "esp32_"
+#define MQTT_COMMAND_QOS 1
+
+// MQTT 5 transport (CONFIG_MQTT_SERVICE_PROTOCOL_V5). Telemetry topics are sent
+// as topic aliases after their first publish on a connection (the broker must
+// accept MQTT5_TOPIC_ALIASES of them, mosquitto allows 10 by default), all
+// commands arrive through one devices/<id>/# subscription and payload schema
+// versions travel as a "schema" user property.
+#define MQTT5_TOPIC_ALIASES 7
+#define MQTT5_SESSION_EXPIRY_S (24 * 3600)
+
+#define MQTT_TOPIC_MAX_LEN 64
+// Hash table slots for command topics, a power of two
+#define MQTT_ROUTER_SIZE 16
+
+// Publish pipeline: QoS 1 messages are copied to the outbox without
+// blocking, and dropped once the window or the outbox limit is reached
+#define MQTT_INFLIGHT_WINDOW 8
+#define MQTT_OUTBOX_LIMIT_BYTES (8 * 1024)
+#define MQTT_MESSAGE_MAX 256
+
+// Topics of this device, built once by mqtt_app_start()
+typedef enum {
+    MQTT_TOPIC_STATUS,
+    MQTT_TOPIC_PH_CALIBRATION_RESPONSE,
+    MQTT_TOPIC_TDS_CALIBRATION_RESPONSE,
+    MQTT_TOPIC_PROBES_RESPONSE,
+    MQTT_TOPIC_SNAPSHOT,
+    MQTT_TOPIC_SNAPSHOT_BIN,
+    MQTT_TOPIC_SNAPSHOT_BATCH,
+    MQTT_TOPIC_TEMPERATURE,
+    MQTT_TOPIC_TDS,
+    MQTT_TOPIC_PH,
+    MQTT_TOPIC_TURBIDITY,
+    MQTT_TOPIC_COUNT
+} mqtt_topic_id_t;
+
+typedef struct {
+    uint32_t enqueued;
+    uint32_t acked;
+    uint32_t dropped;
+    uint32_t inflight;
+    uint32_t inflight_max;
+    int outbox_bytes;
+    int64_t first_publish_us;   // from reset to the first acknowledged publish
+} mqtt_publish_stats_t;
+
+// Called from the MQTT task with the payload of a routed topic, must not block
+typedef void (*mqtt_route_handler_t)(const char *data, int len);
+
+// Called from the MQTT task when the broker acknowledges a QoS 1 publish
+typedef void (*mqtt_published_handler_t)(int msg_id);
 
 extern char ota_url[256];
 
 void mqtt_app_start(void);
+esp_err_t mqtt_route_add(const char *command, mqtt_route_handler_t handler);
+const char *mqtt_topic(mqtt_topic_id_t id);
+int mqtt_publish_topic(mqtt_topic_id_t id, const void *data, int len);
+int mqtt_publishf(mqtt_topic_id_t id, const char *format, ...) __attribute__((format(printf, 2, 3)));
 void mqtt_publish(const char *topic, const char *message);
+int mqtt_publish_data(const char *topic, const void *data, int len);
+void mqtt_get_publish_stats(mqtt_publish_stats_t *stats);
+esp_err_t mqtt_topic_set_schema(mqtt_topic_id_t id, int version);
+void mqtt_set_published_handler(mqtt_published_handler_t handler);
 EventBits_t mqtt_event_get_bits(void);
+EventBits_t mqtt_event_wait_bits(EventBits_t bits, TickType_t timeout);
 void mqtt_event_clear_bits(EventBits_t bit);
@@ -1,64 +1,373 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_bit_defs.h"
 #include "esp_event.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
 #include "esp_mac.h"
 #include "esp_wifi.h"
+#include "esp_netif.h"
 
 #include "mqtt_service.h"
 #include "device_info.h"
 #include "sensors_manager.h"
+#include "wifi_manager.h"
+#include "pm_policy.h"
+#if CONFIG_MQTT_SERVICE_TLS && CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#define MQTT_TLS_SESSION_TICKETS 1
+#include "mqtt_tls.h"
+#endif
 
 static const char *TAG = "mqtt";
 
 static EventGroupHandle_t mqtt_event_group;
 static esp_mqtt_client_handle_t client;
+static mqtt_published_handler_t published_handler;
+
+typedef struct {
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int topic_len;
+    uint32_t hash;
+    mqtt_route_handler_t handler;
+} mqtt_route_t;
+
+// Open addressing, kept at most half full so probes stay short
+static mqtt_route_t routes[MQTT_ROUTER_SIZE];
+static int route_count;
+
+static const struct {
+    const char *prefix;
+    const char *name;
+    bool alias;     // recurring telemetry, sent as a topic alias with MQTT 5
+} topic_formats[MQTT_TOPIC_COUNT] = {
+    [MQTT_TOPIC_STATUS] = {"devices", "status", false},
+    [MQTT_TOPIC_PH_CALIBRATION_RESPONSE] = {"devices", "ph_calibration_response", false},
+    [MQTT_TOPIC_TDS_CALIBRATION_RESPONSE] = {"devices", "tds_calibration_response", false},
+    [MQTT_TOPIC_PROBES_RESPONSE] = {"devices", "rescan_probes_response", false},
+    [MQTT_TOPIC_SNAPSHOT] = {"sensors", "snapshot", true},
+    [MQTT_TOPIC_SNAPSHOT_BIN] = {"sensors", "snapshot/bin", true},
+    [MQTT_TOPIC_SNAPSHOT_BATCH] = {"sensors", "snapshot/batch", true},
+    [MQTT_TOPIC_TEMPERATURE] = {"sensors", "temperature", true},
+    [MQTT_TOPIC_TDS] = {"sensors", "tds", true},
+    [MQTT_TOPIC_PH] = {"sensors", "ph", true},
+    [MQTT_TOPIC_TURBIDITY] = {"sensors", "turbidity", true},
+};
+static char topics[MQTT_TOPIC_COUNT][MQTT_TOPIC_MAX_LEN];
+
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+
+static char command_filter[MQTT_TOPIC_MAX_LEN];
+static uint16_t topic_aliases[MQTT_TOPIC_COUNT];
+static mqtt5_user_property_handle_t topic_properties[MQTT_TOPIC_COUNT];
+// Aliases announced on the current connection, the broker forgets them on disconnect
+static volatile uint32_t aliases_sent;
+// Publish properties apply to the next publish of the client, so setting them
+// and enqueueing happen under this mutex
+static SemaphoreHandle_t publish_mutex;
+static volatile bool status_pending;
+#endif
+
+// Formatted messages are built here and copied by the outbox
+static char message_arena[MQTT_MESSAGE_MAX];
+static SemaphoreHandle_t arena_mutex;
+
+static portMUX_TYPE publish_lock = portMUX_INITIALIZER_UNLOCKED;
+static mqtt_publish_stats_t publish_stats;
+static bool client_started;
+
+#if CONFIG_MQTT_SERVICE_TLS
+extern const char broker_ca_pem_start[] asm("_binary_ca_pem_start");
+#endif
 
 char ota_url[256];
-char status_topic[64];
 char status_message[64];
+static char client_id[32];
+// Routes the broker session already holds, kept across deep sleep but not a
+// reset, so a new firmware always subscribes again
+RTC_DATA_ATTR static int subscribed_routes;
 const char* device_id_str;
 const char* firmware_version;
 
+// FNV-1a, over the topic bytes as they arrive (not NUL terminated)
+static uint32_t topic_hash(const char *topic, int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static mqtt_route_t *route_find(const char *topic, int len)
+{
+    uint32_t hash = topic_hash(topic, len);
+
+    for (int i = 0; i < MQTT_ROUTER_SIZE; i++) {
+        mqtt_route_t *route = &routes[(hash + i) & (MQTT_ROUTER_SIZE - 1)];
+        if (route->handler == NULL) {
+            return NULL;
+        }
+        if (route->hash == hash && route->topic_len == len && memcmp(route->topic, topic, len) == 0) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+// Subscribes to devices/<id>/<command> and dispatches its messages to handler,
+// also after every reconnect
+esp_err_t mqtt_route_add(const char *command, mqtt_route_handler_t handler)
+{
+    char topic[MQTT_TOPIC_MAX_LEN];
+    int len = snprintf(topic, sizeof(topic), "devices/%s/%s", device_id_str, command);
+
+    if (len <= 0 || len >= sizeof(topic)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (route_count >= MQTT_ROUTER_SIZE / 2) {
+        ESP_LOGE(TAG, "Router full, cannot route %s", topic);
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint32_t hash = topic_hash(topic, len);
+    for (int i = 0; i < MQTT_ROUTER_SIZE; i++) {
+        mqtt_route_t *route = &routes[(hash + i) & (MQTT_ROUTER_SIZE - 1)];
+        if (route->handler == NULL) {
+            memcpy(route->topic, topic, len + 1);
+            route->topic_len = len;
+            route->hash = hash;
+            route->handler = handler;
+            route_count++;
+            break;
+        }
+    }
+
+#if !CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    if (mqtt_event_group && (xEventGroupGetBits(mqtt_event_group) & MQTT_CONNECTED_EVENT)) {
+        esp_mqtt_client_subscribe(client, topic, MQTT_COMMAND_QOS);
+        subscribed_routes = route_count;
+    }
+#endif
+    return ESP_OK;
+}
+
+static void subscribe_routes(esp_mqtt_client_handle_t client)
+{
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    // No Local keeps our own status and responses from coming back through
+    // the wildcard, and retained messages are not replayed
+    const esp_mqtt5_subscribe_property_config_t property = {
+        .no_local_flag = true,
+        .retain_handle = 2,
+    };
+    esp_mqtt5_client_set_subscribe_property(client, &property);
+    esp_mqtt_client_subscribe(client, command_filter, MQTT_COMMAND_QOS);
+    ESP_LOGI(TAG, "Subscribed to topic %s", command_filter);
+#else
+    for (int i = 0; i < MQTT_ROUTER_SIZE; i++) {
+        if (routes[i].handler) {
+            esp_mqtt_client_subscribe(client, routes[i].topic, MQTT_COMMAND_QOS);
+            ESP_LOGI(TAG, "Subscribed to topic %s", routes[i].topic);
+        }
+    }
+#endif
+    subscribed_routes = route_count;
+}
+
+static void publish_done(void)
+{
+    portENTER_CRITICAL(&publish_lock);
+    if (publish_stats.inflight > 0) {
+        publish_stats.inflight--;
+    }
+    portEXIT_CRITICAL(&publish_lock);
+}
+
+// Copies the message into the outbox, the MQTT task sends it. Returns the
+// message id, or -1 if it was dropped.
+static int enqueue(const char *topic, const char *data, int len)
+{
+    int outbox_bytes = esp_mqtt_client_get_outbox_size(client);
+    bool room;
+    int msg_id;
+
+    portENTER_CRITICAL(&publish_lock);
+    room = publish_stats.inflight < MQTT_INFLIGHT_WINDOW && outbox_bytes < MQTT_OUTBOX_LIMIT_BYTES;
+    if (room) {
+        publish_stats.inflight++;
+    } else {
+        publish_stats.dropped++;
+    }
+    portEXIT_CRITICAL(&publish_lock);
+
+    if (!room) {
+        ESP_LOGW(TAG, "Dropped message to %s, %" PRIu32 " in flight, outbox %d bytes",
+                 topic, publish_stats.inflight, outbox_bytes);
+        return -1;
+    }
+
+    msg_id = esp_mqtt_client_enqueue(client, topic, data, len, 1, 0, true);
+
+    portENTER_CRITICAL(&publish_lock);
+    if (msg_id < 0) {
+        publish_stats.inflight--;
+        publish_stats.dropped++;
+    } else {
+        publish_stats.enqueued++;
+        publish_stats.inflight_max = MAX(publish_stats.inflight_max, publish_stats.inflight);
+    }
+    portEXIT_CRITICAL(&publish_lock);
+
+    return msg_id;
+}
+
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+// Must be called with publish_mutex held
+static int enqueue_with_properties(int id, const char *topic, const char *data, int len)
+{
+    esp_mqtt5_publish_property_config_t property = {0};
+    int msg_id;
+
+    if (id >= 0) {
+        property.topic_alias = topic_aliases[id];
+        property.user_property = topic_properties[id];
+        // Once announced on this connection the alias stands for the topic
+        if (property.topic_alias && (aliases_sent & BIT(id))) {
+            topic = "";
+        }
+    }
+
+    esp_mqtt5_client_set_publish_property(client, &property);
+    msg_id = enqueue(topic, data, len);
+    if (msg_id >= 0 && property.topic_alias) {
+        aliases_sent |= BIT(id);
+    }
+    return msg_id;
+}
+#endif
+
+// id is a mqtt_topic_id_t, or -1 for a topic outside the table
+static int publish(int id, const char *topic, const char *data, int len)
+{
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    int msg_id;
+
+    xSemaphoreTake(publish_mutex, portMAX_DELAY);
+    msg_id = enqueue_with_properties(id, topic, data, len);
+    if (status_pending) {
+        status_pending = false;
+        enqueue_with_properties(MQTT_TOPIC_STATUS, topics[MQTT_TOPIC_STATUS], status_message, 0);
+    }
+    xSemaphoreGive(publish_mutex);
+
+    return msg_id;
+#else
+    return enqueue(topic, data, len);
+#endif
+}
+
+// Runs in the MQTT task
+static void publish_status(void)
+{
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    // The MQTT task holds the client lock here and must not wait for a task
+    // that set its properties but has not enqueued yet. That task sends the
+    // status when it releases the mutex.
+    if (xSemaphoreTake(publish_mutex, 0) != pdTRUE) {
+        status_pending = true;
+        return;
+    }
+    enqueue_with_properties(MQTT_TOPIC_STATUS, topics[MQTT_TOPIC_STATUS], status_message, 0);
+    xSemaphoreGive(publish_mutex);
+#else
+    enqueue(topics[MQTT_TOPIC_STATUS], status_message, 0);
+#endif
+}
+
+static float parse_float(const char *data, int len)
+{
+    char data_str[32];
+
+    snprintf(data_str, sizeof(data_str), "%.*s", len, data);
+    return atof(data_str);
+}
+
+static void handle_firmware_update(const char *data, int len)
+{
+    snprintf(ota_url, sizeof(ota_url), "%.*s", len, data);
+    xEventGroupSetBits(mqtt_event_group, MQTT_OTA_EVENT);
+}
+
+static void handle_send_data(const char *data, int len)
+{
+    sensors_request_measurement();
+}
+
+static void handle_ph_calibration(const char *data, int len)
+{
+    sensors_command_submit(SENSORS_COMMAND_PH_CALIBRATION, parse_float(data, len));
+}
+
+static void handle_tds_calibration(const char *data, int len)
+{
+    sensors_command_submit(SENSORS_COMMAND_TDS_CALIBRATION, parse_float(data, len));
+}
+
+static void handle_rescan_probes(const char *data, int len)
+{
+    sensors_command_submit(SENSORS_COMMAND_RESCAN_PROBES, 0);
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32, base, event_id);
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
-    static char firmware_update_topic[64];
-    static char send_data_topic[64];
-    static char ph_calibration_topic[64];
-    static char tds_calibration_topic[64];
-    // Sensor calibration
-    static float ph_expected_value, tds_expected_value;
+    mqtt_route_t *route;
+    bool first_publish;
     switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        // The TLS handshake is the most CPU intensive part of a connect
+        pm_policy_boost(PM_PHASE_MQTT_CONNECT);
+        break;
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        pm_policy_unboost(PM_PHASE_MQTT_CONNECT);
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+        aliases_sent = 0;
+#endif
+        xEventGroupSetBits(mqtt_event_group, MQTT_CONNECTED_EVENT);
         snprintf(status_message, sizeof(status_message), "{\"status\": \"1\", \"firmware_version\": \"%s\"}", firmware_version);
-        esp_mqtt_client_publish(client, status_topic, status_message, 0, 1, 0);
-        ESP_LOGI(TAG, "Published LWT status to topic='%s'", status_topic);
-
-        snprintf(ph_calibration_topic, sizeof(ph_calibration_topic), "devices/%s/ph_calibration", device_id_str);
-        esp_mqtt_client_subscribe(client, ph_calibration_topic, 0);
-        ESP_LOGI(TAG, "Subscribed to topic %s", ph_calibration_topic);
-
-        snprintf(tds_calibration_topic, sizeof(tds_calibration_topic), "devices/%s/tds_calibration", device_id_str);
-        esp_mqtt_client_subscribe(client, tds_calibration_topic, 0);
-        ESP_LOGI(TAG, "Subscribed to topic %s", tds_calibration_topic);
-
-        snprintf(send_data_topic, sizeof(send_data_topic), "devices/%s/send_data", device_id_str);
-        esp_mqtt_client_subscribe(client, send_data_topic, 0);
-        ESP_LOGI(TAG, "Subscribed to topic %s", send_data_topic);
-
-        snprintf(firmware_update_topic, sizeof(firmware_update_topic), "devices/%s/firmware_update", device_id_str);
-        esp_mqtt_client_subscribe(client, firmware_update_topic, 0);
-        ESP_LOGI(TAG, "Subscribed to topic %s", firmware_update_topic);
+        publish_status();
+        ESP_LOGI(TAG, "Published LWT status to topic='%s'", topics[MQTT_TOPIC_STATUS]);
 
+        // The broker kept our subscriptions, skip the round trips
+        if (event->session_present && subscribed_routes == route_count) {
+            ESP_LOGI(TAG, "Resumed persistent session");
+        } else {
+            subscribe_routes(client);
+        }
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        pm_policy_unboost(PM_PHASE_MQTT_CONNECT);
+        xEventGroupClearBits(mqtt_event_group, MQTT_CONNECTED_EVENT);
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+        // Messages queued while offline carry the full topic again
+        aliases_sent = 0;
+#endif
         break;
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -68,32 +377,39 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         break;
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        publish_done();
+        portENTER_CRITICAL(&publish_lock);
+        publish_stats.acked++;
+        first_publish = publish_stats.first_publish_us == 0;
+        if (first_publish) {
+            publish_stats.first_publish_us = esp_timer_get_time();
+        }
+        portEXIT_CRITICAL(&publish_lock);
+        if (first_publish) {
+            ESP_LOGI(TAG, "First publish acknowledged %d ms after reset",
+                     (int)(publish_stats.first_publish_us / 1000));
+        }
+        if (published_handler) {
+            published_handler(event->msg_id);
+        }
+        break;
+    case MQTT_EVENT_DELETED:
+        // Expired in the outbox without being acknowledged
+        ESP_LOGW(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+        publish_done();
+        portENTER_CRITICAL(&publish_lock);
+        publish_stats.dropped++;
+        portEXIT_CRITICAL(&publish_lock);
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
-        if (strncmp(event->topic, firmware_update_topic, event->topic_len) == 0) {
-            xEventGroupSetBits(mqtt_event_group, MQTT_OTA_EVENT);
-            strncpy(ota_url, event->data, event->data_len);
-        }
-
-        if (strncmp(event->topic, send_data_topic, event->topic_len) == 0) {
-            xEventGroupSetBits(mqtt_event_group, MQTT_SEND_DATA_EVENT);
-        }
-
-        if (strncmp(event->topic, ph_calibration_topic, event->topic_len) == 0) {
-            char data_str[32] = {0};
-            snprintf(data_str, sizeof(data_str), "%.*s", event->data_len, event->data);
-            ph_expected_value = atof(data_str);
-            init_calibrate_ph_task(&ph_expected_value);
-        }
-
-        if (strncmp(event->topic, tds_calibration_topic, event->topic_len) == 0) {
-            char data_str[32] = {0};
-            snprintf(data_str, sizeof(data_str), "%.*s", event->data_len, event->data);
-            tds_expected_value = atof(data_str);
-            init_calibrate_tds_task(&tds_expected_value);
+        route = route_find(event->topic, event->topic_len);
+        if (route) {
+            route->handler(event->data, event->data_len);
+        } else {
+            ESP_LOGW(TAG, "No route for topic %.*s", event->topic_len, event->topic);
         }
         break;
     case MQTT_EVENT_ERROR:
@@ -115,44 +431,168 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     }
 }
 
+static void start_client(void)
+{
+    bool started;
+
+    portENTER_CRITICAL(&publish_lock);
+    started = client_started;
+    client_started = true;
+    portEXIT_CRITICAL(&publish_lock);
+
+    if (!started) {
+        esp_mqtt_client_start(client);
+    } else {
+        // Back on the network, skip what is left of the reconnect timeout
+        esp_mqtt_client_reconnect(client);
+    }
+}
+
+static void ip_event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    start_client();
+}
+
+// Messages published before the broker is reached wait in the outbox
 void mqtt_app_start(void)
 {
     device_id_str = device_info_get_id();
     firmware_version = get_firmware_version();
     
-    snprintf(status_topic, sizeof(status_topic), "devices/%s/status", device_id_str);
+    for (int i = 0; i < MQTT_TOPIC_COUNT; i++) {
+        snprintf(topics[i], sizeof(topics[i]), "%s/%s/%s", topic_formats[i].prefix, device_id_str, topic_formats[i].name);
+    }
     snprintf(status_message, sizeof(status_message), "{\"status\": \"0\", \"firmware_version\": \"%s\"}", firmware_version);
 
+    snprintf(client_id, sizeof(client_id), MQTT_CLIENT_ID_PREFIX "%s", device_id_str);
+
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    uint16_t alias = 0;
+    for (int i = 0; i < MQTT_TOPIC_COUNT; i++) {
+        if (topic_formats[i].alias && alias < MQTT5_TOPIC_ALIASES) {
+            topic_aliases[i] = ++alias;
+        }
+    }
+    snprintf(command_filter, sizeof(command_filter), "devices/%s/#", device_id_str);
+    publish_mutex = xSemaphoreCreateMutex();
+#endif
+
     const esp_mqtt_client_config_t mqtt_cfg = {
         .broker = {
-            .address.uri = "mqtt://192.168.0.110:1883",
+#if CONFIG_MQTT_SERVICE_TLS
+            .address.uri = CONFIG_MQTT_SERVICE_TLS_URI,
+            .verification.certificate = broker_ca_pem_start,
+#else
+            .address.uri = MQTT_BROKER_URI,
+#endif
         },
+        .credentials = {
+            .client_id = client_id,
+            // .username = "usuario",
+            // .authentication = {
+            //     .password = "senha"
+            // }
+        },
+#if MQTT_TLS_SESSION_TICKETS
+        // esp-mqtt's own SSL transport has no way to reuse a session.
+        // Left NULL when out of memory, esp-mqtt then picks its own.
+        .network.transport = mqtt_tls_transport_init(broker_ca_pem_start),
+#endif
         .session = {
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+            .protocol_ver = MQTT_PROTOCOL_V_5,
+#endif
+            .disable_clean_session = MQTT_PERSISTENT_SESSION,
             .last_will = {
-                .topic = status_topic,
+                .topic = topics[MQTT_TOPIC_STATUS],
                 .msg = status_message,
                 .qos = 1,
                 .retain = 1
             }
         }
-        // .credentials = {
-        //     .username = "usuario",
-        //     .authentication = {
-        //         .password = "senha"
-        //     }
-        // }
     };
 
     mqtt_event_group = xEventGroupCreate();
+    arena_mutex = xSemaphoreCreateMutex();
+
+    mqtt_route_add("ph_calibration", handle_ph_calibration);
+    mqtt_route_add("tds_calibration", handle_tds_calibration);
+    mqtt_route_add("send_data", handle_send_data);
+    mqtt_route_add("rescan_probes", handle_rescan_probes);
+    mqtt_route_add("firmware_update", handle_firmware_update);
 
     client = esp_mqtt_client_init(&mqtt_cfg);
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    // Without an expiry interval an MQTT 5 broker drops the session on disconnect
+    const esp_mqtt5_connection_property_config_t connect_property = {
+        .session_expiry_interval = MQTT_PERSISTENT_SESSION ? MQTT5_SESSION_EXPIRY_S : 0,
+    };
+    esp_mqtt5_client_set_connect_property(client, &connect_property);
+#endif
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
-    esp_mqtt_client_start(client);
+
+    // Connecting before there is an IP would only push the first attempt
+    // back by the reconnect timeout
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_event_handler, NULL));
+    if (is_wifi_connected()) {
+        start_client();
+    }
+}
+
+const char *mqtt_topic(mqtt_topic_id_t id)
+{
+    return topics[id];
+}
+
+// A len of 0 publishes data as a NUL-terminated string.
+// Returns the message id, or -1 if the message was dropped.
+int mqtt_publish_topic(mqtt_topic_id_t id, const void *data, int len)
+{
+    ESP_LOGI(TAG, "Sending message to topic %s.", topics[id]);
+    return publish(id, topics[id], data, len);
+}
+
+int mqtt_publishf(mqtt_topic_id_t id, const char *format, ...)
+{
+    va_list args;
+    int msg_id = -1;
+
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    va_start(args, format);
+    int len = vsnprintf(message_arena, sizeof(message_arena), format, args);
+    va_end(args);
+    if (len > 0 && len < sizeof(message_arena)) {
+        msg_id = mqtt_publish_topic(id, message_arena, len);
+    } else {
+        ESP_LOGE(TAG, "Message to %s does not fit in %d bytes", topics[id], MQTT_MESSAGE_MAX);
+    }
+    xSemaphoreGive(arena_mutex);
+
+    return msg_id;
 }
 
 void mqtt_publish(const char *topic, const char *message) {
     ESP_LOGI(TAG, "Sending message to topic %s.", topic);
-    esp_mqtt_client_publish(client, topic, message, 0, 1, 0);
+    publish(-1, topic, message, 0);
+}
+
+// Returns the message id, or -1 if the message was dropped
+int mqtt_publish_data(const char *topic, const void *data, int len) {
+    ESP_LOGI(TAG, "Sending %d bytes to topic %s.", len, topic);
+    return publish(-1, topic, data, len);
+}
+
+void mqtt_get_publish_stats(mqtt_publish_stats_t *stats)
+{
+    portENTER_CRITICAL(&publish_lock);
+    *stats = publish_stats;
+    portEXIT_CRITICAL(&publish_lock);
+    stats->outbox_bytes = esp_mqtt_client_get_outbox_size(client);
+}
+
+void mqtt_set_published_handler(mqtt_published_handler_t handler)
+{
+    published_handler = handler;
 }
 
 EventBits_t mqtt_event_get_bits(void)
@@ -160,7 +600,27 @@ EventBits_t mqtt_event_get_bits(void)
     return xEventGroupGetBits(mqtt_event_group);
 }
 
+// Waits for all of the given bits without clearing them
+EventBits_t mqtt_event_wait_bits(EventBits_t bits, TickType_t timeout)
+{
+    return xEventGroupWaitBits(mqtt_event_group, bits, pdFALSE, pdTRUE, timeout);
+}
+
 void mqtt_event_clear_bits(EventBits_t bit)
 {
     xEventGroupClearBits(mqtt_event_group, bit);
-}
\ No newline at end of file
+}
+
+// Tags every message on the topic with a "schema" user property (MQTT 5 only)
+esp_err_t mqtt_topic_set_schema(mqtt_topic_id_t id, int version)
+{
+#if CONFIG_MQTT_SERVICE_PROTOCOL_V5
+    char value[12];
+    esp_mqtt5_user_property_item_t item = {"schema", value};
+
+    snprintf(value, sizeof(value), "%d", version);
+    return esp_mqtt5_client_set_user_property(&topic_properties[id], &item, 1);
+#else
+    return ESP_OK;
+#endif
+}
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_tls.h"
+#include "esp_transport.h"
+
+#include "mqtt_tls.h"
+
+#if !CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#error "mqtt_tls needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS"
+#endif
+
+const static char *TAG = "mqtt_tls";
+
+typedef struct {
+    const char *ca_pem;
+    esp_tls_t *tls;
+    int sockfd;
+} mqtt_tls_t;
+
+// Only the MQTT task connects and closes, so no lock. Kept in RAM: after
+// deep sleep the first connect is a full handshake again.
+static esp_tls_client_session_t *session;
+
+static void save_session(esp_tls_t *tls)
+{
+    esp_tls_client_session_t *latest = esp_tls_get_client_session(tls);
+
+    // NULL when the handshake never completed, keep the previous ticket
+    if (latest == NULL) {
+        return;
+    }
+    if (session) {
+        esp_tls_free_client_session(session);
+    }
+    session = latest;
+}
+
+static void drop_session(void)
+{
+    if (session) {
+        esp_tls_free_client_session(session);
+        session = NULL;
+    }
+}
+
+static int tls_poll(mqtt_tls_t *ctx, bool write, int timeout_ms)
+{
+    fd_set fds;
+    struct timeval timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    // Records already decrypted by mbedTLS never show up on the socket
+    if (!write && esp_tls_get_bytes_avail(ctx->tls) > 0) {
+        return 1;
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(ctx->sockfd, &fds);
+    return select(ctx->sockfd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, timeout_ms < 0 ? NULL : &timeout);
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+
+    return ctx->tls ? tls_poll(ctx, false, timeout_ms) : -1;
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+
+    return ctx->tls ? tls_poll(ctx, true, timeout_ms) : -1;
+}
+
+static int tls_close(esp_transport_handle_t t)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+
+    if (ctx->tls == NULL) {
+        return 0;
+    }
+    // Read here rather than after the handshake: TLS 1.3 brokers only send
+    // the ticket once the connection is up
+    save_session(ctx->tls);
+    esp_tls_conn_destroy(ctx->tls);
+    ctx->tls = NULL;
+    return 0;
+}
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = (const unsigned char *)ctx->ca_pem,
+        .cacert_bytes = strlen(ctx->ca_pem) + 1,
+        .timeout_ms = timeout_ms,
+        .client_session = session,
+    };
+
+    tls_close(t);
+    ctx->tls = esp_tls_init();
+    if (ctx->tls == NULL) {
+        return -1;
+    }
+
+    ESP_LOGD(TAG, "Connecting to %s:%d%s", host, port, session ? " with a session ticket" : "");
+    if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, ctx->tls) != 1) {
+        ESP_LOGW(TAG, "TLS connection to %s:%d failed", host, port);
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+        // Costs one full handshake if the ticket was fine, but never offers
+        // a ticket the broker keeps refusing
+        drop_session();
+        return -1;
+    }
+    esp_tls_get_conn_sockfd(ctx->tls, &ctx->sockfd);
+    save_session(ctx->tls);
+    return 0;
+}
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    int ret = tls_poll_read(t, timeout_ms);
+
+    if (ret <= 0) {
+        return ret == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    ret = esp_tls_conn_read(ctx->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ret;
+}
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+    int ret = tls_poll_write(t, timeout_ms);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    ret = esp_tls_conn_write(ctx->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return 0;
+    }
+    return ret < 0 ? -1 : ret;
+}
+
+static int tls_destroy(esp_transport_handle_t t)
+{
+    mqtt_tls_t *ctx = esp_transport_get_context_data(t);
+
+    tls_close(t);
+    free(ctx);
+    return 0;
+}
+
+esp_transport_handle_t mqtt_tls_transport_init(const char *ca_pem)
+{
+    mqtt_tls_t *ctx = calloc(1, sizeof(*ctx));
+    esp_transport_handle_t t = esp_transport_init();
+
+    if (ctx == NULL || t == NULL) {
+        free(ctx);
+        if (t) {
+            esp_transport_destroy(t);
+        }
+        return NULL;
+    }
+
+    ctx->ca_pem = ca_pem;
+    esp_transport_set_context_data(t, ctx);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write, tls_destroy);
+    esp_transport_set_default_port(t, 8883);
+    return t;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "esp_transport.h"
+
+// esp-mqtt transport over esp-tls that keeps the broker's session ticket and
+// offers it on the next connect, so a reconnect resumes the TLS session
+// instead of repeating the certificate exchange. NULL if out of memory.
+esp_transport_handle_t mqtt_tls_transport_init(const char *ca_pem);
@@ -0,0 +1,45 @@
+#include <stdio.h>
+
+#include "onewire_sim.h"
+#include "ds18x20.h"
+
+#define PIN 4
+
+// Bus cost of a full search and of a measure and read cycle as the bus grows,
+// in modeled standard speed time
+static onewire_addr_t addrs[ONEWIRE_SIM_MAX_DEVICES];
+static float temps[ONEWIRE_SIM_MAX_DEVICES];
+
+static void report(const char *what, int devices, esp_err_t err)
+{
+    onewire_sim_stats_t stats;
+
+    onewire_sim_get_stats(&stats);
+    printf("%-8s %7d %7u %7u %10.1f %s\n", what, devices, stats.resets, stats.slots,
+           stats.bus_time_us / 1000.0, err == ESP_OK ? "" : esp_err_to_name(err));
+    onewire_sim_clear_stats();
+}
+
+int main(void)
+{
+    const int sizes[] = { 1, 4, 16, ONEWIRE_SIM_MAX_DEVICES };
+
+    printf("%-8s %7s %7s %7s %10s\n", "cycle", "probes", "resets", "slots", "bus ms");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t found;
+        esp_err_t err;
+
+        onewire_sim_reset();
+        for (int i = 0; i < sizes[s]; i++)
+            onewire_sim_add_device(DS18X20_FAMILY_DS18B20, 0x1000 + i * 0x1d, 20.0f + i * 0.0625f);
+
+        err = ds18x20_scan_devices(PIN, addrs, ONEWIRE_SIM_MAX_DEVICES, &found);
+        report("search", (int)found, err);
+
+        err = ds18x20_measure_and_read_multi(PIN, addrs, found, temps);
+        // The conversion wait is idle bus time, not traffic
+        report("read", (int)found, err);
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "onewire_sim.h"
+#include "ds18x20.h"
+
+#define PIN 4
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+static int failures;
+
+#define CHECK_EQ(actual, expected) do { \
+    long long a_ = (actual), e_ = (expected); \
+    if (a_ != e_) { \
+        printf("%s:%d: %s = %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+        failures++; \
+    } \
+} while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance) do { \
+    double a_ = (actual), e_ = (expected); \
+    if (fabs(a_ - e_) > (tolerance)) { \
+        printf("%s:%d: %s = %.4f, expected %.4f\n", __FILE__, __LINE__, #actual, a_, e_); \
+        failures++; \
+    } \
+} while (0)
+
+static const struct {
+    uint8_t family;
+    uint64_t serial;
+    float temperature;
+} mixed_bus[] = {
+    { DS18X20_FAMILY_DS18B20, 0x0000017a3c11, 21.0625f },
+    { DS18X20_FAMILY_DS18S20, 0x000802a1b6e4, 23.5f },
+    { DS18X20_FAMILY_MAX31850, 0x00000055aa01, 98.25f },
+    { DS18X20_FAMILY_DS18B20, 0x0000017a3c12, -10.125f },
+};
+
+static onewire_addr_t addrs[ONEWIRE_SIM_MAX_DEVICES];
+
+static void add_mixed_bus(void)
+{
+    onewire_sim_reset();
+    for (int i = 0; i < COUNT(mixed_bus); i++)
+        CHECK_EQ(onewire_sim_add_device(mixed_bus[i].family, mixed_bus[i].serial, mixed_bus[i].temperature), i);
+}
+
+// Index of the simulated device with this ROM code, -1 if none
+static int find_device(onewire_addr_t addr)
+{
+    for (int i = 0; i < COUNT(mixed_bus); i++)
+        if (onewire_sim_get_addr(i) == addr)
+            return i;
+    return -1;
+}
+
+static void test_crc8(void)
+{
+    // ROM code 02 1c b8 01 00 00 00 a2 from the Maxim application note 27
+    const uint8_t rom[] = { 0x02, 0x1c, 0xb8, 0x01, 0x00, 0x00, 0x00 };
+
+    CHECK_EQ(onewire_crc8(rom, sizeof(rom)), 0xa2);
+    CHECK_EQ(onewire_crc8(rom, 0), 0);
+}
+
+static void test_scan_mixed_bus(void)
+{
+    size_t found;
+    bool seen[COUNT(mixed_bus)] = { false };
+
+    add_mixed_bus();
+    CHECK_EQ(ds18x20_scan_devices(PIN, addrs, ONEWIRE_SIM_MAX_DEVICES, &found), ESP_OK);
+    CHECK_EQ(found, COUNT(mixed_bus));
+
+    for (size_t i = 0; i < found; i++)
+    {
+        int device = find_device(addrs[i]);
+        CHECK_EQ(device >= 0, 1);
+        if (device < 0)
+            continue;
+        CHECK_EQ(seen[device], 0);
+        seen[device] = true;
+        CHECK_EQ((uint8_t)addrs[i], mixed_bus[device].family);
+    }
+
+    // A short list still reports how many devices are on the bus
+    CHECK_EQ(ds18x20_scan_devices(PIN, addrs, 2, &found), ESP_OK);
+    CHECK_EQ(found, COUNT(mixed_bus));
+}
+
+static void test_read_temperatures(void)
+{
+    float temps[COUNT(mixed_bus)];
+
+    add_mixed_bus();
+    for (int i = 0; i < COUNT(mixed_bus); i++)
+        addrs[i] = onewire_sim_get_addr(i);
+
+    CHECK_EQ(ds18x20_measure_and_read_multi(PIN, addrs, COUNT(mixed_bus), temps), ESP_OK);
+    for (int i = 0; i < COUNT(mixed_bus); i++)
+        CHECK_NEAR(temps[i], mixed_bus[i].temperature, 0.5);
+
+    // A new conversion picks up the new temperature
+    onewire_sim_set_temperature(0, 30.5f);
+    CHECK_EQ(ds18x20_measure_and_read_multi(PIN, addrs, COUNT(mixed_bus), temps), ESP_OK);
+    CHECK_NEAR(temps[0], 30.5, 0.0625);
+}
+
+static void test_parasite_power(void)
+{
+    float temp;
+    ds18x20_conversion_t conv = { 0 };
+
+    add_mixed_bus();
+    onewire_sim_set_parasite(0, true);
+    addrs[0] = onewire_sim_get_addr(0);
+
+    CHECK_EQ(ds18x20_measure_start(PIN, addrs[0], DS18X20_RESOLUTION_12_BIT, &conv), ESP_OK);
+    CHECK_EQ(conv.parasite, 1);
+    CHECK_EQ(ds18x20_wait_conversion(&conv), ESP_OK);
+    CHECK_EQ(ds18x20_read_temperature(PIN, addrs[0], &temp), ESP_OK);
+    CHECK_NEAR(temp, mixed_bus[0].temperature, 0.0625);
+}
+
+static void test_crc_fault(void)
+{
+    float temps[COUNT(mixed_bus)];
+    onewire_sim_stats_t stats;
+
+    add_mixed_bus();
+    for (int i = 0; i < COUNT(mixed_bus); i++)
+        addrs[i] = onewire_sim_get_addr(i);
+    CHECK_EQ(ds18x20_measure(PIN, DS18X20_ANY, true), ESP_OK);
+
+    onewire_sim_inject_crc_error(1, 1);
+    CHECK_EQ(ds18x20_read_temp_multi(PIN, addrs, COUNT(mixed_bus), temps), ESP_ERR_INVALID_CRC);
+    // The other devices are still read
+    CHECK_NEAR(temps[0], mixed_bus[0].temperature, 0.0625);
+    CHECK_NEAR(temps[3], mixed_bus[3].temperature, 0.0625);
+    onewire_sim_get_stats(&stats);
+    CHECK_EQ(stats.crc_errors_injected, 1);
+
+    // The fault is transient, a retry succeeds
+    CHECK_EQ(ds18x20_read_temperature(PIN, addrs[1], &temps[1]), ESP_OK);
+    CHECK_NEAR(temps[1], mixed_bus[1].temperature, 0.5);
+}
+
+static void test_shorted_bus(void)
+{
+    size_t found;
+    float temps[COUNT(mixed_bus)];
+
+    add_mixed_bus();
+    for (int i = 0; i < COUNT(mixed_bus); i++)
+        addrs[i] = onewire_sim_get_addr(i);
+
+    onewire_sim_set_short(true);
+    CHECK_EQ(onewire_reset(PIN), 0);
+    CHECK_EQ(ds18x20_scan_devices(PIN, addrs + COUNT(mixed_bus), 1, &found), ESP_OK);
+    CHECK_EQ(found, 0);
+    CHECK_EQ(ds18x20_read_temp_multi(PIN, addrs, COUNT(mixed_bus), temps), ESP_ERR_INVALID_RESPONSE);
+
+    onewire_sim_set_short(false);
+    CHECK_EQ(ds18x20_measure_and_read_multi(PIN, addrs, COUNT(mixed_bus), temps), ESP_OK);
+}
+
+int main(void)
+{
+    test_crc8();
+    test_scan_mixed_bus();
+    test_read_temperatures();
+    test_parasite_power();
+    test_crc_fault();
+    test_shorted_bus();
+
+    if (failures)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
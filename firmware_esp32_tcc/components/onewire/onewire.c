@@ -35,6 +35,10 @@
  * Routines to access devices using the Dallas Semiconductor 1-Wire(tm)
  * protocol.
  *
+ * This file holds the hardware independent part of the driver (byte framing,
+ * ROM commands, search algorithm and CRCs). Bus timing is provided by one of
+ * the backends declared in onewire_bus.h, selected in menuconfig.
+ *
  * This is a port of a bit-banging one wire driver based on the implementation
  * from NodeMCU.
  *
@@ -50,125 +54,17 @@
  */
 
 #include <string.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <ets_sys.h>
-#include <esp_idf_lib_helpers.h>
+#include <sdkconfig.h>
 #include "onewire.h"
+#include "onewire_bus.h"
 
 #define ONEWIRE_SELECT_ROM 0x55
 #define ONEWIRE_SKIP_ROM   0xcc
 #define ONEWIRE_SEARCH     0xf0
 
-#if HELPER_TARGET_IS_ESP8266
-#define PORT_ENTER_CRITICAL portENTER_CRITICAL()
-#define PORT_EXIT_CRITICAL portEXIT_CRITICAL()
-#define OPEN_DRAIN_MODE GPIO_MODE_OUTPUT_OD
-
-#elif HELPER_TARGET_IS_ESP32
-static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
-#define PORT_ENTER_CRITICAL portENTER_CRITICAL(&mux)
-#define PORT_EXIT_CRITICAL portEXIT_CRITICAL(&mux)
-#define OPEN_DRAIN_MODE GPIO_MODE_INPUT_OUTPUT_OD
-#else
-#error BUG: Unknown target
-#endif
-
-// Waits up to `max_wait` microseconds for the specified pin to go high.
-// Returns true if successful, false if the bus never comes high (likely
-// shorted).
-static inline bool _onewire_wait_for_bus(gpio_num_t pin, int max_wait)
-{
-    bool state;
-    for (int i = 0; i < ((max_wait + 4) / 5); i++)
-    {
-        if (gpio_get_level(pin))
-            break;
-        ets_delay_us(5);
-    }
-    state = gpio_get_level(pin);
-    // Wait an extra 1us to make sure the devices have an adequate recovery
-    // time before we drive things low again.
-    ets_delay_us(1);
-    return state;
-}
-
-static void setup_pin(gpio_num_t pin, bool open_drain)
-{
-    gpio_set_direction(pin, open_drain ? OPEN_DRAIN_MODE : GPIO_MODE_OUTPUT);
-    gpio_set_pull_mode(pin, GPIO_PULLUP_ONLY);
-}
-
-// Perform the onewire reset function.  We will wait up to 250uS for
-// the bus to come high, if it doesn't then it is broken or shorted
-// and we return false;
-//
-// Returns true if a device asserted a presence pulse, false otherwise.
-//
 bool onewire_reset(gpio_num_t pin)
 {
-    setup_pin(pin, true);
-
-    gpio_set_level(pin, 1);
-    // wait until the wire is high... just in case
-    if (!_onewire_wait_for_bus(pin, 250))
-        return false;
-
-    gpio_set_level(pin, 0);
-    ets_delay_us(480);
-
-    PORT_ENTER_CRITICAL;
-    gpio_set_level(pin, 1); // allow it to float
-    ets_delay_us(70);
-    bool r = !gpio_get_level(pin);
-    PORT_EXIT_CRITICAL;
-
-    // Wait for all devices to finish pulling the bus low before returning
-    if (!_onewire_wait_for_bus(pin, 410))
-        return false;
-
-    return r;
-}
-
-static bool _onewire_write_bit(gpio_num_t pin, bool v)
-{
-    if (!_onewire_wait_for_bus(pin, 10))
-        return false;
-    PORT_ENTER_CRITICAL;
-    if (v)
-    {
-        gpio_set_level(pin, 0);  // drive output low
-        ets_delay_us(10);
-        gpio_set_level(pin, 1);  // allow output high
-        ets_delay_us(55);
-    }
-    else
-    {
-        gpio_set_level(pin, 0);  // drive output low
-        ets_delay_us(65);
-        gpio_set_level(pin, 1); // allow output high
-    }
-    ets_delay_us(1);
-    PORT_EXIT_CRITICAL;
-
-    return true;
-}
-
-static int _onewire_read_bit(gpio_num_t pin)
-{
-    if (!_onewire_wait_for_bus(pin, 10))
-        return -1;
-
-    PORT_ENTER_CRITICAL;
-    gpio_set_level(pin, 0);
-    ets_delay_us(2);
-    gpio_set_level(pin, 1);  // let pin float, pull up will raise
-    ets_delay_us(11);
-    int r = gpio_get_level(pin);  // Must sample within 15us of start
-    ets_delay_us(48);
-    PORT_EXIT_CRITICAL;
-
-    return r;
+    return onewire_bus_reset(pin);
 }
 
 // Write a byte. The writing code uses open-drain mode and expects the pullup
@@ -178,69 +74,42 @@ static int _onewire_read_bit(gpio_num_t pin)
 //
 bool onewire_write(gpio_num_t pin, uint8_t v)
 {
-    for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1)
-        if (!_onewire_write_bit(pin, (bitMask & v)))
-            return false;
-
-    return true;
+    return onewire_bus_write_bytes(pin, &v, 1);
 }
 
 bool onewire_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count)
 {
-    for (size_t i = 0; i < count; i++)
-        if (!onewire_write(pin, buf[i]))
-            return false;
-
-    return true;
+    return onewire_bus_write_bytes(pin, buf, count);
 }
 
 // Read a byte
 //
 int onewire_read(gpio_num_t pin)
 {
-    int r = 0;
+    uint8_t v;
 
-    for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1)
-    {
-        int bit = _onewire_read_bit(pin);
-        if (bit < 0)
-            return -1;
-        else if (bit)
-            r |= bitMask;
-    }
-    return r;
+    if (!onewire_bus_read_bytes(pin, &v, 1))
+        return -1;
+    return v;
 }
 
 bool onewire_read_bytes(gpio_num_t pin, uint8_t *buf, size_t count)
 {
-    size_t i;
-    int b;
-
-    for (i = 0; i < count; i++)
-    {
-        b = onewire_read(pin);
-        if (b < 0)
-            return false;
-        buf[i] = b;
-    }
-    return true;
+    return onewire_bus_read_bytes(pin, buf, count);
 }
 
 bool onewire_select(gpio_num_t pin, onewire_addr_t addr)
 {
-    uint8_t i;
-
-    if (!onewire_write(pin, ONEWIRE_SELECT_ROM))
-        return false;
+    uint8_t buf[9];
 
-    for (i = 0; i < 8; i++)
+    buf[0] = ONEWIRE_SELECT_ROM;
+    for (int i = 1; i < 9; i++)
     {
-        if (!onewire_write(pin, addr & 0xff))
-            return false;
+        buf[i] = addr & 0xff;
         addr >>= 8;
     }
 
-    return true;
+    return onewire_bus_write_bytes(pin, buf, sizeof(buf));
 }
 
 bool onewire_skip_rom(gpio_num_t pin)
@@ -250,20 +119,12 @@ bool onewire_skip_rom(gpio_num_t pin)
 
 bool onewire_power(gpio_num_t pin)
 {
-    // Make sure the bus is not being held low before driving it high, or we
-    // may end up shorting ourselves out.
-    if (!_onewire_wait_for_bus(pin, 10))
-        return false;
-
-    setup_pin(pin, false);
-    gpio_set_level(pin, 1);
-
-    return true;
+    return onewire_bus_power(pin);
 }
 
 void onewire_depower(gpio_num_t pin)
 {
-    setup_pin(pin, true);
+    onewire_bus_depower(pin);
 }
 
 void onewire_search_start(onewire_search_t *search)
@@ -335,8 +196,8 @@ onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin)
         do
         {
             // read a bit and its complement
-            id_bit = _onewire_read_bit(pin);
-            cmp_id_bit = _onewire_read_bit(pin);
+            id_bit = onewire_bus_read_bit(pin);
+            cmp_id_bit = onewire_bus_read_bit(pin);
 
             if ((id_bit == 1) && (cmp_id_bit == 1))
                 break;
@@ -368,7 +229,7 @@ onewire_addr_t onewire_search_next(onewire_search_t *search, gpio_num_t pin)
                     search->rom_no[rom_byte_number] &= ~rom_byte_mask;
 
                 // serial number search direction write bit
-                _onewire_write_bit(pin, search_direction);
+                onewire_bus_write_bit(pin, search_direction);
 
                 // increment the byte counter id_bit_number
                 // and shift the mask rom_byte_mask
@@ -0,0 +1,68 @@
+/**
+ * @file onewire_bus.h
+ *
+ * Bus access primitives implemented by each 1-Wire backend. The protocol
+ * layer in onewire.c is written only against these functions, which keeps it
+ * independent from how the time slots are generated.
+ *
+ * Backends:
+ *   - onewire_gpio.c: bit-banging with busy waits (CONFIG_ONEWIRE_BACKEND_GPIO)
+ *   - onewire_rmt.c:  RMT peripheral, slots timed in hardware
+ *                     (CONFIG_ONEWIRE_BACKEND_RMT)
+ */
+#ifndef __ONEWIRE_BUS_H__
+#define __ONEWIRE_BUS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <driver/gpio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reset pulse followed by presence detection.
+ *
+ * @return `true` if at least one device answered with a presence pulse.
+ */
+bool onewire_bus_reset(gpio_num_t pin);
+
+/**
+ * @brief Generate a single write time slot.
+ */
+bool onewire_bus_write_bit(gpio_num_t pin, bool v);
+
+/**
+ * @brief Generate a single read time slot.
+ *
+ * @return the bit value, or a negative value on error.
+ */
+int onewire_bus_read_bit(gpio_num_t pin);
+
+/**
+ * @brief Write `count` bytes, LSB first.
+ */
+bool onewire_bus_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count);
+
+/**
+ * @brief Read `count` bytes, LSB first.
+ */
+bool onewire_bus_read_bytes(gpio_num_t pin, uint8_t *buf, size_t count);
+
+/**
+ * @brief Actively drive the bus high (strong pull-up).
+ */
+bool onewire_bus_power(gpio_num_t pin);
+
+/**
+ * @brief Release the bus back to the pull-up resistor.
+ */
+void onewire_bus_depower(gpio_num_t pin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __ONEWIRE_BUS_H__ */
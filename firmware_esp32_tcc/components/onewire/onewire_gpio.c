@@ -0,0 +1,206 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 zeroday nodemcu.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * -------------------------------------------------------------------------------
+ * Portions copyright (C) 2000 Dallas Semiconductor Corporation, under the
+ * following additional terms:
+ *
+ * Except as contained in this notice, the name of Dallas Semiconductor
+ * shall not be used except as stated in the Dallas Semiconductor
+ * Branding Policy.
+ */
+
+/**
+ * @file onewire_gpio.c
+ *
+ * Bit-banging 1-Wire backend. Every time slot is generated in software with
+ * busy waits inside a critical section.
+ */
+
+#include <sdkconfig.h>
+
+#if CONFIG_ONEWIRE_BACKEND_GPIO
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <ets_sys.h>
+#include <esp_idf_lib_helpers.h>
+#include "onewire_bus.h"
+
+#if HELPER_TARGET_IS_ESP8266
+#define PORT_ENTER_CRITICAL portENTER_CRITICAL()
+#define PORT_EXIT_CRITICAL portEXIT_CRITICAL()
+#define OPEN_DRAIN_MODE GPIO_MODE_OUTPUT_OD
+
+#elif HELPER_TARGET_IS_ESP32
+static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+#define PORT_ENTER_CRITICAL portENTER_CRITICAL(&mux)
+#define PORT_EXIT_CRITICAL portEXIT_CRITICAL(&mux)
+#define OPEN_DRAIN_MODE GPIO_MODE_INPUT_OUTPUT_OD
+#else
+#error BUG: Unknown target
+#endif
+
+// Waits up to `max_wait` microseconds for the specified pin to go high.
+// Returns true if successful, false if the bus never comes high (likely
+// shorted).
+static inline bool _onewire_wait_for_bus(gpio_num_t pin, int max_wait)
+{
+    bool state;
+    for (int i = 0; i < ((max_wait + 4) / 5); i++)
+    {
+        if (gpio_get_level(pin))
+            break;
+        ets_delay_us(5);
+    }
+    state = gpio_get_level(pin);
+    // Wait an extra 1us to make sure the devices have an adequate recovery
+    // time before we drive things low again.
+    ets_delay_us(1);
+    return state;
+}
+
+static void setup_pin(gpio_num_t pin, bool open_drain)
+{
+    gpio_set_direction(pin, open_drain ? OPEN_DRAIN_MODE : GPIO_MODE_OUTPUT);
+    gpio_set_pull_mode(pin, GPIO_PULLUP_ONLY);
+}
+
+// Perform the onewire reset function.  We will wait up to 250uS for
+// the bus to come high, if it doesn't then it is broken or shorted
+// and we return false;
+//
+// Returns true if a device asserted a presence pulse, false otherwise.
+//
+bool onewire_bus_reset(gpio_num_t pin)
+{
+    setup_pin(pin, true);
+
+    gpio_set_level(pin, 1);
+    // wait until the wire is high... just in case
+    if (!_onewire_wait_for_bus(pin, 250))
+        return false;
+
+    gpio_set_level(pin, 0);
+    ets_delay_us(480);
+
+    PORT_ENTER_CRITICAL;
+    gpio_set_level(pin, 1); // allow it to float
+    ets_delay_us(70);
+    bool r = !gpio_get_level(pin);
+    PORT_EXIT_CRITICAL;
+
+    // Wait for all devices to finish pulling the bus low before returning
+    if (!_onewire_wait_for_bus(pin, 410))
+        return false;
+
+    return r;
+}
+
+bool onewire_bus_write_bit(gpio_num_t pin, bool v)
+{
+    if (!_onewire_wait_for_bus(pin, 10))
+        return false;
+    PORT_ENTER_CRITICAL;
+    if (v)
+    {
+        gpio_set_level(pin, 0);  // drive output low
+        ets_delay_us(10);
+        gpio_set_level(pin, 1);  // allow output high
+        ets_delay_us(55);
+    }
+    else
+    {
+        gpio_set_level(pin, 0);  // drive output low
+        ets_delay_us(65);
+        gpio_set_level(pin, 1); // allow output high
+    }
+    ets_delay_us(1);
+    PORT_EXIT_CRITICAL;
+
+    return true;
+}
+
+int onewire_bus_read_bit(gpio_num_t pin)
+{
+    if (!_onewire_wait_for_bus(pin, 10))
+        return -1;
+
+    PORT_ENTER_CRITICAL;
+    gpio_set_level(pin, 0);
+    ets_delay_us(2);
+    gpio_set_level(pin, 1);  // let pin float, pull up will raise
+    ets_delay_us(11);
+    int r = gpio_get_level(pin);  // Must sample within 15us of start
+    ets_delay_us(48);
+    PORT_EXIT_CRITICAL;
+
+    return r;
+}
+
+bool onewire_bus_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1)
+            if (!onewire_bus_write_bit(pin, (bitMask & buf[i])))
+                return false;
+
+    return true;
+}
+
+bool onewire_bus_read_bytes(gpio_num_t pin, uint8_t *buf, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t r = 0;
+        for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1)
+        {
+            int bit = onewire_bus_read_bit(pin);
+            if (bit < 0)
+                return false;
+            else if (bit)
+                r |= bitMask;
+        }
+        buf[i] = r;
+    }
+    return true;
+}
+
+bool onewire_bus_power(gpio_num_t pin)
+{
+    // Make sure the bus is not being held low before driving it high, or we
+    // may end up shorting ourselves out.
+    if (!_onewire_wait_for_bus(pin, 10))
+        return false;
+
+    setup_pin(pin, false);
+    gpio_set_level(pin, 1);
+
+    return true;
+}
+
+void onewire_bus_depower(gpio_num_t pin)
+{
+    setup_pin(pin, true);
+}
+
+#endif // CONFIG_ONEWIRE_BACKEND_GPIO
@@ -0,0 +1,327 @@
+/**
+ * @file onewire_rmt.c
+ *
+ * RMT based 1-Wire backend.
+ *
+ * The bus pin is shared by one RMT TX channel (open drain, looped back to the
+ * input) and one RX channel. Every time slot is encoded as one RMT symbol: the
+ * TX channel drives the low part of the slot and releases the line, while the
+ * RX channel records how long the line actually stayed low. A device answering
+ * a read slot with 0, or a presence pulse after reset, shows up as a longer
+ * low period. Transfers run entirely in hardware; the calling task blocks on
+ * a queue and interrupts are never masked.
+ *
+ * Timing follows Maxim AN126 standard speed values.
+ */
+
+#include <sdkconfig.h>
+
+#if CONFIG_ONEWIRE_BACKEND_RMT
+
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <driver/rmt_tx.h>
+#include <driver/rmt_rx.h>
+#include <esp_log.h>
+#include "onewire_bus.h"
+
+#define ONEWIRE_RMT_RESOLUTION_HZ 1000000 // 1 tick = 1 us
+#define ONEWIRE_RMT_MEM_SYMBOLS   64
+#define ONEWIRE_RMT_MAX_BUSES     2
+#define ONEWIRE_RMT_TIMEOUT_MS    50
+// Bytes per RX transaction. The RX symbol buffer also needs room for the
+// end marker and a possible glitch symbol, so one byte's worth is kept free.
+#define ONEWIRE_RMT_CHUNK_BYTES   (ONEWIRE_RMT_MEM_SYMBOLS / 8 - 1)
+
+// Timings in microseconds
+#define RESET_PULSE_DURATION         500
+#define RESET_WAIT_DURATION          200
+#define RESET_PRESENCE_WAIT_MIN      15
+#define RESET_PRESENCE_DURATION_MIN  60
+#define SLOT_START_DURATION          2
+#define SLOT_BIT_DURATION            60
+#define SLOT_RECOVERY_DURATION       2
+#define SLOT_BIT_SAMPLE_TIME         15
+// Idle time that ends an RX transaction after the last slot
+#define SLOT_IDLE_DURATION           100
+
+typedef struct
+{
+    gpio_num_t pin;
+    rmt_channel_handle_t tx;
+    rmt_channel_handle_t rx;
+    rmt_encoder_handle_t copy_encoder;
+    rmt_encoder_handle_t bytes_encoder;
+    QueueHandle_t rx_queue;
+    rmt_symbol_word_t rx_symbols[ONEWIRE_RMT_MEM_SYMBOLS];
+} onewire_rmt_bus_t;
+
+static const char *TAG = "onewire_rmt";
+
+static onewire_rmt_bus_t buses[ONEWIRE_RMT_MAX_BUSES];
+static size_t bus_count = 0;
+
+static const rmt_symbol_word_t reset_symbol = {
+    .level0 = 0, .duration0 = RESET_PULSE_DURATION,
+    .level1 = 1, .duration1 = RESET_WAIT_DURATION,
+};
+
+static const rmt_symbol_word_t bit0_symbol = {
+    .level0 = 0, .duration0 = SLOT_START_DURATION + SLOT_BIT_DURATION,
+    .level1 = 1, .duration1 = SLOT_RECOVERY_DURATION,
+};
+
+static const rmt_symbol_word_t bit1_symbol = {
+    .level0 = 0, .duration0 = SLOT_START_DURATION,
+    .level1 = 1, .duration1 = SLOT_BIT_DURATION + SLOT_RECOVERY_DURATION,
+};
+
+static const rmt_transmit_config_t tx_config = {
+    .loop_count = 0,
+    .flags.eot_level = 1, // release the bus when done
+};
+
+static const rmt_receive_config_t reset_rx_config = {
+    .signal_range_min_ns = 1000000000 / ONEWIRE_RMT_RESOLUTION_HZ,
+    .signal_range_max_ns = (RESET_PULSE_DURATION + RESET_WAIT_DURATION) * 1000,
+};
+
+static const rmt_receive_config_t slot_rx_config = {
+    .signal_range_min_ns = 1000000000 / ONEWIRE_RMT_RESOLUTION_HZ,
+    .signal_range_max_ns = SLOT_IDLE_DURATION * 1000,
+};
+
+static bool IRAM_ATTR rx_done_callback(rmt_channel_handle_t channel, const rmt_rx_done_event_data_t *edata, void *user_data)
+{
+    BaseType_t task_woken = pdFALSE;
+    QueueHandle_t queue = (QueueHandle_t)user_data;
+
+    xQueueSendFromISR(queue, &edata->num_symbols, &task_woken);
+
+    return task_woken == pdTRUE;
+}
+
+static esp_err_t bus_create(onewire_rmt_bus_t *bus, gpio_num_t pin)
+{
+    esp_err_t err;
+
+    memset(bus, 0, sizeof(*bus));
+    bus->pin = pin;
+
+    rmt_tx_channel_config_t tx_channel_config = {
+        .gpio_num = pin,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = ONEWIRE_RMT_RESOLUTION_HZ,
+        .mem_block_symbols = ONEWIRE_RMT_MEM_SYMBOLS,
+        .trans_queue_depth = 4,
+        .flags.io_loop_back = true,
+        .flags.io_od_mode = true,
+    };
+    if ((err = rmt_new_tx_channel(&tx_channel_config, &bus->tx)) != ESP_OK)
+        goto fail;
+
+    rmt_rx_channel_config_t rx_channel_config = {
+        .gpio_num = pin,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = ONEWIRE_RMT_RESOLUTION_HZ,
+        .mem_block_symbols = ONEWIRE_RMT_MEM_SYMBOLS,
+    };
+    if ((err = rmt_new_rx_channel(&rx_channel_config, &bus->rx)) != ESP_OK)
+        goto fail;
+
+    rmt_copy_encoder_config_t copy_encoder_config = {};
+    if ((err = rmt_new_copy_encoder(&copy_encoder_config, &bus->copy_encoder)) != ESP_OK)
+        goto fail;
+
+    rmt_bytes_encoder_config_t bytes_encoder_config = {
+        .bit0 = bit0_symbol,
+        .bit1 = bit1_symbol,
+        .flags.msb_first = 0,
+    };
+    if ((err = rmt_new_bytes_encoder(&bytes_encoder_config, &bus->bytes_encoder)) != ESP_OK)
+        goto fail;
+
+    bus->rx_queue = xQueueCreate(1, sizeof(size_t));
+    if (!bus->rx_queue)
+    {
+        err = ESP_ERR_NO_MEM;
+        goto fail;
+    }
+
+    rmt_rx_event_callbacks_t callbacks = {
+        .on_recv_done = rx_done_callback,
+    };
+    if ((err = rmt_rx_register_event_callbacks(bus->rx, &callbacks, bus->rx_queue)) != ESP_OK)
+        goto fail;
+
+    gpio_set_pull_mode(pin, GPIO_PULLUP_ONLY);
+
+    if ((err = rmt_enable(bus->rx)) != ESP_OK)
+        goto fail;
+    if ((err = rmt_enable(bus->tx)) != ESP_OK)
+    {
+        rmt_disable(bus->rx);
+        goto fail;
+    }
+    return ESP_OK;
+
+fail:
+    if (bus->rx_queue)
+        vQueueDelete(bus->rx_queue);
+    if (bus->bytes_encoder)
+        rmt_del_encoder(bus->bytes_encoder);
+    if (bus->copy_encoder)
+        rmt_del_encoder(bus->copy_encoder);
+    if (bus->rx)
+        rmt_del_channel(bus->rx);
+    if (bus->tx)
+        rmt_del_channel(bus->tx);
+    memset(bus, 0, sizeof(*bus));
+    return err;
+}
+
+static onewire_rmt_bus_t *get_bus(gpio_num_t pin)
+{
+    for (size_t i = 0; i < bus_count; i++)
+        if (buses[i].pin == pin)
+            return &buses[i];
+
+    if (bus_count >= ONEWIRE_RMT_MAX_BUSES)
+    {
+        ESP_LOGE(TAG, "No free bus slot for GPIO %d", pin);
+        return NULL;
+    }
+
+    esp_err_t err = bus_create(&buses[bus_count], pin);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to set up RMT bus on GPIO %d: %s", pin, esp_err_to_name(err));
+        return NULL;
+    }
+    ESP_LOGI(TAG, "1-Wire bus on GPIO %d driven by RMT", pin);
+
+    return &buses[bus_count++];
+}
+
+// Arms the receiver, sends `size` bytes of payload through `encoder` and
+// waits for the receiver to report the sampled symbols.
+static int transfer(onewire_rmt_bus_t *bus, const rmt_receive_config_t *rx_config, rmt_encoder_handle_t encoder,
+        const void *payload, size_t size)
+{
+    size_t num_symbols;
+
+    xQueueReset(bus->rx_queue);
+    if (rmt_receive(bus->rx, bus->rx_symbols, sizeof(bus->rx_symbols), rx_config) != ESP_OK)
+        return -1;
+    if (rmt_transmit(bus->tx, encoder, payload, size, &tx_config) != ESP_OK)
+        return -1;
+    if (rmt_tx_wait_all_done(bus->tx, ONEWIRE_RMT_TIMEOUT_MS) != ESP_OK)
+        return -1;
+    if (xQueueReceive(bus->rx_queue, &num_symbols, pdMS_TO_TICKS(ONEWIRE_RMT_TIMEOUT_MS)) != pdTRUE)
+        return -1;
+
+    return (int)num_symbols;
+}
+
+static inline bool decode_bit(const rmt_symbol_word_t *symbol)
+{
+    // A short low period means nobody held the line after our start pulse
+    return symbol->duration0 <= SLOT_BIT_SAMPLE_TIME;
+}
+
+bool onewire_bus_reset(gpio_num_t pin)
+{
+    onewire_rmt_bus_t *bus = get_bus(pin);
+    if (!bus)
+        return false;
+
+    int num_symbols = transfer(bus, &reset_rx_config, bus->copy_encoder, &reset_symbol, sizeof(reset_symbol));
+    if (num_symbols < 2)
+        return false;
+
+    return bus->rx_symbols[0].duration1 > RESET_PRESENCE_WAIT_MIN
+        && bus->rx_symbols[1].duration0 > RESET_PRESENCE_DURATION_MIN;
+}
+
+bool onewire_bus_write_bit(gpio_num_t pin, bool v)
+{
+    onewire_rmt_bus_t *bus = get_bus(pin);
+    if (!bus)
+        return false;
+
+    const rmt_symbol_word_t *symbol = v ? &bit1_symbol : &bit0_symbol;
+    if (rmt_transmit(bus->tx, bus->copy_encoder, symbol, sizeof(*symbol), &tx_config) != ESP_OK)
+        return false;
+    return rmt_tx_wait_all_done(bus->tx, ONEWIRE_RMT_TIMEOUT_MS) == ESP_OK;
+}
+
+int onewire_bus_read_bit(gpio_num_t pin)
+{
+    onewire_rmt_bus_t *bus = get_bus(pin);
+    if (!bus)
+        return -1;
+
+    if (transfer(bus, &slot_rx_config, bus->copy_encoder, &bit1_symbol, sizeof(bit1_symbol)) < 1)
+        return -1;
+
+    return decode_bit(&bus->rx_symbols[0]);
+}
+
+bool onewire_bus_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count)
+{
+    onewire_rmt_bus_t *bus = get_bus(pin);
+    if (!bus)
+        return false;
+
+    if (rmt_transmit(bus->tx, bus->bytes_encoder, buf, count, &tx_config) != ESP_OK)
+        return false;
+    return rmt_tx_wait_all_done(bus->tx, ONEWIRE_RMT_TIMEOUT_MS) == ESP_OK;
+}
+
+bool onewire_bus_read_bytes(gpio_num_t pin, uint8_t *buf, size_t count)
+{
+    static const uint8_t read_slots[ONEWIRE_RMT_CHUNK_BYTES] = {
+        [0 ... ONEWIRE_RMT_CHUNK_BYTES - 1] = 0xff
+    };
+
+    onewire_rmt_bus_t *bus = get_bus(pin);
+    if (!bus)
+        return false;
+
+    // A read slot is a write-1 slot that the device may stretch low
+    while (count > 0)
+    {
+        size_t chunk = count < ONEWIRE_RMT_CHUNK_BYTES ? count : ONEWIRE_RMT_CHUNK_BYTES;
+
+        if (transfer(bus, &slot_rx_config, bus->bytes_encoder, read_slots, chunk) < (int)(chunk * 8))
+            return false;
+
+        for (size_t i = 0; i < chunk; i++)
+        {
+            uint8_t v = 0;
+            for (int b = 0; b < 8; b++)
+                if (decode_bit(&bus->rx_symbols[i * 8 + b]))
+                    v |= 1 << b;
+            buf[i] = v;
+        }
+
+        buf += chunk;
+        count -= chunk;
+    }
+
+    return true;
+}
+
+bool onewire_bus_power(gpio_num_t pin)
+{
+    // The pin is owned by the open-drain RMT channel and cannot be driven
+    // push-pull, so strong pull-up is not available with this backend.
+    return false;
+}
+
+void onewire_bus_depower(gpio_num_t pin)
+{
+}
+
+#endif // CONFIG_ONEWIRE_BACKEND_RMT
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef int gpio_num_t;
+
+#define GPIO_NUM_NC -1
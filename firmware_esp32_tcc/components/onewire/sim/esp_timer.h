@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "onewire_sim.h"
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+} esp_timer_create_args_t;
+
+static inline int64_t esp_timer_get_time(void)
+{
+    return onewire_sim_time_us();
+}
+
+// Timers are not simulated; ds18x20_measure_start_cb() reports an error
+static inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    (void)args;
+    (void)handle;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    (void)timer;
+    (void)timeout_us;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    (void)timer;
+    (void)period_us;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    (void)timer;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    (void)timer;
+    return ESP_ERR_NOT_SUPPORTED;
+}
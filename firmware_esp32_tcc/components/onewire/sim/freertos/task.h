@@ -0,0 +1,10 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "onewire_sim.h"
+
+// Sleeping only moves the simulated clock forward
+static inline void vTaskDelay(TickType_t ticks)
+{
+    onewire_sim_advance_us((int64_t)ticks * portTICK_PERIOD_MS * 1000);
+}
@@ -0,0 +1,525 @@
+/**
+ * @file onewire_sim.c
+ *
+ * Simulated 1-Wire backend, see onewire_sim.h.
+ *
+ * Every time slot is delivered to each attached device, which runs a small
+ * model of the ROM and function command state machines of the real part.
+ * The bus level seen by the master is the wired-AND of the master and all
+ * devices, so search collisions and multi-drop reads behave like the real
+ * bus. A single bus is modeled; the pin argument is ignored.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "onewire_sim.h"
+#include "onewire_bus.h"
+
+#define FAMILY_DS18S20  0x10
+#define FAMILY_DS18B20  0x28
+#define FAMILY_MAX31850 0x3b
+
+#define CMD_READ_ROM          0x33
+#define CMD_MATCH_ROM         0x55
+#define CMD_SKIP_ROM          0xCC
+#define CMD_SEARCH_ROM        0xF0
+#define CMD_ALARM_SEARCH      0xEC
+#define CMD_CONVERT_T         0x44
+#define CMD_READ_SCRATCHPAD   0xBE
+#define CMD_WRITE_SCRATCHPAD  0x4E
+#define CMD_COPY_SCRATCHPAD   0x48
+#define CMD_RECALL_EEPROM     0xB8
+#define CMD_READ_POWER_SUPPLY 0xB4
+
+typedef enum {
+    DEV_IDLE,             // Not addressed, ignores slots until the next reset
+    DEV_ROM_COMMAND,
+    DEV_MATCH_ROM,
+    DEV_SEARCH,
+    DEV_FUNCTION,
+    DEV_WRITE_SCRATCHPAD,
+    DEV_SEND,
+    DEV_CONVERTING,
+    DEV_POWER_SUPPLY,
+} dev_state_t;
+
+typedef struct {
+    onewire_addr_t rom;
+    uint8_t family;
+    float temperature;
+    float latched;         // Temperature of the last completed conversion
+    bool parasite;
+    int crc_errors;
+    uint8_t scratchpad[8];
+    uint8_t eeprom[3];
+    int64_t conversion_end_us;
+    bool converting;
+    bool powered;
+    bool alarm_search;
+
+    dev_state_t state;
+    dev_state_t next_state; // State after DEV_SEND
+    uint64_t acc;           // Bits received in the current phase
+    int bit;
+    int phase;              // Search triplet position
+    uint8_t buf[9];
+    int len;
+} sim_device_t;
+
+static sim_device_t devices[ONEWIRE_SIM_MAX_DEVICES];
+static int device_count = 0;
+static bool bus_shorted = false;
+static bool strong_pullup = false;
+static int64_t now_us = 0;
+static onewire_sim_stats_t stats;
+
+static const uint8_t power_on_scratchpad[][8] = {
+    { 0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10 }, // DS18B20, 85°C, 12 bit
+    { 0xAA, 0x00, 0x4B, 0x46, 0xFF, 0xFF, 0x0C, 0x10 }, // DS18S20, 85°C
+    { 0x50, 0x05, 0x00, 0x00, 0xF0, 0xFF, 0xFF, 0xFF }, // MAX31850, 85°C
+};
+
+static const uint8_t *default_scratchpad(uint8_t family)
+{
+    switch (family)
+    {
+        case FAMILY_DS18B20:
+            return power_on_scratchpad[0];
+        case FAMILY_DS18S20:
+            return power_on_scratchpad[1];
+        case FAMILY_MAX31850:
+            return power_on_scratchpad[2];
+        default:
+            return NULL;
+    }
+}
+
+static int64_t conversion_time_us(const sim_device_t *dev)
+{
+    switch (dev->family)
+    {
+        case FAMILY_DS18B20:
+            return 93750LL << ((dev->scratchpad[4] >> 5) & 0x03);
+        case FAMILY_MAX31850:
+            return 100000;
+        default:
+            return 750000;
+    }
+}
+
+static void encode_temperature(sim_device_t *dev)
+{
+    float t = dev->temperature;
+
+    switch (dev->family)
+    {
+        case FAMILY_DS18B20:
+        {
+            // Undefined low bits at lower resolutions read as 0
+            int unused = 3 - ((dev->scratchpad[4] >> 5) & 0x03);
+            int16_t raw = (int16_t)lrintf(t * 16) & ~((1 << unused) - 1);
+            dev->scratchpad[0] = (uint8_t)raw;
+            dev->scratchpad[1] = (uint8_t)(raw >> 8);
+            break;
+        }
+        case FAMILY_DS18S20:
+        {
+            // T = TEMP_READ - 0.25 + (COUNT_PER_C - COUNT_REMAIN) / COUNT_PER_C
+            float x = t + 0.25f;
+            int whole = (int)floorf(x);
+            int count_remain = 16 - (int)lrintf((x - whole) * 16);
+            int16_t raw = (int16_t)(whole * 2);
+            dev->scratchpad[0] = (uint8_t)raw;
+            dev->scratchpad[1] = (uint8_t)(raw >> 8);
+            dev->scratchpad[6] = (uint8_t)(count_remain & 0x0f);
+            dev->scratchpad[7] = 0x10;
+            break;
+        }
+        case FAMILY_MAX31850:
+        {
+            int16_t raw = (int16_t)(lrintf(t * 4) * 4); // bit 0 is the fault flag
+            dev->scratchpad[0] = (uint8_t)raw;
+            dev->scratchpad[1] = (uint8_t)(raw >> 8);
+            break;
+        }
+    }
+    dev->latched = t;
+}
+
+// Conversions complete lazily, whenever the bus or the clock is looked at
+static void update_device(sim_device_t *dev)
+{
+    if (!dev->converting || now_us < dev->conversion_end_us)
+        return;
+
+    dev->converting = false;
+    // A parasite powered device without strong pull-up browns out and keeps
+    // its previous scratchpad
+    if (!dev->parasite || dev->powered)
+        encode_temperature(dev);
+}
+
+static void update_devices(void)
+{
+    for (int i = 0; i < device_count; i++)
+        update_device(&devices[i]);
+}
+
+static void release_strong_pullup(void)
+{
+    if (!strong_pullup)
+        return;
+
+    update_devices();
+    strong_pullup = false;
+    for (int i = 0; i < device_count; i++)
+        devices[i].powered = false;
+}
+
+static void start_phase(sim_device_t *dev, dev_state_t state)
+{
+    dev->state = state;
+    dev->acc = 0;
+    dev->bit = 0;
+    dev->phase = 0;
+}
+
+static void start_send(sim_device_t *dev, const uint8_t *data, int len, dev_state_t next_state)
+{
+    memcpy(dev->buf, data, len);
+    dev->len = len;
+    dev->next_state = next_state;
+    start_phase(dev, DEV_SEND);
+}
+
+// Shifts in one bit, LSB first. Returns true when `bits` have been received.
+static bool receive(sim_device_t *dev, bool v, int bits)
+{
+    dev->acc |= (uint64_t)v << dev->bit;
+    return ++dev->bit == bits;
+}
+
+static bool in_alarm(const sim_device_t *dev)
+{
+    if (dev->family == FAMILY_MAX31850)
+        return false;
+    return dev->latched >= (int8_t)dev->scratchpad[2] || dev->latched <= (int8_t)dev->scratchpad[3];
+}
+
+static void rom_command(sim_device_t *dev, uint8_t cmd)
+{
+    uint8_t rom[8];
+
+    switch (cmd)
+    {
+        case CMD_READ_ROM:
+            for (int i = 0; i < 8; i++)
+                rom[i] = (uint8_t)(dev->rom >> (i * 8));
+            start_send(dev, rom, 8, DEV_FUNCTION);
+            break;
+        case CMD_MATCH_ROM:
+            start_phase(dev, DEV_MATCH_ROM);
+            break;
+        case CMD_SKIP_ROM:
+            start_phase(dev, DEV_FUNCTION);
+            break;
+        case CMD_SEARCH_ROM:
+            start_phase(dev, DEV_SEARCH);
+            break;
+        case CMD_ALARM_SEARCH:
+            update_device(dev);
+            start_phase(dev, in_alarm(dev) ? DEV_SEARCH : DEV_IDLE);
+            break;
+        default:
+            start_phase(dev, DEV_IDLE);
+    }
+}
+
+static void function_command(sim_device_t *dev, uint8_t cmd)
+{
+    uint8_t data[9];
+
+    switch (cmd)
+    {
+        case CMD_CONVERT_T:
+            dev->converting = true;
+            dev->powered = false;
+            dev->conversion_end_us = now_us + conversion_time_us(dev);
+            start_phase(dev, DEV_CONVERTING);
+            break;
+        case CMD_READ_SCRATCHPAD:
+            update_device(dev);
+            memcpy(data, dev->scratchpad, 8);
+            data[8] = onewire_crc8(data, 8);
+            if (dev->crc_errors > 0)
+            {
+                data[8] ^= 0x01;
+                dev->crc_errors--;
+                stats.crc_errors_injected++;
+            }
+            start_send(dev, data, 9, DEV_IDLE);
+            break;
+        case CMD_WRITE_SCRATCHPAD:
+            dev->len = 0;
+            start_phase(dev, dev->family == FAMILY_MAX31850 ? DEV_IDLE : DEV_WRITE_SCRATCHPAD);
+            break;
+        case CMD_COPY_SCRATCHPAD:
+            memcpy(dev->eeprom, &dev->scratchpad[2], 3);
+            start_phase(dev, DEV_IDLE);
+            break;
+        case CMD_RECALL_EEPROM:
+            memcpy(&dev->scratchpad[2], dev->eeprom, 3);
+            start_phase(dev, DEV_IDLE);
+            break;
+        case CMD_READ_POWER_SUPPLY:
+            start_phase(dev, DEV_POWER_SUPPLY);
+            break;
+        default:
+            start_phase(dev, DEV_IDLE);
+    }
+}
+
+// Runs one time slot on a device. `v` is the level the master writes (1 for
+// read slots). Returns the level the device drives: 0 pulls the bus low.
+static bool device_slot(sim_device_t *dev, bool v)
+{
+    switch (dev->state)
+    {
+        case DEV_IDLE:
+            return 1;
+
+        case DEV_ROM_COMMAND:
+            if (receive(dev, v, 8))
+                rom_command(dev, (uint8_t)dev->acc);
+            return 1;
+
+        case DEV_MATCH_ROM:
+            if (receive(dev, v, 64))
+                start_phase(dev, dev->acc == dev->rom ? DEV_FUNCTION : DEV_IDLE);
+            return 1;
+
+        case DEV_SEARCH:
+        {
+            bool rom_bit = (dev->rom >> dev->bit) & 1;
+            switch (dev->phase++)
+            {
+                case 0:
+                    return rom_bit;
+                case 1:
+                    return !rom_bit;
+                default:
+                    dev->phase = 0;
+                    if (v != rom_bit)
+                        start_phase(dev, DEV_IDLE);
+                    else if (++dev->bit == 64)
+                        start_phase(dev, DEV_FUNCTION);
+                    return 1;
+            }
+        }
+
+        case DEV_FUNCTION:
+            if (receive(dev, v, 8))
+                function_command(dev, (uint8_t)dev->acc);
+            return 1;
+
+        case DEV_WRITE_SCRATCHPAD:
+            if (receive(dev, v, 8))
+            {
+                int expected = dev->family == FAMILY_DS18S20 ? 2 : 3;
+                dev->scratchpad[2 + dev->len++] = (uint8_t)dev->acc;
+                if (dev->len == expected)
+                    start_phase(dev, DEV_IDLE);
+                else
+                    start_phase(dev, DEV_WRITE_SCRATCHPAD);
+            }
+            return 1;
+
+        case DEV_SEND:
+        {
+            bool out = (dev->buf[dev->bit / 8] >> (dev->bit % 8)) & 1;
+            if (++dev->bit == dev->len * 8)
+                start_phase(dev, dev->next_state);
+            return out;
+        }
+
+        case DEV_CONVERTING:
+            update_device(dev);
+            // Parasite powered devices cannot signal completion
+            return dev->parasite || !dev->converting;
+
+        case DEV_POWER_SUPPLY:
+            start_phase(dev, DEV_IDLE);
+            return !dev->parasite;
+    }
+
+    return 1;
+}
+
+static bool bus_slot(bool v)
+{
+    release_strong_pullup();
+    stats.slots++;
+    stats.bus_time_us += ONEWIRE_SIM_SLOT_US;
+    now_us += ONEWIRE_SIM_SLOT_US;
+
+    bool level = v;
+    for (int i = 0; i < device_count; i++)
+        level &= device_slot(&devices[i], v);
+
+    return bus_shorted ? 0 : level;
+}
+
+bool onewire_bus_reset(gpio_num_t pin)
+{
+    (void)pin;
+    release_strong_pullup();
+    stats.resets++;
+    stats.bus_time_us += ONEWIRE_SIM_RESET_US;
+    now_us += ONEWIRE_SIM_RESET_US;
+    update_devices();
+
+    if (bus_shorted)
+        return false;
+
+    for (int i = 0; i < device_count; i++)
+        start_phase(&devices[i], DEV_ROM_COMMAND);
+
+    return device_count > 0;
+}
+
+bool onewire_bus_write_bit(gpio_num_t pin, bool v)
+{
+    (void)pin;
+    bus_slot(v);
+    return !bus_shorted;
+}
+
+int onewire_bus_read_bit(gpio_num_t pin)
+{
+    (void)pin;
+    return bus_slot(1);
+}
+
+bool onewire_bus_write_bytes(gpio_num_t pin, const uint8_t *buf, size_t count)
+{
+    (void)pin;
+    for (size_t i = 0; i < count; i++)
+        for (int b = 0; b < 8; b++)
+            bus_slot((buf[i] >> b) & 1);
+
+    return !bus_shorted;
+}
+
+bool onewire_bus_read_bytes(gpio_num_t pin, uint8_t *buf, size_t count)
+{
+    (void)pin;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t v = 0;
+        for (int b = 0; b < 8; b++)
+            if (bus_slot(1))
+                v |= 1 << b;
+        buf[i] = v;
+    }
+
+    return !bus_shorted;
+}
+
+bool onewire_bus_power(gpio_num_t pin)
+{
+    (void)pin;
+    update_devices();
+    strong_pullup = true;
+    for (int i = 0; i < device_count; i++)
+        devices[i].powered = devices[i].converting;
+
+    return !bus_shorted;
+}
+
+void onewire_bus_depower(gpio_num_t pin)
+{
+    (void)pin;
+    release_strong_pullup();
+}
+
+void onewire_sim_reset(void)
+{
+    memset(devices, 0, sizeof(devices));
+    device_count = 0;
+    bus_shorted = false;
+    strong_pullup = false;
+    now_us = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+int onewire_sim_add_device(uint8_t family, uint64_t serial, float temperature)
+{
+    const uint8_t *scratchpad = default_scratchpad(family);
+    if (!scratchpad || device_count >= ONEWIRE_SIM_MAX_DEVICES)
+        return -1;
+
+    sim_device_t *dev = &devices[device_count];
+    memset(dev, 0, sizeof(*dev));
+
+    uint8_t rom[8];
+    rom[0] = family;
+    for (int i = 1; i < 7; i++)
+        rom[i] = (uint8_t)(serial >> ((i - 1) * 8));
+    rom[7] = onewire_crc8(rom, 7);
+
+    for (int i = 0; i < 8; i++)
+        dev->rom |= (onewire_addr_t)rom[i] << (i * 8);
+    dev->family = family;
+    dev->temperature = temperature;
+    dev->latched = 85.0f;
+    memcpy(dev->scratchpad, scratchpad, 8);
+    memcpy(dev->eeprom, &scratchpad[2], 3);
+    dev->state = DEV_IDLE;
+
+    return device_count++;
+}
+
+onewire_addr_t onewire_sim_get_addr(int device)
+{
+    return devices[device].rom;
+}
+
+void onewire_sim_set_temperature(int device, float temperature)
+{
+    devices[device].temperature = temperature;
+}
+
+void onewire_sim_set_parasite(int device, bool parasite)
+{
+    devices[device].parasite = parasite;
+}
+
+void onewire_sim_inject_crc_error(int device, int count)
+{
+    devices[device].crc_errors = count;
+}
+
+void onewire_sim_set_short(bool shorted)
+{
+    bus_shorted = shorted;
+}
+
+void onewire_sim_advance_us(int64_t us)
+{
+    now_us += us;
+}
+
+int64_t onewire_sim_time_us(void)
+{
+    return now_us;
+}
+
+void onewire_sim_get_stats(onewire_sim_stats_t *out)
+{
+    *out = stats;
+}
+
+void onewire_sim_clear_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,108 @@
+/**
+ * @file onewire_sim.h
+ *
+ * Host-side 1-Wire bus simulator.
+ *
+ * onewire_sim.c implements the onewire_bus_* backend interface on top of a
+ * model of the bus with virtual DS18B20, DS18S20 and MAX31850 devices, so the
+ * protocol layer (onewire.c) and the ds18x20 driver run unmodified on Linux.
+ * The headers in this directory stand in for the ESP-IDF and FreeRTOS ones
+ * these files include; time is virtual and advances with bus traffic and
+ * vTaskDelay().
+ *
+ * Build with this directory first on the include path, e.g.:
+ *
+ *     cc -Icomponents/onewire/sim -Icomponents/onewire -Icomponents/ds18x20 \
+ *        -Icomponents/esp_idf_lib_helpers program.c \
+ *        components/onewire/onewire.c components/onewire/sim/onewire_sim.c \
+ *        components/ds18x20/ds18x20.c -lm
+ *
+ * components/onewire/host_test builds the tests and the bus timing report
+ * this way.
+ */
+#ifndef __ONEWIRE_SIM_H__
+#define __ONEWIRE_SIM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "onewire.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ONEWIRE_SIM_MAX_DEVICES 64
+
+// Modeled bus timings in microseconds (standard speed)
+#define ONEWIRE_SIM_RESET_US 960
+#define ONEWIRE_SIM_SLOT_US  70
+
+typedef struct {
+    uint32_t resets;
+    uint32_t slots;
+    uint32_t crc_errors_injected;
+    int64_t bus_time_us;    //!< Time the bus spent in resets and slots
+} onewire_sim_stats_t;
+
+/**
+ * @brief Remove all devices, clear faults and statistics and rewind the clock.
+ */
+void onewire_sim_reset(void);
+
+/**
+ * @brief Attach a virtual device to the bus.
+ *
+ * @param family      Family code (0x28 DS18B20, 0x10 DS18S20, 0x3b MAX31850)
+ * @param serial      48-bit serial number
+ * @param temperature Initial temperature in degrees Celsius
+ *
+ * @return the device index, or -1 if the family is unknown or the bus is full
+ */
+int onewire_sim_add_device(uint8_t family, uint64_t serial, float temperature);
+
+/**
+ * @brief ROM code of a device, including family and CRC bytes.
+ */
+onewire_addr_t onewire_sim_get_addr(int device);
+
+/**
+ * @brief Temperature latched by the device's next conversion.
+ */
+void onewire_sim_set_temperature(int device, float temperature);
+
+/**
+ * @brief Make the device parasite powered.
+ *
+ * A conversion only completes if the strong pull-up is applied while it
+ * runs; otherwise the scratchpad keeps its power-on value (85 °C).
+ */
+void onewire_sim_set_parasite(int device, bool parasite);
+
+/**
+ * @brief Corrupt the CRC byte of the next `count` scratchpad reads.
+ */
+void onewire_sim_inject_crc_error(int device, int count);
+
+/**
+ * @brief Short the bus to ground. Resets fail and every slot reads 0.
+ */
+void onewire_sim_set_short(bool shorted);
+
+/**
+ * @brief Advance the virtual clock.
+ */
+void onewire_sim_advance_us(int64_t us);
+
+/**
+ * @brief Current virtual time in microseconds.
+ */
+int64_t onewire_sim_time_us(void);
+
+void onewire_sim_get_stats(onewire_sim_stats_t *stats);
+void onewire_sim_clear_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __ONEWIRE_SIM_H__ */
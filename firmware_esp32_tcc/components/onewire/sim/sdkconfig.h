@@ -0,0 +1,8 @@
+/* Host configuration for the 1-Wire simulator, see onewire_sim.h */
+#pragma once
+
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_ONEWIRE_BACKEND_SIM 1
+#ifndef ONEWIRE_SIM_BITWISE_CRC8
+#define CONFIG_ONEWIRE_CRC8_TABLE 1
+#endif
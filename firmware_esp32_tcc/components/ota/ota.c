@@ -6,6 +6,8 @@
 #include "esp_log.h"
 
 #include "mqtt_service.h"
+#include "sleep_manager.h"
+#include "pm_policy.h"
 
 static const char *TAG = "simple_ota_example";
 
@@ -42,31 +44,33 @@ static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 
 static void ota_task(void *pvParameter)
 {
-    EventBits_t uxBits;
     while (1) {
-        uxBits = mqtt_event_get_bits();
-        if (uxBits & MQTT_OTA_EVENT) {
-            ESP_LOGI(TAG, "Starting OTA example task");
-            esp_http_client_config_t config = {
-                .url = ota_url,
-                .event_handler = _http_event_handler,
-                .keep_alive_enable = true,
-            };
+        // The bit stays set until the attempt fails, a successful update reboots
+        mqtt_event_wait_bits(MQTT_OTA_EVENT, portMAX_DELAY);
 
-            esp_https_ota_config_t ota_config = {
-                .http_config = &config,
-            };
-            ESP_LOGI(TAG, "Attempting to download update from %s", config.url);
-            esp_err_t ret = esp_https_ota(&ota_config);
-            if (ret == ESP_OK) {
-                ESP_LOGI(TAG, "OTA Succeed, Rebooting...");
-                esp_restart();
-            } else {
-                ESP_LOGE(TAG, "Firmware upgrade failed");
-                mqtt_event_clear_bits(MQTT_OTA_EVENT);
-            }
+        ESP_LOGI(TAG, "Starting OTA example task");
+        esp_http_client_config_t config = {
+            .url = ota_url,
+            .event_handler = _http_event_handler,
+            .keep_alive_enable = true,
+        };
+
+        esp_https_ota_config_t ota_config = {
+            .http_config = &config,
+        };
+        ESP_LOGI(TAG, "Attempting to download update from %s", config.url);
+        sleep_manager_hold();
+        pm_policy_boost(PM_PHASE_OTA);
+        esp_err_t ret = esp_https_ota(&ota_config);
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "OTA Succeed, Rebooting...");
+            esp_restart();
+        } else {
+            ESP_LOGE(TAG, "Firmware upgrade failed");
+            mqtt_event_clear_bits(MQTT_OTA_EVENT);
         }
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        pm_policy_unboost(PM_PHASE_OTA);
+        sleep_manager_release();
     }
 }
 
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+// Frequency bounds for dynamic frequency scaling. The CPU idles at
+// PM_MIN_FREQ_MHZ and, with CONFIG_FREERTOS_USE_TICKLESS_IDLE, light sleeps
+// through idle gaps such as the sensor settling delays. The heavy phases
+// below run at PM_MAX_FREQ_MHZ.
+#define PM_MAX_FREQ_MHZ 240
+#define PM_MIN_FREQ_MHZ 40
+
+// Interval of the time-per-frequency report in the log. Only the time at
+// PM_MAX_FREQ_MHZ is measured here; the split between the lower frequencies
+// and light sleep is only printed with CONFIG_PM_PROFILING.
+#define PM_REPORT_INTERVAL_S 3600
+
+typedef enum {
+    PM_PHASE_OTA,               // firmware download and flash write
+    PM_PHASE_MQTT_CONNECT,      // TCP and TLS handshake with the broker
+    PM_PHASE_UPLOAD,            // batch drain of the flash log
+    PM_PHASE_COUNT
+} pm_phase_t;
+
+typedef struct {
+    int64_t uptime_us;
+    int64_t max_freq_us;                    // at PM_MAX_FREQ_MHZ, any phase active
+    int64_t phase_us[PM_PHASE_COUNT];       // held by each phase
+    uint32_t phase_count[PM_PHASE_COUNT];
+} pm_policy_stats_t;
+
+void pm_policy_init(void);
+void pm_policy_boost(pm_phase_t phase);
+void pm_policy_unboost(pm_phase_t phase);
+void pm_policy_get_stats(pm_policy_stats_t *stats);
+void pm_policy_report(void);
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+
+#include "pm_policy.h"
+
+const static char *TAG = "pm_policy";
+
+static const char *phase_names[PM_PHASE_COUNT] = {
+    "ota",
+    "mqtt_connect",
+    "upload",
+};
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool held[PM_PHASE_COUNT];
+static int64_t held_since_us[PM_PHASE_COUNT];
+static int64_t phase_us[PM_PHASE_COUNT];
+static uint32_t phase_count[PM_PHASE_COUNT];
+static int active_phases;
+static int64_t max_freq_since_us;
+static int64_t max_freq_us;
+
+#if CONFIG_PM_ENABLE
+// One lock per phase, so that esp_pm_dump_locks() shows each of them
+static esp_pm_lock_handle_t locks[PM_PHASE_COUNT];
+static esp_timer_handle_t report_timer;
+
+static void report_timer_callback(void *arg) {
+    pm_policy_report();
+}
+#endif
+
+void pm_policy_init(void) {
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = PM_MAX_FREQ_MHZ,
+        .min_freq_mhz = PM_MIN_FREQ_MHZ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#endif
+    };
+    ESP_ERROR_CHECK( esp_pm_configure(&pm_config) );
+
+    for (int i = 0; i < PM_PHASE_COUNT; i++) {
+        ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, phase_names[i], &locks[i]));
+    }
+
+    const esp_timer_create_args_t report_timer_args = {
+        .callback = report_timer_callback,
+        .name = "pm_report",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&report_timer_args, &report_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(report_timer, PM_REPORT_INTERVAL_S * 1000000LL));
+#endif
+}
+
+// Runs the CPU at PM_MAX_FREQ_MHZ until pm_policy_unboost(). A phase is
+// either boosted or not, repeated calls are ignored.
+void pm_policy_boost(pm_phase_t phase) {
+    int64_t now_us = esp_timer_get_time();
+    bool changed = false;
+
+    portENTER_CRITICAL(&stats_lock);
+    if (!held[phase]) {
+        held[phase] = true;
+        held_since_us[phase] = now_us;
+        phase_count[phase]++;
+        if (active_phases++ == 0) {
+            max_freq_since_us = now_us;
+        }
+        changed = true;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+#if CONFIG_PM_ENABLE
+    if (changed) {
+        esp_pm_lock_acquire(locks[phase]);
+    }
+#endif
+}
+
+void pm_policy_unboost(pm_phase_t phase) {
+    int64_t now_us = esp_timer_get_time();
+    bool changed = false;
+
+    portENTER_CRITICAL(&stats_lock);
+    if (held[phase]) {
+        held[phase] = false;
+        phase_us[phase] += now_us - held_since_us[phase];
+        if (--active_phases == 0) {
+            max_freq_us += now_us - max_freq_since_us;
+        }
+        changed = true;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+#if CONFIG_PM_ENABLE
+    if (changed) {
+        esp_pm_lock_release(locks[phase]);
+    }
+#endif
+}
+
+// Includes the phases still running
+void pm_policy_get_stats(pm_policy_stats_t *stats) {
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&stats_lock);
+    stats->uptime_us = now_us;
+    stats->max_freq_us = max_freq_us + (active_phases > 0 ? now_us - max_freq_since_us : 0);
+    for (int i = 0; i < PM_PHASE_COUNT; i++) {
+        stats->phase_us[i] = phase_us[i] + (held[i] ? now_us - held_since_us[i] : 0);
+        stats->phase_count[i] = phase_count[i];
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void pm_policy_report(void) {
+    pm_policy_stats_t stats;
+
+    pm_policy_get_stats(&stats);
+    ESP_LOGI(TAG, "%d MHz for %" PRId64 " ms of %" PRId64 " ms uptime, lower frequencies and light sleep the rest",
+             PM_MAX_FREQ_MHZ, stats.max_freq_us / 1000, stats.uptime_us / 1000);
+    for (int i = 0; i < PM_PHASE_COUNT; i++) {
+        ESP_LOGI(TAG, "  %s: %" PRId64 " ms in %" PRIu32 " run(s)", phase_names[i],
+                 stats.phase_us[i] / 1000, stats.phase_count[i]);
+    }
+
+#if CONFIG_PM_PROFILING
+    // Time in each mode: CPU_MAX, APB_MAX, APB_MIN and light sleep
+    esp_pm_dump_locks(stdout);
+#endif
+}
@@ -0,0 +1,166 @@
+// Compares the plain truncating average that adc_manager used to compute with
+// sample_filter_robust_mean() on synthetic ADC windows (white noise plus
+// switching glitches), and times the filters on the host.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "sample_filter.h"
+
+#define TRIALS 20000
+#define LEVEL 1500              // true reading, ADC counts
+#define NOISE_SIGMA 8.0         // white noise, ADC counts
+#define GLITCH_PERCENT 5        // chance of an impulse on any sample
+#define GLITCH_FIRST_PERCENT 50 // chance of a glitch on the first sample after power on
+// Per-channel rate of a 4-channel capture at ADC_CAPTURE_FREQ_HZ (20 kHz)
+#define CHANNEL_RATE_HZ 5000
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double rng_uniform(void)
+{
+    return (rng_next() + 1.0) / 4294967297.0;
+}
+
+static double rng_gaussian(void)
+{
+    return sqrt(-2.0 * log(rng_uniform())) * cos(2.0 * M_PI * rng_uniform());
+}
+
+static void make_window(int32_t *samples, int n)
+{
+    for (int i = 0; i < n; i++) {
+        double value = LEVEL + NOISE_SIGMA * rng_gaussian();
+        int percent = (i == 0) ? GLITCH_FIRST_PERCENT : GLITCH_PERCENT;
+        if ((int)(rng_next() % 100) < percent) {
+            value += (rng_next() & 1 ? 1 : -1) * (500.0 + rng_next() % 1500);
+        }
+        samples[i] = value < 0 ? 0 : (value > 4095 ? 4095 : lrint(value));
+    }
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void accuracy(void)
+{
+    static const int sizes[] = { 4, 8, 10, 16, 32, 64 };
+    static double plain_err[TRIALS], robust_err[TRIALS];
+    int32_t samples[SAMPLE_FILTER_MAX_WINDOW], scratch[SAMPLE_FILTER_MAX_WINDOW];
+
+    printf("Error against the true level (%d counts, noise sigma %.0f, %d%% glitches, %d%% on the first sample)\n",
+           LEVEL, NOISE_SIGMA, GLITCH_PERCENT, GLITCH_FIRST_PERCENT);
+    printf("%4s %9s %14s %14s %14s %14s\n", "n", "on (ms)", "plain rms", "plain p99", "robust rms", "robust p99");
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int n = sizes[s];
+        double plain_sq = 0, robust_sq = 0;
+
+        for (int t = 0; t < TRIALS; t++) {
+            int64_t sum = 0;
+
+            make_window(samples, n);
+            for (int i = 0; i < n; i++) {
+                sum += samples[i];
+            }
+            plain_err[t] = fabs((double)(sum / n) - LEVEL);
+            robust_err[t] = fabs((double)sample_filter_robust_mean(samples, n, scratch) - LEVEL);
+            plain_sq += plain_err[t] * plain_err[t];
+            robust_sq += robust_err[t] * robust_err[t];
+        }
+
+        qsort(plain_err, TRIALS, sizeof(double), compare_double);
+        qsort(robust_err, TRIALS, sizeof(double), compare_double);
+        printf("%4d %9.1f %14.2f %14.2f %14.2f %14.2f\n", n, n * 1000.0 / CHANNEL_RATE_HZ,
+               sqrt(plain_sq / TRIALS), plain_err[TRIALS * 99 / 100],
+               sqrt(robust_sq / TRIALS), robust_err[TRIALS * 99 / 100]);
+    }
+}
+
+static void timing(void)
+{
+    static const int sizes[] = { 10, 32, 64 };
+    int32_t windows[64][SAMPLE_FILTER_MAX_WINDOW], work[SAMPLE_FILTER_MAX_WINDOW], scratch[SAMPLE_FILTER_MAX_WINDOW];
+    volatile int32_t sink = 0;
+
+    for (int w = 0; w < 64; w++) {
+        make_window(windows[w], SAMPLE_FILTER_MAX_WINDOW);
+    }
+
+    printf("\nHost time per call (ns)\n");
+    printf("%4s %10s %14s %10s %12s\n", "n", "median", "trimmed mean", "hampel", "robust mean");
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int n = sizes[s];
+        double start, elapsed[4];
+
+        start = now_ns();
+        for (int t = 0; t < TRIALS; t++) {
+            sink += sample_filter_median(windows[t % 64], n, scratch);
+        }
+        elapsed[0] = now_ns() - start;
+
+        start = now_ns();
+        for (int t = 0; t < TRIALS; t++) {
+            sink += sample_filter_trimmed_mean(windows[t % 64], n, n / 10, scratch);
+        }
+        elapsed[1] = now_ns() - start;
+
+        // The copy into work is part of every Hampel iteration
+        start = now_ns();
+        for (int t = 0; t < TRIALS; t++) {
+            for (int i = 0; i < n; i++) {
+                work[i] = windows[t % 64][i];
+            }
+            sink += sample_filter_hampel(work, n, 3 << 8, scratch);
+        }
+        elapsed[2] = now_ns() - start;
+
+        start = now_ns();
+        for (int t = 0; t < TRIALS; t++) {
+            for (int i = 0; i < n; i++) {
+                work[i] = windows[t % 64][i];
+            }
+            sink += sample_filter_robust_mean(work, n, scratch);
+        }
+        elapsed[3] = now_ns() - start;
+
+        printf("%4d %10.0f %14.0f %10.0f %12.0f\n", n,
+               elapsed[0] / TRIALS, elapsed[1] / TRIALS, elapsed[2] / TRIALS, elapsed[3] / TRIALS);
+    }
+
+    sample_ema_t ema;
+    double start = now_ns();
+    sample_ema_init(&ema, SAMPLE_FILTER_ONE / 4);
+    for (int t = 0; t < TRIALS * 64; t++) {
+        sink += sample_ema_update(&ema, windows[t % 64][t % SAMPLE_FILTER_MAX_WINDOW]);
+    }
+    printf("EMA update: %.1f ns\n", (now_ns() - start) / (TRIALS * 64));
+    (void)sink;
+}
+
+int main(void)
+{
+    accuracy();
+    timing();
+    return 0;
+}
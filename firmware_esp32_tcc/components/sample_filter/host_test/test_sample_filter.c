@@ -0,0 +1,154 @@
+#include <stdio.h>
+
+#include "sample_filter.h"
+
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+static int failures;
+
+#define CHECK_EQ(actual, expected) do { \
+    long long a_ = (actual), e_ = (expected); \
+    if (a_ != e_) { \
+        printf("%s:%d: %s = %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+        failures++; \
+    } \
+} while (0)
+
+static int32_t scratch[SAMPLE_FILTER_MAX_WINDOW];
+
+static void test_median(void)
+{
+    const int32_t odd[] = { 9, 1, 5, 3, 7 };
+    const int32_t even[] = { 4, 1, 2, 3 };
+    const int32_t negative[] = { -3, -4 };
+
+    CHECK_EQ(sample_filter_median(odd, COUNT(odd), scratch), 5);
+    // Even windows average the middle pair, rounding half away from zero
+    CHECK_EQ(sample_filter_median(even, COUNT(even), scratch), 3);
+    CHECK_EQ(sample_filter_median(negative, COUNT(negative), scratch), -4);
+    CHECK_EQ(sample_filter_median(odd, 0, scratch), 0);
+    // The input is left untouched
+    CHECK_EQ(odd[0], 9);
+}
+
+static void test_trimmed_mean(void)
+{
+    const int32_t ramp[] = { 10, 1, 9, 2, 8, 3, 7, 4, 6, 5 };
+    const int32_t glitch[] = { 100, 102, 98, 101, 99, 4095 };
+
+    // 2..9 averages to 5.5
+    CHECK_EQ(sample_filter_trimmed_mean(ramp, COUNT(ramp), 1, scratch), 6);
+    CHECK_EQ(sample_filter_trimmed_mean(ramp, COUNT(ramp), 0, scratch), 6);
+    // Only 5 and 6 are left
+    CHECK_EQ(sample_filter_trimmed_mean(ramp, COUNT(ramp), 4, scratch), 6);
+    // Trimming everything falls back to the middle samples
+    CHECK_EQ(sample_filter_trimmed_mean(ramp, COUNT(ramp), 5, scratch), 6);
+    CHECK_EQ(sample_filter_trimmed_mean(glitch, COUNT(glitch), 1, scratch), 101);
+}
+
+static void test_hampel(void)
+{
+    int32_t spike[] = { 100, 101, 99, 100, 102, 98, 100, 4000 };
+    int32_t dip[] = { 2000, 2003, 1998, 2001, 12, 1999, 2002, 2000, 2001 };
+    int32_t clean[] = { 100, 104, 96, 101, 99, 103, 97, 100 };
+
+    CHECK_EQ(sample_filter_hampel(spike, COUNT(spike), 3 << 8, scratch), 1);
+    CHECK_EQ(spike[7], 100);
+    CHECK_EQ(spike[0], 100);
+
+    CHECK_EQ(sample_filter_hampel(dip, COUNT(dip), 3 << 8, scratch), 1);
+    CHECK_EQ(dip[4], 2000);
+
+    CHECK_EQ(sample_filter_hampel(clean, COUNT(clean), 3 << 8, scratch), 0);
+    CHECK_EQ(clean[1], 104);
+
+    // Too short for a meaningful median
+    int32_t pair[] = { 1, 1000 };
+    CHECK_EQ(sample_filter_hampel(pair, COUNT(pair), 3 << 8, scratch), 0);
+}
+
+static void test_hampel_mad_floor(void)
+{
+    int32_t flat[16];
+    int32_t quantised[10] = { 50, 50, 50, 50, 50, 50, 50, 50, 50, 53 };
+    int32_t outlier[10] = { 50, 50, 50, 50, 50, 50, 50, 50, 50, 60 };
+
+    for (int i = 0; i < COUNT(flat); i++) {
+        flat[i] = 1234;
+    }
+    CHECK_EQ(sample_filter_hampel(flat, COUNT(flat), 3 << 8, scratch), 0);
+    CHECK_EQ(flat[0], 1234);
+
+    // The MAD is 0 here; the one-count floor keeps a few counts of
+    // quantisation noise (threshold 3 * 1.4826 -> 4 counts)...
+    CHECK_EQ(sample_filter_hampel(quantised, COUNT(quantised), 3 << 8, scratch), 0);
+    CHECK_EQ(quantised[9], 53);
+
+    // ...but still rejects a real outlier
+    CHECK_EQ(sample_filter_hampel(outlier, COUNT(outlier), 3 << 8, scratch), 1);
+    CHECK_EQ(outlier[9], 50);
+}
+
+static void test_robust_mean(void)
+{
+    int32_t glitch[20];
+
+    // A switching glitch on the first sample after the sensor is powered
+    glitch[0] = 4095;
+    for (int i = 1; i < COUNT(glitch); i++) {
+        glitch[i] = 1000 + (i % 3) - 1;
+    }
+    CHECK_EQ(sample_filter_robust_mean(glitch, COUNT(glitch), scratch), 1000);
+
+    int32_t single[] = { 42 };
+    CHECK_EQ(sample_filter_robust_mean(single, COUNT(single), scratch), 42);
+}
+
+static void test_ema(void)
+{
+    sample_ema_t ema;
+
+    sample_ema_init(&ema, SAMPLE_FILTER_ONE / 2);
+    // The first sample primes the filter
+    CHECK_EQ(sample_ema_update(&ema, 100), 100);
+    CHECK_EQ(sample_ema_update(&ema, 200), 150);
+    CHECK_EQ(sample_ema_update(&ema, 200), 175);
+
+    // Step response with alpha = 1/4 converges to the new level
+    sample_ema_init(&ema, SAMPLE_FILTER_ONE / 4);
+    sample_ema_update(&ema, 0);
+    int32_t value = 0;
+    for (int i = 0; i < 64; i++) {
+        value = sample_ema_update(&ema, 1000);
+    }
+    CHECK_EQ(value, 1000);
+
+    // Values past the 16-bit range, which a Q16 int32_t could not hold
+    sample_ema_init(&ema, SAMPLE_FILTER_ONE / 2);
+    CHECK_EQ(sample_ema_update(&ema, 100000), 100000);
+    CHECK_EQ(sample_ema_update(&ema, -100000), 0);
+    CHECK_EQ(sample_ema_update(&ema, -SAMPLE_FILTER_EMA_LIMIT), -SAMPLE_FILTER_EMA_LIMIT / 2);
+    CHECK_EQ(sample_ema_update(&ema, SAMPLE_FILTER_EMA_LIMIT), SAMPLE_FILTER_EMA_LIMIT / 4);
+
+    // alpha is clamped to 1, which tracks the input exactly
+    sample_ema_init(&ema, 2 * SAMPLE_FILTER_ONE);
+    sample_ema_update(&ema, 5);
+    CHECK_EQ(sample_ema_update(&ema, -7), -7);
+}
+
+int main(void)
+{
+    test_median();
+    test_trimmed_mean();
+    test_hampel();
+    test_hampel_mad_floor();
+    test_robust_mean();
+    test_ema();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All sample_filter checks passed\n");
+    return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Integer-only robust statistics over small sample windows. The component has
+// no IDF dependencies so it can also be compiled on the host.
+
+#define SAMPLE_FILTER_MAX_WINDOW 64
+#define SAMPLE_FILTER_Q 16
+#define SAMPLE_FILTER_ONE (1 << SAMPLE_FILTER_Q)
+// 1.4826 (MAD to standard deviation for normal noise) in Q8
+#define SAMPLE_FILTER_MAD_SCALE_Q8 380
+// Largest magnitude sample_ema_update() accepts without overflowing
+#define SAMPLE_FILTER_EMA_LIMIT (1 << 29)
+
+typedef struct {
+    int64_t value_q16;
+    uint32_t alpha_q16;
+    bool primed;
+} sample_ema_t;
+
+int32_t sample_filter_median(const int32_t *samples, int n, int32_t *scratch);
+int32_t sample_filter_trimmed_mean(const int32_t *samples, int n, int trim, int32_t *scratch);
+int sample_filter_hampel(int32_t *samples, int n, int k_q8, int32_t *scratch);
+int32_t sample_filter_robust_mean(int32_t *samples, int n, int32_t *scratch);
+
+void sample_ema_init(sample_ema_t *ema, uint32_t alpha_q16);
+int32_t sample_ema_update(sample_ema_t *ema, int32_t sample);
@@ -0,0 +1,130 @@
+#include <string.h>
+#include <assert.h>
+
+#include "sample_filter.h"
+
+// Hampel threshold (in MADs) and trim ratio used by sample_filter_robust_mean
+#define ROBUST_HAMPEL_K_Q8 (3 << 8)
+#define ROBUST_TRIM_DIVISOR 10
+
+static int32_t div_round(int64_t num, int32_t den)
+{
+    return (int32_t)((num >= 0 ? num + den / 2 : num - den / 2) / den);
+}
+
+// Insertion sort: windows are at most SAMPLE_FILTER_MAX_WINDOW long and
+// usually already close to sorted, where this beats anything fancier.
+static void sort_samples(int32_t *samples, int n)
+{
+    for (int i = 1; i < n; i++) {
+        int32_t value = samples[i];
+        int j = i - 1;
+        while (j >= 0 && samples[j] > value) {
+            samples[j + 1] = samples[j];
+            j--;
+        }
+        samples[j + 1] = value;
+    }
+}
+
+static int32_t median_sorted(const int32_t *sorted, int n)
+{
+    if (n & 1) {
+        return sorted[n / 2];
+    }
+    return div_round((int64_t)sorted[n / 2 - 1] + sorted[n / 2], 2);
+}
+
+int32_t sample_filter_median(const int32_t *samples, int n, int32_t *scratch)
+{
+    if (n <= 0) {
+        return 0;
+    }
+    memcpy(scratch, samples, n * sizeof(int32_t));
+    sort_samples(scratch, n);
+    return median_sorted(scratch, n);
+}
+
+// Mean of the samples left after dropping the `trim` lowest and highest ones
+int32_t sample_filter_trimmed_mean(const int32_t *samples, int n, int trim, int32_t *scratch)
+{
+    if (n <= 0) {
+        return 0;
+    }
+    if (trim < 0 || 2 * trim >= n) {
+        trim = (n - 1) / 2;
+    }
+
+    memcpy(scratch, samples, n * sizeof(int32_t));
+    sort_samples(scratch, n);
+
+    int64_t sum = 0;
+    for (int i = trim; i < n - trim; i++) {
+        sum += scratch[i];
+    }
+    return div_round(sum, n - 2 * trim);
+}
+
+// Replaces every sample further than k MADs (k in Q8) from the window median
+// with the median itself. Returns the number of samples replaced.
+int sample_filter_hampel(int32_t *samples, int n, int k_q8, int32_t *scratch)
+{
+    if (n < 3) {
+        return 0;
+    }
+
+    int32_t median = sample_filter_median(samples, n, scratch);
+
+    for (int i = 0; i < n; i++) {
+        int32_t deviation = samples[i] - median;
+        scratch[i] = deviation < 0 ? -deviation : deviation;
+    }
+    sort_samples(scratch, n);
+    int64_t mad = median_sorted(scratch, n);
+
+    // A zero MAD means more than half of the window agrees exactly; keep a
+    // one-count floor so quantisation noise is not treated as an outlier.
+    if (mad == 0) {
+        mad = 1;
+    }
+    int64_t threshold = (mad * SAMPLE_FILTER_MAD_SCALE_Q8 * k_q8) >> 16;
+
+    int replaced = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t deviation = (int64_t)samples[i] - median;
+        if (deviation > threshold || -deviation > threshold) {
+            samples[i] = median;
+            replaced++;
+        }
+    }
+    return replaced;
+}
+
+// Hampel outlier rejection followed by a 10% trimmed mean
+int32_t sample_filter_robust_mean(int32_t *samples, int n, int32_t *scratch)
+{
+    sample_filter_hampel(samples, n, ROBUST_HAMPEL_K_Q8, scratch);
+    return sample_filter_trimmed_mean(samples, n, n / ROBUST_TRIM_DIVISOR, scratch);
+}
+
+void sample_ema_init(sample_ema_t *ema, uint32_t alpha_q16)
+{
+    ema->value_q16 = 0;
+    ema->alpha_q16 = alpha_q16 > SAMPLE_FILTER_ONE ? SAMPLE_FILTER_ONE : alpha_q16;
+    ema->primed = false;
+}
+
+int32_t sample_ema_update(sample_ema_t *ema, int32_t sample)
+{
+    assert(sample >= -SAMPLE_FILTER_EMA_LIMIT && sample <= SAMPLE_FILTER_EMA_LIMIT);
+    int64_t sample_q16 = (int64_t)sample << SAMPLE_FILTER_Q;
+
+    if (!ema->primed) {
+        ema->value_q16 = sample_q16;
+        ema->primed = true;
+    } else {
+        ema->value_q16 += ((sample_q16 - ema->value_q16) * ema->alpha_q16) >> SAMPLE_FILTER_Q;
+    }
+
+    return div_round(ema->value_q16, SAMPLE_FILTER_ONE);
+}
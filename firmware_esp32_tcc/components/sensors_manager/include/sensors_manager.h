@@ -1,10 +1,39 @@
 #pragma once
 
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_bit_defs.h"
+
 #define TURBIDITY_MAX 2300
 #define CALIBRACAO_PH6_86 1.735
 #define CALIBRACAO_PH_9_18 1.473
+#define SENSOR_SAMPLES 10
+// TDS readings are compensated to this temperature (degrees C)
+#define TDS_REFERENCE_TEMPERATURE 25.0f
+#define SENSORS_COMMAND_QUEUE_LENGTH 4
+
+// Measurements run at local hours that are multiples of the interval
+#define SENSORS_MEASURE_INTERVAL_HOURS 3
+#define SENSORS_SCHEDULE_RECHECK_S 3600
+// RTC clock drift tolerated over a deep sleep: a timer wake this early still
+// takes the reading of the slot it was set for
+#define SENSORS_EARLY_WAKE_TOLERANCE_S 300
+
+// Notification bits of the sensors manager task
+#define SENSORS_NOTIFY_SCHEDULE BIT0
+#define SENSORS_NOTIFY_MEASURE_NOW BIT1
+#define SENSORS_NOTIFY_TIME_VALID BIT2
 
-extern SemaphoreHandle_t adc_mutex;
+// Board wiring, shared with adc_manager and ulp_sampler: the GPIO that
+// powers each sensor and the ADC1 channel it is read on
+#define TEMPERATURE_SENSOR_POWER_GPIO GPIO_NUM_16
+#define TDS_SENSOR_POWER_GPIO GPIO_NUM_17
+#define PH_SENSOR_POWER_GPIO GPIO_NUM_18
+#define TURBIDITY_SENSOR_POWER_GPIO GPIO_NUM_19
+#define TEMPERATURE_SENSOR_ADC_CHANNEL ADC_CHANNEL_0
+#define TDS_SENSOR_ADC_CHANNEL ADC_CHANNEL_3
+#define PH_SENSOR_ADC_CHANNEL ADC_CHANNEL_4
+#define TURBIDITY_SENSOR_ADC_CHANNEL ADC_CHANNEL_5
 
 typedef enum {
     TEMPERATURE_SENSOR,
@@ -13,7 +42,29 @@ typedef enum {
     TURBIDITY_SENSOR
 } sensor_type_t;
 
+// esp_timer timestamps of the phases of the last measurement cycle
+typedef struct {
+    int64_t start_us;
+    int64_t conversion_started_us;
+    int64_t turbidity_ph_done_us;
+    int64_t tds_done_us;
+    int64_t temperature_done_us;
+    int64_t end_us;
+} sensors_cycle_timing_t;
+
+typedef enum {
+    SENSORS_COMMAND_PH_CALIBRATION,
+    SENSORS_COMMAND_TDS_CALIBRATION,
+    SENSORS_COMMAND_RESCAN_PROBES
+} sensors_command_type_t;
+
+typedef struct {
+    sensors_command_type_t type;
+    float value;    // expected reading of the calibration solution, if any
+} sensors_command_t;
 
 void init_sensors_task(void);
-void init_calibrate_ph_task(float *expected_value);
-void init_calibrate_tds_task(float *expected_value);
+void sensors_manager_get_cycle_timing(sensors_cycle_timing_t *timing);
+void sensors_request_measurement(void);
+void sensors_time_synced(void);
+esp_err_t sensors_command_submit(sensors_command_type_t type, float value);
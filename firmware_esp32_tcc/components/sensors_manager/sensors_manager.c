@@ -1,7 +1,13 @@
 #include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
 #include "driver/gpio.h"
 #include <time.h>
 #include <math.h>
@@ -12,30 +18,49 @@
 #include "sensors_manager.h"
 #include "adc_manager.h"
 #include "ds18x20.h"
+#include "temperature_probes.h"
+#include "telemetry.h"
 #include "mqtt_service.h"
 #include "device_info.h"
 #include "time_sync.h"
+#include "sleep_manager.h"
+#include "batch_policy.h"
+#include "ulp_sampler.h"
 
 const static char *TAG = "sensors_manager";
 
-SemaphoreHandle_t adc_mutex = NULL;
-
 static const gpio_num_t sensor_pins[] = {
-    GPIO_NUM_16,
-    GPIO_NUM_17,
-    GPIO_NUM_18,
-    GPIO_NUM_19
+    [TEMPERATURE_SENSOR] = TEMPERATURE_SENSOR_POWER_GPIO,
+    [TDS_SENSOR] = TDS_SENSOR_POWER_GPIO,
+    [PH_SENSOR] = PH_SENSOR_POWER_GPIO,
+    [TURBIDITY_SENSOR] = TURBIDITY_SENSOR_POWER_GPIO
 };
 
-static const onewire_addr_t TEMPERATURE_SENSOR_ADDR = 0x5e00000000f59728;
+static const gpio_num_t TEMPERATURE_SENSOR_PIN = GPIO_NUM_4;
+static const ds18x20_resolution_t TEMPERATURE_SENSOR_RESOLUTION = DS18X20_RESOLUTION_12_BIT;
+
+// Sensor leases taken by each kind of measurement
+#define CYCLE_SENSORS_MASK (ADC_SENSOR_BIT(TEMPERATURE_SENSOR) | ADC_SENSOR_BIT(TDS_SENSOR) | \
+                            ADC_SENSOR_BIT(PH_SENSOR) | ADC_SENSOR_BIT(TURBIDITY_SENSOR))
+#define TDS_CALIBRATION_SENSORS_MASK (ADC_SENSOR_BIT(TEMPERATURE_SENSOR) | ADC_SENSOR_BIT(TDS_SENSOR))
+
+static sensors_cycle_timing_t last_cycle_timing;
+static QueueHandle_t command_queue;
+static TaskHandle_t sensors_task_handle;
+static esp_timer_handle_t schedule_timer;
 
 // Flash memory
 nvs_handle_t my_handle;
 
-// Sensors variables
-float ph_voltage_6_86 = 1.735;
-float ph_voltage_9_18 = 1.473;
-float tds_correction_factor = 842 / (float) 930;
+// Sensors variables, kept in RTC memory so a wake from deep sleep skips NVS
+RTC_DATA_ATTR float ph_voltage_6_86 = 1.735;
+RTC_DATA_ATTR float ph_voltage_9_18 = 1.473;
+RTC_DATA_ATTR float tds_correction_factor = 842 / (float) 930;
+RTC_DATA_ATTR static bool calibration_loaded;
+// Local hour of the last scheduled reading
+RTC_DATA_ATTR static int last_measure_time = -1;
+// Slot the last schedule was armed for, so a timer wake knows what it is for
+RTC_DATA_ATTR static time_t next_slot;
 
 static void enable_sensor(sensor_type_t sensor_type) {
     gpio_set_level(sensor_pins[sensor_type], 1);
@@ -45,76 +70,229 @@ static void disable_sensor(sensor_type_t sensor_type) {
     gpio_set_level(sensor_pins[sensor_type], 0);
 }
 
+// The DS18B20 conversion runs unattended, so it is started first and the ADC
+// sensors are read while it is in progress. Turbidity and pH sit on separate
+// ADC channels and are powered and sampled together; the TDS probe excites
+// the water and would disturb the pH probe, so it gets a phase of its own.
+// Returns the TELEMETRY_HAS_* bits of the readings that succeeded.
+static uint8_t measure_sensors(int *turbidity_adc_value, float *ph_voltage, float *tds_voltage, float *temperatures) {
+    adc_reading_t readings[SENSOR_LENGTH] = {0};
+    sensors_cycle_timing_t timing = {0};
+    ds18x20_conversion_t conversion = {0};
+    uint8_t valid = 0;
+    esp_err_t err;
+
+    timing.start_us = esp_timer_get_time();
+
+    enable_sensor(TEMPERATURE_SENSOR);
+    esp_err_t temperature_err = temperature_probes_start(&conversion);
+    if (temperature_err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start temperature conversion: %s", esp_err_to_name(temperature_err));
+        for (int i = 0; i < TEMPERATURE_PROBES_MAX; i++) {
+            temperatures[i] = NAN;
+        }
+    }
+    timing.conversion_started_us = esp_timer_get_time();
+
+    enable_sensor(TURBIDITY_SENSOR);
+    enable_sensor(PH_SENSOR);
+    vTaskDelay(pdMS_TO_TICKS(ADC_SETTLING_TIME_MS));
+    err = adc_read_sensors(ADC_SENSOR_BIT(TURBIDITY_SENSOR) | ADC_SENSOR_BIT(PH_SENSOR), readings, SENSOR_SAMPLES);
+    disable_sensor(TURBIDITY_SENSOR);
+    disable_sensor(PH_SENSOR);
+    if (err == ESP_OK) {
+        valid |= TELEMETRY_HAS_TURBIDITY | TELEMETRY_HAS_PH;
+    } else {
+        ESP_LOGE(TAG, "Failed to read turbidity and pH: %s", esp_err_to_name(err));
+    }
+    timing.turbidity_ph_done_us = esp_timer_get_time();
+
+    enable_sensor(TDS_SENSOR);
+    vTaskDelay(pdMS_TO_TICKS(ADC_SETTLING_TIME_MS));
+    err = adc_read_sensors(ADC_SENSOR_BIT(TDS_SENSOR), readings, SENSOR_SAMPLES);
+    disable_sensor(TDS_SENSOR);
+    if (err == ESP_OK) {
+        valid |= TELEMETRY_HAS_TDS;
+    } else {
+        ESP_LOGE(TAG, "Failed to read TDS: %s", esp_err_to_name(err));
+    }
+    // Reference for the ULP sampler during the next deep sleep
+    if ((valid & TELEMETRY_HAS_TURBIDITY) && (valid & TELEMETRY_HAS_TDS)) {
+        ulp_sampler_set_baseline(readings[TURBIDITY_SENSOR].raw, readings[TDS_SENSOR].raw);
+    }
+    timing.tds_done_us = esp_timer_get_time();
+
+    if (temperature_err == ESP_OK) {
+        // Only the primary probe decides; a failed secondary probe reads NAN
+        temperature_err = temperature_probes_finish(&conversion, temperatures);
+        if (temperature_err == ESP_OK && !isnan(temperatures[TEMPERATURE_PROBE_PRIMARY])) {
+            valid |= TELEMETRY_HAS_TEMPERATURE;
+        } else {
+            ESP_LOGE(TAG, "Failed to read temperature: %s", esp_err_to_name(temperature_err));
+        }
+    }
+    disable_sensor(TEMPERATURE_SENSOR);
+    timing.temperature_done_us = esp_timer_get_time();
+
+    *turbidity_adc_value = readings[TURBIDITY_SENSOR].raw;
+    *ph_voltage = readings[PH_SENSOR].voltage;
+    *tds_voltage = readings[TDS_SENSOR].voltage;
+
+    timing.end_us = esp_timer_get_time();
+    last_cycle_timing = timing;
+
+    ESP_LOGI(TAG, "Cycle phases (ms): conversion start %" PRId64 ", turbidity/pH %" PRId64 ", TDS %" PRId64 ", temperature %" PRId64 ", total %" PRId64,
+             (timing.conversion_started_us - timing.start_us) / 1000,
+             (timing.turbidity_ph_done_us - timing.start_us) / 1000,
+             (timing.tds_done_us - timing.start_us) / 1000,
+             (timing.temperature_done_us - timing.start_us) / 1000,
+             (timing.end_us - timing.start_us) / 1000);
+
+    return valid;
+}
+
+static int turbidity_from_raw(int raw) {
+    return fmaxf(0.0f, (1 - raw/(float) TURBIDITY_MAX) * 100);
+}
+
+static float tds_from_voltage(float voltage, float temperature) {
+    float compensationCoefficient = 1.0+0.02*(temperature-TDS_REFERENCE_TEMPERATURE);    //temperature compensation formula: fFinalResult(25^C) = fFinalResult(current)/(1.0+0.02*(fTP-25.0));
+    float compensationVoltage = voltage/compensationCoefficient;
+    return fmaxf(0.0f, tds_correction_factor*(133.42*compensationVoltage*compensationVoltage*compensationVoltage - 255.86*compensationVoltage*compensationVoltage + 857.39*compensationVoltage)*0.5 - 59);
+}
+
+// Extremes the ULP sampled while the node slept, in the units of the snapshot
+static void add_ulp_summary(telemetry_snapshot_t *snapshot, float temperature) {
+    const uint16_t *lut = adc_calibration_get_lut(ADC_UNIT_1, ADC_ATTEN_DB_12);
+    ulp_sampler_summary_t summary;
+
+    if (lut == NULL || !ulp_sampler_take_summary(&summary)) {
+        return;
+    }
+
+    snapshot->valid |= TELEMETRY_HAS_ULP;
+    snapshot->ulp_samples = summary.samples;
+    // Turbidity falls as the raw code rises
+    snapshot->turbidity_min = turbidity_from_raw(summary.max[ULP_CHANNEL_TURBIDITY]);
+    snapshot->turbidity_max = turbidity_from_raw(summary.min[ULP_CHANNEL_TURBIDITY]);
+    snapshot->tds_min = tds_from_voltage(lut[summary.min[ULP_CHANNEL_TDS] & D_MAX] / 1000.0f, temperature);
+    snapshot->tds_max = tds_from_voltage(lut[summary.max[ULP_CHANNEL_TDS] & D_MAX] / 1000.0f, temperature);
+}
+
+static void schedule_timer_callback(void *arg) {
+    xTaskNotify(sensors_task_handle, SENSORS_NOTIFY_SCHEDULE, eSetBits);
+}
+
+// Arms the timer for the next measurement slot. The wait is capped so that a
+// clock step (SNTP sync) is picked up within SENSORS_SCHEDULE_RECHECK_S.
+static void schedule_next_measurement(time_t now, const struct tm *timeinfo) {
+    int64_t hours = SENSORS_MEASURE_INTERVAL_HOURS - timeinfo->tm_hour % SENSORS_MEASURE_INTERVAL_HOURS;
+    int64_t delay_s = hours * 3600 - timeinfo->tm_min * 60 - timeinfo->tm_sec;
+
+    // An early wake already took the reading of the slot just ahead
+    if (delay_s <= SENSORS_EARLY_WAKE_TOLERANCE_S && (timeinfo->tm_hour + hours) % 24 == last_measure_time) {
+        delay_s += SENSORS_MEASURE_INTERVAL_HOURS * 3600;
+    }
+    next_slot = now + delay_s;
+
+    // Deep sleep can't watch for clock steps, it sleeps until the slot
+    sleep_manager_set_next_wake(MAX(1, delay_s));
+    delay_s = MAX(1, MIN(delay_s, SENSORS_SCHEDULE_RECHECK_S));
+
+    esp_timer_stop(schedule_timer);
+    ESP_ERROR_CHECK(esp_timer_start_once(schedule_timer, delay_s * 1000000));
+    ESP_LOGI(TAG, "Next schedule check in %" PRId64 " s", delay_s);
+}
+
+// Local hour the boot reading of a timer wake stands for. The RTC timer may
+// fire a little before the slot; that reading then counts for the slot so it
+// isn't taken again when the clock gets there.
+static int wake_slot(time_t now, const struct tm *timeinfo) {
+    struct tm slot;
+
+    if (next_slot <= now || next_slot - now > SENSORS_EARLY_WAKE_TOLERANCE_S) {
+        return timeinfo->tm_hour;
+    }
+    localtime_r(&next_slot, &slot);
+    ESP_LOGI(TAG, "Woke %d s before the %02d:00 slot, taking its reading", (int)(next_slot - now), slot.tm_hour);
+    return slot.tm_hour;
+}
+
 static void sensors_manager_task(void *parm) {
-    // Device id
-    const char *device_id_str;
     // Sensors variables
     int turbidity_adc_value, turbidity;
-    float tds_voltage, tds, compensationCoefficient, compensationVoltage;
+    float tds_voltage, tds;
+    float temperatures[TEMPERATURE_PROBES_MAX] = {0};
     float temperature;
     float ph, ph_voltage, m, b;
+    uint8_t valid;
     // Time variables
     time_t now;
     struct tm timeinfo;
     char strftime_buf[64];
-    int last_measure_time = -1;
-    // Buffer for mqtt messages
-    char topic[64];
-    char message[128];
-
-    // Get device id
-    device_id_str = device_info_get_id();
+    // First reading right at boot, without waiting for the network or the clock
+    uint32_t notified = SENSORS_NOTIFY_MEASURE_NOW;
+    bool timer_wake = sleep_manager_woke_by_timer();
+    telemetry_snapshot_t snapshot;
 
     // Set timezone to Brazil (Recife)
     time_sync_set_timezone("<-03>3");
 
-    // RTC config
-    obtain_time();
-    time_sync_get_localtime(&now, &timeinfo);
-
     for (int i = 0; i < sizeof(sensor_pins) / sizeof(sensor_pins[0]); i++) {
         gpio_set_direction(sensor_pins[i], GPIO_MODE_OUTPUT);
         ESP_LOGI(TAG, "GPIO %d successfully configured!", sensor_pins[i]);
     }
 
-    // Event bits to check mqtt event
-    EventBits_t uxBits;
+    // Probe discovery needs the probes powered. A full search on power on
+    // picks up probes added to a tank; wakes from deep sleep trust the cache.
+    enable_sensor(TEMPERATURE_SENSOR);
+    if (temperature_probes_init(TEMPERATURE_SENSOR_PIN, TEMPERATURE_SENSOR_RESOLUTION, !sleep_manager_woke_from_sleep()) != ESP_OK) {
+        ESP_LOGE(TAG, "No temperature probe available");
+    }
+    disable_sensor(TEMPERATURE_SENSOR);
+
+    const esp_timer_create_args_t schedule_timer_args = {
+        .callback = schedule_timer_callback,
+        .name = "sensors_schedule",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&schedule_timer_args, &schedule_timer));
+
+    // Sleeps until the next measurement slot or a send_data request
     while (1) {
+        if (notified & SENSORS_NOTIFY_TIME_VALID) {
+            notified &= ~SENSORS_NOTIFY_TIME_VALID;
+            telemetry_time_synced();
+            // The clock may have jumped by decades, the boot reading stands for the current slot
+            time_sync_get_localtime(&now, &timeinfo);
+            last_measure_time = timeinfo.tm_hour;
+        }
+
         time_sync_get_localtime(&now, &timeinfo);
-        uxBits = mqtt_event_get_bits();
-        if (((timeinfo.tm_hour % 3 == 0) && (timeinfo.tm_hour != last_measure_time)) || (uxBits & MQTT_SEND_DATA_EVENT)) {
+        if (((timeinfo.tm_hour % SENSORS_MEASURE_INTERVAL_HOURS == 0) && (timeinfo.tm_hour != last_measure_time)) ||
+            (notified & SENSORS_NOTIFY_MEASURE_NOW)) {
+            notified = 0;
+            last_measure_time = timer_wake ? wake_slot(now, &timeinfo) : timeinfo.tm_hour;
+            timer_wake = false;
+
             // Read sensors
-            if (xSemaphoreTake(adc_mutex, pdMS_TO_TICKS(2500))) {
-                adc_init();
-                enable_sensor(TURBIDITY_SENSOR);
-                get_adc_avarage(TURBIDITY_SENSOR, &turbidity_adc_value, 10);
-                disable_sensor(TURBIDITY_SENSOR);
-
-                enable_sensor(PH_SENSOR);
-                get_adc_avarage_voltage(PH_SENSOR, &ph_voltage, 10);
-                disable_sensor(PH_SENSOR);
-
-                enable_sensor(TDS_SENSOR);
-                get_adc_avarage_voltage(TDS_SENSOR, &tds_voltage, 10);
-                disable_sensor(TDS_SENSOR);
-                
-                adc_deinit();
-
-                enable_sensor(TEMPERATURE_SENSOR);
-                ds18b20_measure_and_read(GPIO_NUM_4, TEMPERATURE_SENSOR_ADDR, &temperature);
-                disable_sensor(TEMPERATURE_SENSOR);
-
-                xSemaphoreGive(adc_mutex);
+            if (adc_session_acquire(CYCLE_SENSORS_MASK, pdMS_TO_TICKS(2500)) != ESP_OK) {
+                // A calibration holds the sensors; there is nothing to publish
+                ESP_LOGE(TAG, "Sensors busy, reading skipped");
+                sleep_manager_request_network(false);
+                sleep_manager_ready(SLEEP_READY_MEASURED);
+                continue;
             }
+            valid = measure_sensors(&turbidity_adc_value, &ph_voltage, &tds_voltage, temperatures);
+            adc_session_release(CYCLE_SENSORS_MASK);
+            // Without a temperature the TDS is left uncompensated
+            temperature = (valid & TELEMETRY_HAS_TEMPERATURE) ? temperatures[TEMPERATURE_PROBE_PRIMARY] : TDS_REFERENCE_TEMPERATURE;
 
             // Prepare message to mqtt
             // turbidity
-            turbidity = fmaxf(0.0f, (1 - turbidity_adc_value/(float) TURBIDITY_MAX) * 100);
+            turbidity = turbidity_from_raw(turbidity_adc_value);
 
             // tds
-            compensationCoefficient = 1.0+0.02*(temperature-25.0);    //temperature compensation formula: fFinalResult(25^C) = fFinalResult(current)/(1.0+0.02*(fTP-25.0));
-            compensationVoltage = tds_voltage/compensationCoefficient;
-            tds = fmaxf(0.0f, tds_correction_factor*(133.42*compensationVoltage*compensationVoltage*compensationVoltage - 255.86*compensationVoltage*compensationVoltage + 857.39*compensationVoltage)*0.5 - 59);
+            tds = tds_from_voltage(tds_voltage, temperature);
             
             // pH
             // m = (9.18 - 6.86)/(CALIBRACAO_PH6_86 - CALIBRACAO_PH_9_18);
@@ -131,34 +309,32 @@ static void sensors_manager_task(void *parm) {
             
             // Format time
             strftime(strftime_buf, sizeof(strftime_buf), "%Y-%m-%dT%H:%M:%S%z", &timeinfo);
-            
-            snprintf(topic, sizeof(topic), "sensors/%s/turbidity", device_id_str);
-            snprintf(message, sizeof(message), "{\"timestamp\": \"%s\", \"turbidity\": %d}", strftime_buf, turbidity);
-            mqtt_publish(topic, message);
-            
-            snprintf(topic, sizeof(topic), "sensors/%s/tds", device_id_str);
-            snprintf(message, sizeof(message), "{\"timestamp\": \"%s\", \"tds\": %.2f}", strftime_buf, tds);
-            mqtt_publish(topic, message);
-            
-            snprintf(topic, sizeof(topic), "sensors/%s/temperature", device_id_str);
-            snprintf(message, sizeof(message), "{\"timestamp\": \"%s\", \"temperature\": %.2f}", strftime_buf, temperature);
-            mqtt_publish(topic, message);
 
-            snprintf(topic, sizeof(topic), "sensors/%s/ph", device_id_str);
-            snprintf(message, sizeof(message), "{\"timestamp\": \"%s\", \"ph\": %.2f}", strftime_buf, ph);
-            mqtt_publish(topic, message);
+            snapshot.valid = valid;
+            snapshot.timestamp = time_sync_is_valid() ? now : 0;
+            snapshot.uptime_us = esp_timer_get_time();
+            snapshot.turbidity = turbidity;
+            snapshot.tds = tds;
+            snapshot.ph = ph;
+            snapshot.temperature = temperature;
+            snapshot.probe_count = MIN(temperature_probes_count(), TELEMETRY_MAX_PROBES);
+            memcpy(snapshot.probes, temperatures, snapshot.probe_count * sizeof(float));
+            add_ulp_summary(&snapshot, temperature);
+            telemetry_publish(&snapshot);
+            sleep_manager_request_network(batch_policy_should_upload(&snapshot));
+            sleep_manager_ready(SLEEP_READY_MEASURED);
     
             ESP_LOGI(TAG, "Turbidity = %d", turbidity);
             ESP_LOGI(TAG, "Tds = %.2f", tds);
             ESP_LOGI(TAG, "Temperature = %.2f", temperature);
+            for (int i = 0; i < temperature_probes_count(); i++) {
+                ESP_LOGI(TAG, "Temperature probe %d = %.2f", i, temperatures[i]);
+            }
             ESP_LOGI(TAG, "pH = %.4f", ph);
             ESP_LOGI(TAG, "The current date/time in Recife is: %s", strftime_buf);
-
-            last_measure_time = timeinfo.tm_hour;
-            mqtt_event_clear_bits(MQTT_SEND_DATA_EVENT);
-            vTaskDelay(pdMS_TO_TICKS(1000));
         } else {
-            vTaskDelay(pdMS_TO_TICKS(1000));
+            schedule_next_measurement(now, &timeinfo);
+            xTaskNotifyWait(0, UINT32_MAX, &notified, portMAX_DELAY);
         }
     }
 }
@@ -166,6 +342,10 @@ static void sensors_manager_task(void *parm) {
 static void load_calibration() {
     esp_err_t err;
 
+    if (calibration_loaded && sleep_manager_woke_from_sleep()) {
+        return;
+    }
+
     ESP_LOGI(TAG, "Loading storaged calibration values");
 
     err = nvs_open("storage", NVS_READONLY, &my_handle);
@@ -194,49 +374,40 @@ static void load_calibration() {
 
     nvs_close(my_handle);
 
+    calibration_loaded = true;
     ESP_LOGI(TAG, "Calibration values loaded");
     ESP_LOGI(TAG, "calib_9_18 = %.2f", ph_voltage_9_18);
     ESP_LOGI(TAG, "calib_6_86 = %.2f", ph_voltage_6_86);
     ESP_LOGI(TAG, "calib_tds = %.2f", tds_correction_factor);
 }
 
-void init_sensors_task(void) {
-    ESP_LOGI(TAG, "Initializing sensors manager task...");
-    load_calibration();
-    xTaskCreate(sensors_manager_task, "sensors_manager_task", 4096, NULL, 3, NULL);
-}
-
-static void calibrate_ph_task(void *parm) {
+static void calibrate_ph(float expected_value) {
     esp_err_t err;
 
-    // Buffer for mqtt messages
-    char topic[64];
-    char message[128];
-
-    float expected_value = *((float*)parm);
+    const mqtt_topic_id_t topic = MQTT_TOPIC_PH_CALIBRATION_RESPONSE;
     float measured;
 
-    snprintf(topic, sizeof(topic), "devices/%s/ph_calibration_response", device_info_get_id());
-
-    if (xSemaphoreTake(adc_mutex, pdMS_TO_TICKS(6000))) {
-        adc_init();
+    if (adc_session_acquire(ADC_SENSOR_BIT(PH_SENSOR), pdMS_TO_TICKS(6000)) == ESP_OK) {
         enable_sensor(PH_SENSOR);
-        get_adc_avarage_voltage(PH_SENSOR, &measured, 10);
+        err = adc_read_settled_voltage(PH_SENSOR, &measured, SENSOR_SAMPLES);
         disable_sensor(PH_SENSOR);
-        adc_deinit();
-        xSemaphoreGive(adc_mutex);
+        adc_session_release(ADC_SENSOR_BIT(PH_SENSOR));
     } else {
         ESP_LOGI(TAG, "Error on pH calibration");
-        snprintf(message, sizeof(message), "Error on mutex");
-        mqtt_publish(topic, message);
-        vTaskDelete(NULL);
+        mqtt_publish_topic(topic, "Error on mutex", 0);
+        return;
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read pH: %s", esp_err_to_name(err));
+        mqtt_publish_topic(topic, "Error reading the pH sensor", 0);
+        return;
     }
 
     err = nvs_open("storage", NVS_READWRITE, &my_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error opening NVS handle!");
-        snprintf(message, sizeof(message), "Error on NVS handle!");
-        mqtt_publish(topic, message);
+        mqtt_publish_topic(topic, "Error on NVS handle!", 0);
     }
 
     if (expected_value == 9.18f) {
@@ -244,70 +415,77 @@ static void calibrate_ph_task(void *parm) {
         err = nvs_set_blob(my_handle, "calib_9_18", &ph_voltage_9_18, sizeof(ph_voltage_9_18));
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Failed to write calib_9_18");
-            snprintf(message, sizeof(message), "Failed to write ph 9.18 calibration");
-            mqtt_publish(topic, message);
+            mqtt_publish_topic(topic, "Failed to write ph 9.18 calibration", 0);
         }
     } else {
         ph_voltage_6_86 = measured;
         err = nvs_set_blob(my_handle, "calib_6_86", &ph_voltage_6_86, sizeof(ph_voltage_6_86));
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Failed to write calib_6_86");
-            snprintf(message, sizeof(message), "Failed to write ph 6.86 calibration");
-            mqtt_publish(topic, message);
+            mqtt_publish_topic(topic, "Failed to write ph 6.86 calibration", 0);
         }
     }
 
     err = nvs_commit(my_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to commit NVS");
-        snprintf(message, sizeof(message), "Failed to commit NVS");
-        mqtt_publish(topic, message);
+        mqtt_publish_topic(topic, "Failed to commit NVS", 0);
     }   
 
     nvs_close(my_handle);
 
-    ESP_LOGI(TAG, "pH calibration task done");
+    ESP_LOGI(TAG, "pH calibration done");
     ESP_LOGI(TAG, "Measured = %.2f", measured);
     ESP_LOGI(TAG, "ph_voltage_6_86 = %.2f", ph_voltage_6_86);
     ESP_LOGI(TAG, "ph_voltage_9_18 = %.2f", ph_voltage_9_18);
 
-    snprintf(message, sizeof(message), "Calibration done");
-    mqtt_publish(topic, message);
-
-    vTaskDelete(NULL);
+    mqtt_publish_topic(topic, "Calibration done", 0);
 }
 
-static void calibrate_tds_task(void *parm) {
+static void calibrate_tds(float expected_value) {
     esp_err_t err;
 
-    // Buffer for mqtt messages
-    char topic[64];
-    char message[128];
-
-    float expected_value = *((float*)parm);
+    const mqtt_topic_id_t topic = MQTT_TOPIC_TDS_CALIBRATION_RESPONSE;
     float measured, tds, compensationCoefficient, compensationVoltage, temperature;
+    esp_err_t temperature_err;
+
+    if (adc_session_acquire(TDS_CALIBRATION_SENSORS_MASK, pdMS_TO_TICKS(6000)) == ESP_OK) {
+        ds18x20_conversion_t conversion = {0};
 
-    snprintf(topic, sizeof(topic), "devices/%s/tds_calibration_response", device_info_get_id());
+        enable_sensor(TEMPERATURE_SENSOR);
+        temperature_err = temperature_probes_start(&conversion);
 
-    if (xSemaphoreTake(adc_mutex, pdMS_TO_TICKS(6000))) {
-        adc_init();
         enable_sensor(TDS_SENSOR);
-        get_adc_avarage_voltage(TDS_SENSOR, &measured, 10);
+        err = adc_read_settled_voltage(TDS_SENSOR, &measured, SENSOR_SAMPLES);
         disable_sensor(TDS_SENSOR);
-        adc_deinit();
 
-        enable_sensor(TEMPERATURE_SENSOR);
-        ds18b20_measure_and_read(GPIO_NUM_4, TEMPERATURE_SENSOR_ADDR, &temperature);
+        if (temperature_err == ESP_OK) {
+            float temperatures[TEMPERATURE_PROBES_MAX];
+            temperature_err = temperature_probes_finish(&conversion, temperatures);
+            temperature = temperatures[TEMPERATURE_PROBE_PRIMARY];
+        }
         disable_sensor(TEMPERATURE_SENSOR);
-        xSemaphoreGive(adc_mutex);
+        adc_session_release(TDS_CALIBRATION_SENSORS_MASK);
     } else {
         ESP_LOGI(TAG, "Error on TDS calibration");
-        snprintf(message, sizeof(message), "Error on mutex");
-        mqtt_publish(topic, message);
-        vTaskDelete(NULL);
+        mqtt_publish_topic(topic, "Error on mutex", 0);
+        return;
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read TDS: %s", esp_err_to_name(err));
+        mqtt_publish_topic(topic, "Error reading the TDS sensor", 0);
+        return;
     }
 
-    compensationCoefficient = 1.0+0.02*(temperature-25.0);    //temperature compensation formula: fFinalResult(25^C) = fFinalResult(current)/(1.0+0.02*(fTP-25.0));
+    // The correction factor would absorb the temperature error
+    if (temperature_err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read temperature: %s", esp_err_to_name(temperature_err));
+        mqtt_publish_topic(topic, "Error reading the temperature sensor", 0);
+        return;
+    }
+
+    compensationCoefficient = 1.0+0.02*(temperature-TDS_REFERENCE_TEMPERATURE);    //temperature compensation formula: fFinalResult(25^C) = fFinalResult(current)/(1.0+0.02*(fTP-25.0));
     compensationVoltage = measured/compensationCoefficient;
     tds = fmaxf(0.0f, (133.42*compensationVoltage*compensationVoltage*compensationVoltage - 255.86*compensationVoltage*compensationVoltage + 857.39*compensationVoltage)*0.5 - 59);
 
@@ -318,44 +496,115 @@ static void calibrate_tds_task(void *parm) {
     err = nvs_open("storage", NVS_READWRITE, &my_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error opening NVS handle!");
-        snprintf(message, sizeof(message), "Error on NVS handle!");
-        mqtt_publish(topic, message);
+        mqtt_publish_topic(topic, "Error on NVS handle!", 0);
     }
 
     err = nvs_set_blob(my_handle, "calib_tds", &tds_correction_factor, sizeof(tds_correction_factor));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to write calib_tds");
-        snprintf(message, sizeof(message), "Failed to write tds calibration");
-        mqtt_publish(topic, message);
+        mqtt_publish_topic(topic, "Failed to write tds calibration", 0);
     }
 
     err = nvs_commit(my_handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to commit NVS");
-        snprintf(message, sizeof(message), "Failed to commit NVS");
-        mqtt_publish(topic, message);
+        mqtt_publish_topic(topic, "Failed to commit NVS", 0);
     }   
 
     nvs_close(my_handle);
 
-    ESP_LOGI(TAG, "TDS calibration task done");
-    snprintf(message, sizeof(message), "Calibration done");
-    mqtt_publish(topic, message);
+    ESP_LOGI(TAG, "TDS calibration done");
+    mqtt_publish_topic(topic, "Calibration done", 0);
+}
+
+// Searches the bus again, for probes added or removed since boot
+static void rescan_probes(void) {
+    const mqtt_topic_id_t topic = MQTT_TOPIC_PROBES_RESPONSE;
+    esp_err_t err;
+
+    // The temperature lease keeps measurement cycles off the bus meanwhile
+    if (adc_session_acquire(ADC_SENSOR_BIT(TEMPERATURE_SENSOR), pdMS_TO_TICKS(6000)) != ESP_OK) {
+        ESP_LOGI(TAG, "Error on probe rescan");
+        mqtt_publish_topic(topic, "Error on mutex", 0);
+        return;
+    }
+
+    enable_sensor(TEMPERATURE_SENSOR);
+    err = temperature_probes_rescan();
+    disable_sensor(TEMPERATURE_SENSOR);
+    adc_session_release(ADC_SENSOR_BIT(TEMPERATURE_SENSOR));
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Probe rescan failed: %s", esp_err_to_name(err));
+        mqtt_publish_topic(topic, "No temperature probe found", 0);
+        return;
+    }
+    mqtt_publishf(topic, "Found %d probe(s)", (int)temperature_probes_count());
+}
+
+// Runs the commands received over MQTT one at a time, so they never compete
+// for the sensors and no task is spawned per command
+static void command_task(void *parm) {
+    sensors_command_t command;
+
+    while (1) {
+        if (xQueueReceive(command_queue, &command, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
 
-    vTaskDelete(NULL);
+        sleep_manager_hold();
+        switch (command.type) {
+        case SENSORS_COMMAND_PH_CALIBRATION:
+            calibrate_ph(command.value);
+            break;
+        case SENSORS_COMMAND_TDS_CALIBRATION:
+            calibrate_tds(command.value);
+            break;
+        case SENSORS_COMMAND_RESCAN_PROBES:
+            rescan_probes();
+            break;
+        }
+        sleep_manager_release();
+    }
 }
 
-void init_calibrate_ph_task(float *expected_value) {
-    ESP_LOGI(TAG, "Initializing ph calibration task...");
-    xTaskCreate(calibrate_ph_task, "calibrate_ph_task", 4096, expected_value, 3, NULL);
+void sensors_manager_get_cycle_timing(sensors_cycle_timing_t *timing) {
+    *timing = last_cycle_timing;
 }
 
-void init_calibrate_tds_task(float *expected_value) {
-    ESP_LOGI(TAG, "Initializing TDS calibration task...");
-    xTaskCreate(calibrate_tds_task, "calibrate_tds_task", 4096, expected_value, 3, NULL);
+void init_sensors_task(void) {
+    ESP_LOGI(TAG, "Initializing sensors manager task...");
+    load_calibration();
+    command_queue = xQueueCreate(SENSORS_COMMAND_QUEUE_LENGTH, sizeof(sensors_command_t));
+    xTaskCreate(sensors_manager_task, "sensors_manager_task", 4096, NULL, 3, &sensors_task_handle);
+    xTaskCreate(command_task, "sensors_command_task", 4096, NULL, 3, NULL);
 }
 
+// Measures and publishes right away, outside the schedule
+void sensors_request_measurement(void) {
+    if (sensors_task_handle) {
+        xTaskNotify(sensors_task_handle, SENSORS_NOTIFY_MEASURE_NOW, eSetBits);
+    }
+}
 
+// Called once SNTP sets the clock, dates the readings taken before
+void sensors_time_synced(void) {
+    if (sensors_task_handle) {
+        xTaskNotify(sensors_task_handle, SENSORS_NOTIFY_TIME_VALID, eSetBits);
+    }
+}
 
+// Safe to call from the MQTT event handler, never blocks
+esp_err_t sensors_command_submit(sensors_command_type_t type, float value) {
+    sensors_command_t command = {
+        .type = type,
+        .value = value,
+    };
 
+    if (command_queue == NULL || xQueueSend(command_queue, &command, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Command %d dropped, queue full", type);
+        return ESP_ERR_NO_MEM;
+    }
 
+    return ESP_OK;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_bit_defs.h"
+
+// Timings of the duty-cycled mode (CONFIG_SLEEP_MANAGER_DEEP_SLEEP).
+// Awake time cap, reached when the broker can't be reached; the reading
+// stays in the flash log for the next cycle
+#define SLEEP_AWAKE_MAX_MS (60 * 1000)
+// Time left for commands queued in the persistent session to arrive
+#define SLEEP_COMMAND_GRACE_MS 2000
+// Used when no wake time was set, and the shortest sleep
+#define SLEEP_DEFAULT_INTERVAL_S (3 * 3600)
+#define SLEEP_MIN_INTERVAL_S 10
+// External trigger for a reading outside the schedule (ext0, RTC GPIO,
+// active low). GPIO 0 is the BOOT button of the devkit.
+#define SLEEP_WAKEUP_GPIO GPIO_NUM_0
+
+// Conditions for going back to sleep
+#define SLEEP_READY_MEASURED BIT0
+#define SLEEP_READY_DELIVERED BIT1
+#define SLEEP_READY_ALL (SLEEP_READY_MEASURED | SLEEP_READY_DELIVERED)
+
+// Whether a timer wake brings up the network, see sleep_manager_wait_network()
+#define SLEEP_NETWORK_REQUIRED BIT2
+#define SLEEP_NETWORK_SKIPPED BIT3
+
+// Runs in the sleep task right before deep sleep
+typedef void (*sleep_manager_handler_t)(void);
+
+typedef struct {
+    uint32_t cycles;            // wakes from deep sleep since power on
+    int wake_cause;             // esp_sleep_wakeup_cause_t of this boot
+    int64_t last_awake_us;      // time awake in the previous cycle
+    int64_t total_awake_us;     // time awake in all previous cycles
+} sleep_stats_t;
+
+void sleep_manager_init(void);
+bool sleep_manager_woke_from_sleep(void);
+bool sleep_manager_woke_by_timer(void);
+void sleep_manager_ready(EventBits_t bits);
+void sleep_manager_clear_ready(EventBits_t bits);
+void sleep_manager_hold(void);
+void sleep_manager_release(void);
+void sleep_manager_set_next_wake(int64_t delay_s);
+void sleep_manager_request_network(bool required);
+bool sleep_manager_wait_network(void);
+void sleep_manager_get_stats(sleep_stats_t *stats);
+void sleep_manager_set_sleep_handler(sleep_manager_handler_t handler);
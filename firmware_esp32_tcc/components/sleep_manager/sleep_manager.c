@@ -0,0 +1,224 @@
+#include <inttypes.h>
+#include <sys/param.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "driver/gpio.h"
+
+#include "sleep_manager.h"
+#include "ulp_sampler.h"
+#include "pm_policy.h"
+
+const static char *TAG = "sleep_manager";
+
+// Set while nothing holds the node awake
+#define SLEEP_IDLE_BIT BIT7
+
+typedef struct {
+    uint32_t cycles;
+    int64_t last_awake_us;
+    int64_t total_awake_us;
+} sleep_rtc_state_t;
+
+RTC_DATA_ATTR static sleep_rtc_state_t rtc_state;
+
+static EventGroupHandle_t sleep_events;
+static portMUX_TYPE sleep_lock = portMUX_INITIALIZER_UNLOCKED;
+static int holds;
+static int64_t wake_at_us;
+static esp_sleep_wakeup_cause_t wake_cause;
+static sleep_manager_handler_t sleep_handler;
+
+static const char *wake_cause_name(esp_sleep_wakeup_cause_t cause) {
+    switch (cause) {
+    case ESP_SLEEP_WAKEUP_TIMER:
+        return "timer";
+    case ESP_SLEEP_WAKEUP_EXT0:
+        return "external trigger";
+    case ESP_SLEEP_WAKEUP_ULP:
+        return "ULP";
+    default:
+        return "power on";
+    }
+}
+
+#if CONFIG_SLEEP_MANAGER_DEEP_SLEEP
+static void enter_deep_sleep(void) {
+    int64_t now_us = esp_timer_get_time();
+    int64_t sleep_us = wake_at_us - now_us;
+
+    if (sleep_us < SLEEP_MIN_INTERVAL_S * 1000000LL) {
+        sleep_us = SLEEP_MIN_INTERVAL_S * 1000000LL;
+    }
+
+    // esp_timer starts from zero on every wake, so this is the time awake
+    rtc_state.last_awake_us = now_us;
+    rtc_state.total_awake_us += now_us;
+    ESP_LOGI(TAG, "Awake for %" PRId64 " ms, sleeping for %" PRId64 " s", now_us / 1000, sleep_us / 1000000);
+    pm_policy_report();
+
+    // Last chance to save what only lives in RAM
+    if (sleep_handler) {
+        sleep_handler();
+    }
+
+    esp_wifi_stop();
+    esp_sleep_enable_timer_wakeup(sleep_us);
+    esp_sleep_enable_ext0_wakeup(SLEEP_WAKEUP_GPIO, 0);
+    ulp_sampler_start();
+    esp_deep_sleep_start();
+}
+
+static void sleep_task(void *parm) {
+    const TickType_t deadline = pdMS_TO_TICKS(SLEEP_AWAKE_MAX_MS);
+    EventBits_t bits;
+
+    while (1) {
+        TickType_t now = xTaskGetTickCount();
+        bits = xEventGroupWaitBits(sleep_events, SLEEP_READY_ALL, false, true, deadline - MIN(now, deadline));
+        if ((bits & SLEEP_READY_ALL) != SLEEP_READY_ALL) {
+            ESP_LOGW(TAG, "Awake limit reached (ready bits 0x%" PRIx32 "), going back to sleep", (uint32_t)bits);
+            break;
+        }
+
+        // Commands queued while asleep may still arrive and start new work,
+        // unless the radio never came up
+        if (bits & SLEEP_NETWORK_SKIPPED) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(SLEEP_COMMAND_GRACE_MS));
+        if ((xEventGroupGetBits(sleep_events) & SLEEP_READY_ALL) == SLEEP_READY_ALL) {
+            break;
+        }
+    }
+
+    // Calibrations and firmware updates in progress are not interrupted
+    xEventGroupWaitBits(sleep_events, SLEEP_IDLE_BIT, false, true, portMAX_DELAY);
+    enter_deep_sleep();
+}
+#endif
+
+void sleep_manager_init(void) {
+    wake_cause = esp_sleep_get_wakeup_cause();
+    if (wake_cause == ESP_SLEEP_WAKEUP_UNDEFINED) {
+        rtc_state = (sleep_rtc_state_t){0};
+    } else {
+        rtc_state.cycles++;
+    }
+
+    sleep_events = xEventGroupCreate();
+    xEventGroupSetBits(sleep_events, SLEEP_IDLE_BIT);
+    wake_at_us = SLEEP_DEFAULT_INTERVAL_S * 1000000LL;
+
+    ESP_LOGI(TAG, "Wake-up by %s, cycle %" PRIu32 ", previous cycle awake %" PRId64 " ms",
+             wake_cause_name(wake_cause), rtc_state.cycles, rtc_state.last_awake_us / 1000);
+
+#if CONFIG_SLEEP_MANAGER_DEEP_SLEEP
+    xTaskCreate(sleep_task, "sleep_task", 3072, NULL, 2, NULL);
+#endif
+}
+
+// True when RTC memory kept its contents from the previous cycle
+bool sleep_manager_woke_from_sleep(void) {
+    return wake_cause != ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+// True for the scheduled wakes, see sleep_manager_set_next_wake()
+bool sleep_manager_woke_by_timer(void) {
+    return wake_cause == ESP_SLEEP_WAKEUP_TIMER;
+}
+
+void sleep_manager_ready(EventBits_t bits) {
+    if (sleep_events) {
+        xEventGroupSetBits(sleep_events, bits & SLEEP_READY_ALL);
+    }
+}
+
+void sleep_manager_clear_ready(EventBits_t bits) {
+    if (sleep_events) {
+        xEventGroupClearBits(sleep_events, bits & SLEEP_READY_ALL);
+    }
+}
+
+// Keeps the node awake until the matching sleep_manager_release()
+void sleep_manager_hold(void) {
+    if (sleep_events == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&sleep_lock);
+    holds++;
+    portEXIT_CRITICAL(&sleep_lock);
+    xEventGroupClearBits(sleep_events, SLEEP_IDLE_BIT);
+}
+
+void sleep_manager_release(void) {
+    bool idle;
+
+    if (sleep_events == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&sleep_lock);
+    if (holds > 0) {
+        holds--;
+    }
+    idle = holds == 0;
+    portEXIT_CRITICAL(&sleep_lock);
+    if (idle) {
+        xEventGroupSetBits(sleep_events, SLEEP_IDLE_BIT);
+    }
+}
+
+// Seconds from now until the next scheduled reading
+void sleep_manager_set_next_wake(int64_t delay_s) {
+    wake_at_us = esp_timer_get_time() + delay_s * 1000000LL;
+}
+
+// Reports whether the reading of this wake has to go out now
+void sleep_manager_request_network(bool required) {
+    if (sleep_events == NULL) {
+        return;
+    }
+    if (required) {
+        xEventGroupSetBits(sleep_events, SLEEP_NETWORK_REQUIRED);
+    } else {
+        // The reading stays in the flash log until a later wake uploads it
+        xEventGroupSetBits(sleep_events, SLEEP_NETWORK_SKIPPED | SLEEP_READY_DELIVERED);
+    }
+}
+
+// Blocks a timer wake until the reading decided whether the network is
+// needed. Power on and external wakes always bring it up, so that commands
+// and firmware updates can reach the node.
+bool sleep_manager_wait_network(void) {
+#if CONFIG_SLEEP_MANAGER_DEEP_SLEEP
+    if (wake_cause != ESP_SLEEP_WAKEUP_TIMER) {
+        return true;
+    }
+
+    EventBits_t bits = xEventGroupWaitBits(sleep_events, SLEEP_NETWORK_REQUIRED | SLEEP_NETWORK_SKIPPED,
+                                           false, false, pdMS_TO_TICKS(SLEEP_AWAKE_MAX_MS));
+    if (bits & SLEEP_NETWORK_SKIPPED) {
+        ESP_LOGI(TAG, "Reading kept for a later upload, network stays off");
+        return false;
+    }
+#endif
+    return true;
+}
+
+void sleep_manager_get_stats(sleep_stats_t *stats) {
+    stats->cycles = rtc_state.cycles;
+    stats->wake_cause = wake_cause;
+    stats->last_awake_us = rtc_state.last_awake_us;
+    stats->total_awake_us = rtc_state.total_awake_us;
+}
+
+// Set once at boot, before the node can go to sleep
+void sleep_manager_set_sleep_handler(sleep_manager_handler_t handler) {
+    sleep_handler = handler;
+}
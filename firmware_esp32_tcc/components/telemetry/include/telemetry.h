@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_bit_defs.h"
+#include "telemetry_log.h"
+
+// Snapshot payload format (CONFIG_TELEMETRY_FORMAT), selected by topic suffix:
+//   sensors/<id>/snapshot        JSON
+//   sensors/<id>/snapshot/bin    packed binary, see telemetry_encode_binary()
+//   sensors/<id>/snapshot/batch  logged binary snapshots, see telemetry_encode_batch()
+
+#define TELEMETRY_MAX_PROBES 4
+// Snapshots wait in RAM for their timestamp and, without the flash log, for
+// MQTT to start. Deep sleep moves the dated ones to the log.
+#define TELEMETRY_HOLD_MAX 8
+#define TELEMETRY_JSON_SIZE 384
+
+#define TELEMETRY_BINARY_VERSION 1
+#define TELEMETRY_BINARY_HEADER_SIZE 23
+#define TELEMETRY_BINARY_ULP_SIZE 8
+#define TELEMETRY_BINARY_SIZE (TELEMETRY_BINARY_HEADER_SIZE + 2 * TELEMETRY_MAX_PROBES + TELEMETRY_BINARY_ULP_SIZE)
+
+// Store-and-forward: binary snapshots are appended to the flash log and
+// delivered in batches, the log tail only advances on PUBACK
+#define TELEMETRY_BATCH_VERSION 1
+#define TELEMETRY_BATCH_MAX_RECORDS 16
+#define TELEMETRY_BATCH_RECORD_HEADER_SIZE 5
+#define TELEMETRY_BATCH_SIZE (2 + TELEMETRY_BATCH_MAX_RECORDS * (TELEMETRY_BATCH_RECORD_HEADER_SIZE + TELEMETRY_BINARY_SIZE))
+#define TELEMETRY_DRAIN_INTERVAL_MS 500
+#define TELEMETRY_ACK_TIMEOUT_MS 10000
+#define TELEMETRY_RETRY_INTERVAL_MS 5000
+#define TELEMETRY_ACK_QUEUE_LENGTH 8
+
+// Presence bits of the binary snapshot
+#define TELEMETRY_HAS_TEMPERATURE BIT0
+#define TELEMETRY_HAS_TDS BIT1
+#define TELEMETRY_HAS_PH BIT2
+#define TELEMETRY_HAS_TURBIDITY BIT3
+#define TELEMETRY_HAS_ALL (TELEMETRY_HAS_TEMPERATURE | TELEMETRY_HAS_TDS | TELEMETRY_HAS_PH | TELEMETRY_HAS_TURBIDITY)
+// Extremes sampled by the ULP since the previous reading, see ulp_sampler
+#define TELEMETRY_HAS_ULP BIT4
+
+// All readings of one measurement cycle
+typedef struct {
+    uint8_t valid;    // TELEMETRY_HAS_* bits
+    time_t timestamp;   // 0 while the clock is not set
+    int64_t uptime_us;  // esp_timer time of the reading
+    int turbidity;
+    float tds;
+    float ph;
+    float temperature;
+    float probes[TELEMETRY_MAX_PROBES];
+    int probe_count;
+    uint16_t ulp_samples;
+    int turbidity_min;
+    int turbidity_max;
+    float tds_min;
+    float tds_max;
+} telemetry_snapshot_t;
+
+int telemetry_encode_json(const telemetry_snapshot_t *snapshot, char *buf, size_t size);
+int telemetry_encode_binary(const telemetry_snapshot_t *snapshot, uint8_t *buf, size_t size);
+int telemetry_encode_batch(const telemetry_log_entry_t *entries, int n, uint8_t *buf, size_t size);
+void telemetry_init(void);
+void telemetry_start(void);
+bool telemetry_can_batch(void);
+void telemetry_publish(const telemetry_snapshot_t *snapshot);
+void telemetry_time_synced(void);
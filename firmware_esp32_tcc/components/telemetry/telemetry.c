@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "telemetry.h"
+#include "mqtt_service.h"
+#include "device_info.h"
+#include "sleep_manager.h"
+#include "pm_policy.h"
+#include "time_sync.h"
+
+const static char *TAG = "telemetry";
+
+_Static_assert(TELEMETRY_BINARY_SIZE <= TELEMETRY_LOG_PAYLOAD_MAX, "snapshot does not fit in a log record");
+
+static TaskHandle_t drain_task_handle;
+static QueueHandle_t ack_queue;
+static bool log_ready;
+
+// Snapshots that can't go out yet: undated ones until the clock is set, and
+// all of them until there is somewhere to deliver them (the flash log or
+// MQTT). Shared by the sensors task, telemetry_start() and the sleep task.
+static telemetry_snapshot_t held[TELEMETRY_HOLD_MAX];
+static int held_count;
+static SemaphoreHandle_t held_mutex;
+static bool mqtt_ready;
+
+static void format_timestamp(time_t timestamp, char *buf, size_t size) {
+    struct tm timeinfo;
+
+    localtime_r(&timestamp, &timeinfo);
+    strftime(buf, size, "%Y-%m-%dT%H:%M:%S%z", &timeinfo);
+}
+
+// Returns the encoded length, or -1 if the buffer is too small
+int telemetry_encode_json(const telemetry_snapshot_t *snapshot, char *buf, size_t size) {
+    char timestamp[32];
+    int len;
+
+    format_timestamp(snapshot->timestamp, timestamp, sizeof(timestamp));
+
+    len = snprintf(buf, size,
+                   "{\"timestamp\": \"%s\", \"temperature\": %.2f, \"tds\": %.2f, \"ph\": %.2f, \"turbidity\": %d, \"probes\": [",
+                   timestamp, snapshot->temperature, snapshot->tds, snapshot->ph, snapshot->turbidity);
+
+    for (int i = 0; i < snapshot->probe_count && len > 0 && len < size; i++) {
+        // A probe that failed to read is NAN, which JSON has no literal for
+        if (isnan(snapshot->probes[i])) {
+            len += snprintf(buf + len, size - len, "%snull", i > 0 ? ", " : "");
+        } else {
+            len += snprintf(buf + len, size - len, "%s%.2f", i > 0 ? ", " : "", snapshot->probes[i]);
+        }
+    }
+
+    if (len > 0 && len < size) {
+        len += snprintf(buf + len, size - len, "]");
+    }
+
+    if ((snapshot->valid & TELEMETRY_HAS_ULP) && len > 0 && len < size) {
+        len += snprintf(buf + len, size - len,
+                        ", \"ulp_samples\": %u, \"turbidity_min\": %d, \"turbidity_max\": %d, \"tds_min\": %.2f, \"tds_max\": %.2f",
+                        snapshot->ulp_samples, snapshot->turbidity_min, snapshot->turbidity_max,
+                        snapshot->tds_min, snapshot->tds_max);
+    }
+
+    if (len > 0 && len < size) {
+        len += snprintf(buf + len, size - len, "}");
+    }
+
+    return (len > 0 && len < size) ? len : -1;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    p = put_u16(p, v & 0xffff);
+    return put_u16(p, v >> 16);
+}
+
+static int32_t scale(float value, float factor, int32_t min, int32_t max) {
+    long v = lrintf(value * factor);
+    return v < min ? min : v > max ? max : v;
+}
+
+// Minutes east of UTC for the configured timezone
+static int16_t tz_offset_minutes(time_t timestamp) {
+    struct tm utc;
+
+    gmtime_r(&timestamp, &utc);
+    utc.tm_isdst = 0;
+    return (int16_t)((timestamp - mktime(&utc)) / 60);
+}
+
+/*
+ * Packed little-endian snapshot, version 1:
+ *
+ *   0  u8     version
+ *   1  u8     TELEMETRY_HAS_* bits
+ *   2  u8     probe count (n)
+ *   3  u8     reserved
+ *   4  u32    timestamp, seconds since the Unix epoch (UTC)
+ *   8  i16    local timezone offset, minutes east of UTC
+ *  10  u8[6]  device MAC address
+ *  16  i16    temperature, 0.01 °C
+ *  18  u16    TDS, 0.1 ppm
+ *  20  u16    pH, 0.01
+ *  22  u8     turbidity, %
+ *  23  i16[n] probe temperatures, 0.01 °C
+ *
+ * With TELEMETRY_HAS_ULP, the ULP extremes follow the probes:
+ *
+ *   0  u16    samples taken in deep sleep
+ *   2  u8     minimum turbidity, %
+ *   3  u8     maximum turbidity, %
+ *   4  u16    minimum TDS, 0.1 ppm
+ *   6  u16    maximum TDS, 0.1 ppm
+ *
+ * Returns the encoded length, or -1 if the buffer is too small.
+ */
+int telemetry_encode_binary(const telemetry_snapshot_t *snapshot, uint8_t *buf, size_t size) {
+    int probe_count = snapshot->probe_count;
+    size_t len = TELEMETRY_BINARY_HEADER_SIZE + 2 * probe_count;
+    uint8_t *p = buf;
+
+    if (snapshot->valid & TELEMETRY_HAS_ULP) {
+        len += TELEMETRY_BINARY_ULP_SIZE;
+    }
+
+    if (size < len) {
+        return -1;
+    }
+
+    *p++ = TELEMETRY_BINARY_VERSION;
+    *p++ = snapshot->valid;
+    *p++ = probe_count;
+    *p++ = 0;
+    p = put_u32(p, (uint32_t)snapshot->timestamp);
+    p = put_u16(p, (uint16_t)tz_offset_minutes(snapshot->timestamp));
+    device_info_get_mac(p);
+    p += 6;
+    p = put_u16(p, (uint16_t)scale(snapshot->temperature, 100, INT16_MIN, INT16_MAX));
+    p = put_u16(p, (uint16_t)scale(snapshot->tds, 10, 0, UINT16_MAX));
+    p = put_u16(p, (uint16_t)scale(snapshot->ph, 100, 0, UINT16_MAX));
+    *p++ = (uint8_t)scale(snapshot->turbidity, 1, 0, UINT8_MAX);
+
+    for (int i = 0; i < probe_count; i++) {
+        // INT16_MIN marks a probe that failed to read; readings clamp above it
+        int32_t probe = isnan(snapshot->probes[i]) ? INT16_MIN : scale(snapshot->probes[i], 100, INT16_MIN + 1, INT16_MAX);
+        p = put_u16(p, (uint16_t)probe);
+    }
+
+    if (snapshot->valid & TELEMETRY_HAS_ULP) {
+        p = put_u16(p, snapshot->ulp_samples);
+        *p++ = (uint8_t)scale(snapshot->turbidity_min, 1, 0, UINT8_MAX);
+        *p++ = (uint8_t)scale(snapshot->turbidity_max, 1, 0, UINT8_MAX);
+        p = put_u16(p, (uint16_t)scale(snapshot->tds_min, 10, 0, UINT16_MAX));
+        p = put_u16(p, (uint16_t)scale(snapshot->tds_max, 10, 0, UINT16_MAX));
+    }
+
+    return len;
+}
+
+/*
+ * Batch of logged snapshots, version 1:
+ *
+ *   0  u8     version
+ *   1  u8     record count (n)
+ *   2  n times:
+ *        u32     sequence number
+ *        u8      snapshot length (len)
+ *        u8[len] binary snapshot, see telemetry_encode_binary()
+ *
+ * Returns the encoded length, or -1 if the buffer is too small.
+ */
+int telemetry_encode_batch(const telemetry_log_entry_t *entries, int n, uint8_t *buf, size_t size) {
+    uint8_t *p = buf;
+    size_t len = 2;
+
+    for (int i = 0; i < n; i++) {
+        len += TELEMETRY_BATCH_RECORD_HEADER_SIZE + entries[i].len;
+    }
+    if (n > UINT8_MAX || size < len) {
+        return -1;
+    }
+
+    *p++ = TELEMETRY_BATCH_VERSION;
+    *p++ = n;
+    for (int i = 0; i < n; i++) {
+        p = put_u32(p, entries[i].seq);
+        *p++ = entries[i].len;
+        memcpy(p, entries[i].payload, entries[i].len);
+        p += entries[i].len;
+    }
+
+    return len;
+}
+
+// The node may sleep once nothing is held in RAM and the log is empty.
+// Every change to either goes through here, with held_mutex taken.
+static void update_delivered(void) {
+    bool pending = held_count > 0;
+
+#if CONFIG_TELEMETRY_FORMAT_BINARY
+    pending = pending || (log_ready && telemetry_log_pending() > 0);
+#endif
+    if (pending) {
+        sleep_manager_clear_ready(SLEEP_READY_DELIVERED);
+    } else {
+        sleep_manager_ready(SLEEP_READY_DELIVERED);
+    }
+}
+
+#if CONFIG_TELEMETRY_FORMAT_BINARY
+static void on_published(int msg_id) {
+    xQueueSend(ack_queue, &msg_id, 0);
+}
+
+static bool wait_ack(int msg_id) {
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(TELEMETRY_ACK_TIMEOUT_MS);
+    int acked;
+
+    for (;;) {
+        TickType_t remaining = deadline - xTaskGetTickCount();
+        if ((int32_t)remaining <= 0 || xQueueReceive(ack_queue, &acked, remaining) != pdTRUE) {
+            return false;
+        }
+        if (acked == msg_id) {
+            return true;
+        }
+    }
+}
+
+// Replays the log oldest first while the broker is reachable. A batch that is
+// not acknowledged is sent again, the backend drops duplicate sequence numbers.
+static void drain_task(void *pvParameters) {
+    static telemetry_log_entry_t entries[TELEMETRY_BATCH_MAX_RECORDS];
+    static uint8_t batch[TELEMETRY_BATCH_SIZE];
+
+    while (1) {
+        xSemaphoreTake(held_mutex, portMAX_DELAY);
+        update_delivered();
+        xSemaphoreGive(held_mutex);
+        if (telemetry_log_pending() == 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        mqtt_event_wait_bits(MQTT_CONNECTED_EVENT, portMAX_DELAY);
+
+        pm_policy_boost(PM_PHASE_UPLOAD);
+        int n = telemetry_log_peek(entries, TELEMETRY_BATCH_MAX_RECORDS);
+        int len = n > 0 ? telemetry_encode_batch(entries, n, batch, sizeof(batch)) : -1;
+        if (len < 0) {
+            ESP_LOGE(TAG, "Failed to read %" PRIu32 " pending record(s)", telemetry_log_pending());
+            pm_policy_unboost(PM_PHASE_UPLOAD);
+            vTaskDelay(pdMS_TO_TICKS(TELEMETRY_RETRY_INTERVAL_MS));
+            continue;
+        }
+
+        xQueueReset(ack_queue);
+        int msg_id = mqtt_publish_topic(MQTT_TOPIC_SNAPSHOT_BATCH, batch, len);
+        if (msg_id < 0 || !wait_ack(msg_id)) {
+            ESP_LOGW(TAG, "Batch up to seq %" PRIu32 " not acknowledged, retrying", entries[n - 1].seq);
+            pm_policy_unboost(PM_PHASE_UPLOAD);
+            vTaskDelay(pdMS_TO_TICKS(TELEMETRY_RETRY_INTERVAL_MS));
+            continue;
+        }
+
+        telemetry_log_ack(entries[n - 1].seq);
+        pm_policy_unboost(PM_PHASE_UPLOAD);
+        ESP_LOGI(TAG, "Delivered %d snapshot(s) up to seq %" PRIu32 ", %" PRIu32 " pending",
+                 n, entries[n - 1].seq, telemetry_log_pending());
+
+        if (telemetry_log_pending() > 0) {
+            vTaskDelay(pdMS_TO_TICKS(TELEMETRY_DRAIN_INTERVAL_MS));
+        }
+    }
+}
+
+#endif
+
+#if CONFIG_TELEMETRY_LEGACY_TOPICS
+static void publish_legacy(const telemetry_snapshot_t *snapshot) {
+    char timestamp[32];
+
+    format_timestamp(snapshot->timestamp, timestamp, sizeof(timestamp));
+
+    mqtt_publishf(MQTT_TOPIC_TURBIDITY, "{\"timestamp\": \"%s\", \"turbidity\": %d}", timestamp, snapshot->turbidity);
+    mqtt_publishf(MQTT_TOPIC_TDS, "{\"timestamp\": \"%s\", \"tds\": %.2f}", timestamp, snapshot->tds);
+    mqtt_publishf(MQTT_TOPIC_TEMPERATURE, "{\"timestamp\": \"%s\", \"temperature\": %.2f}", timestamp, snapshot->temperature);
+    mqtt_publishf(MQTT_TOPIC_PH, "{\"timestamp\": \"%s\", \"ph\": %.2f}", timestamp, snapshot->ph);
+}
+#endif
+
+// False when the snapshot has to wait for MQTT after all
+static bool deliver(const telemetry_snapshot_t *snapshot) {
+#if CONFIG_TELEMETRY_FORMAT_BINARY
+    uint8_t data[TELEMETRY_BINARY_SIZE];
+    int len = telemetry_encode_binary(snapshot, data, sizeof(data));
+    if (len < 0) {
+        ESP_LOGE(TAG, "Snapshot does not fit in %d bytes", TELEMETRY_BINARY_SIZE);
+        return true;
+    }
+
+    if (log_ready && telemetry_log_append(data, len, NULL) == ESP_OK) {
+        if (drain_task_handle) {
+            xTaskNotifyGive(drain_task_handle);
+        }
+    } else if (mqtt_ready) {
+        mqtt_publish_topic(MQTT_TOPIC_SNAPSHOT_BIN, data, len);
+    } else {
+        return false;
+    }
+#else
+    char message[TELEMETRY_JSON_SIZE];
+    if (telemetry_encode_json(snapshot, message, sizeof(message)) < 0) {
+        ESP_LOGE(TAG, "Snapshot does not fit in %d bytes", TELEMETRY_JSON_SIZE);
+        return true;
+    }
+
+    mqtt_publish_topic(MQTT_TOPIC_SNAPSHOT, message, 0);
+#endif
+
+#if CONFIG_TELEMETRY_LEGACY_TOPICS
+    publish_legacy(snapshot);
+#endif
+    return true;
+}
+
+static bool can_deliver(const telemetry_snapshot_t *snapshot) {
+    return snapshot->timestamp != 0 && (log_ready || mqtt_ready);
+}
+
+// Called with held_mutex taken
+static void hold(const telemetry_snapshot_t *snapshot) {
+    if (held_count == TELEMETRY_HOLD_MAX) {
+        ESP_LOGW(TAG, "Dropping the oldest held snapshot");
+        memmove(&held[0], &held[1], (TELEMETRY_HOLD_MAX - 1) * sizeof(held[0]));
+        held_count--;
+    }
+    held[held_count++] = *snapshot;
+    ESP_LOGI(TAG, "Snapshot held until %s (%d held)",
+             snapshot->timestamp == 0 ? "the clock is set" : "MQTT starts", held_count);
+}
+
+// Delivers the held snapshots that can go out now, in order. Called with
+// held_mutex taken, returns how many went out.
+static int release_held(void) {
+    int kept = 0;
+    int released = 0;
+
+    for (int i = 0; i < held_count; i++) {
+        if (can_deliver(&held[i]) && deliver(&held[i])) {
+            released++;
+        } else {
+            held[kept++] = held[i];
+        }
+    }
+    held_count = kept;
+    update_delivered();
+    return released;
+}
+
+// Dates the undated held snapshots from their uptime
+static void date_held(void) {
+    time_t now;
+    int64_t now_us = esp_timer_get_time();
+
+    time(&now);
+    for (int i = 0; i < held_count; i++) {
+        if (held[i].timestamp == 0) {
+            held[i].timestamp = now - (time_t)((now_us - held[i].uptime_us) / 1000000);
+        }
+    }
+}
+
+// Runs right before deep sleep, which would wipe the held snapshots. Those
+// with a date go to the flash log for a later wake to upload.
+static void save_held(void) {
+    time_sync_status_t clock;
+    int saved = 0;
+    int lost;
+
+    time_sync_get_status(&clock);
+    xSemaphoreTake(held_mutex, portMAX_DELAY);
+    // A clock restored from the saved epoch is off by its drift at most
+    if (clock.valid || clock.estimated) {
+        date_held();
+    }
+#if CONFIG_TELEMETRY_FORMAT_BINARY
+    for (int i = 0; i < held_count && log_ready; i++) {
+        uint8_t data[TELEMETRY_BINARY_SIZE];
+        int len;
+
+        if (held[i].timestamp == 0) {
+            continue;
+        }
+        len = telemetry_encode_binary(&held[i], data, sizeof(data));
+        if (len > 0 && telemetry_log_append(data, len, NULL) == ESP_OK) {
+            saved++;
+        }
+    }
+#endif
+    lost = held_count - saved;
+    held_count = 0;
+    xSemaphoreGive(held_mutex);
+
+    if (saved) {
+        ESP_LOGI(TAG, "Saved %d held snapshot(s) to the log before sleeping", saved);
+    }
+    if (lost) {
+        ESP_LOGW(TAG, "Dropped %d held snapshot(s), no clock or log to keep them", lost);
+    }
+}
+
+// Opens the flash log, the network is not needed yet
+void telemetry_init(void) {
+    held_mutex = xSemaphoreCreateMutex();
+    sleep_manager_set_sleep_handler(save_held);
+
+#if CONFIG_TELEMETRY_FORMAT_BINARY
+    if (telemetry_log_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Telemetry log unavailable, snapshots are published without store-and-forward");
+        return;
+    }
+
+    ack_queue = xQueueCreate(TELEMETRY_ACK_QUEUE_LENGTH, sizeof(int));
+    log_ready = true;
+#endif
+}
+
+// Starts delivering the log, must run after mqtt_app_start()
+void telemetry_start(void) {
+    int released;
+
+#if CONFIG_TELEMETRY_FORMAT_BINARY
+    mqtt_topic_set_schema(MQTT_TOPIC_SNAPSHOT_BIN, TELEMETRY_BINARY_VERSION);
+    mqtt_topic_set_schema(MQTT_TOPIC_SNAPSHOT_BATCH, TELEMETRY_BATCH_VERSION);
+
+    if (log_ready) {
+        mqtt_set_published_handler(on_published);
+        xTaskCreate(drain_task, "telemetry_drain_task", 4096, NULL, 4, &drain_task_handle);
+    }
+#endif
+
+    xSemaphoreTake(held_mutex, portMAX_DELAY);
+    mqtt_ready = true;
+    released = release_held();
+    xSemaphoreGive(held_mutex);
+    if (released) {
+        ESP_LOGI(TAG, "Published %d snapshot(s) taken before MQTT started", released);
+    }
+}
+
+// True when snapshots can wait in the flash log while the network is off
+bool telemetry_can_batch(void) {
+    return log_ready;
+}
+
+void telemetry_publish(const telemetry_snapshot_t *snapshot) {
+    xSemaphoreTake(held_mutex, portMAX_DELAY);
+    if (!can_deliver(snapshot) || !deliver(snapshot)) {
+        hold(snapshot);
+    }
+    // Keeps the node awake while it is held, see save_held()
+    update_delivered();
+    xSemaphoreGive(held_mutex);
+}
+
+// Dates the held snapshots from their uptime and publishes them
+void telemetry_time_synced(void) {
+    int released;
+
+    xSemaphoreTake(held_mutex, portMAX_DELAY);
+    date_held();
+    released = release_held();
+    xSemaphoreGive(held_mutex);
+    if (released) {
+        ESP_LOGI(TAG, "Published %d snapshot(s) taken before the clock was set", released);
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Raw data partition holding the log, see partitions.csv
+#define TELEMETRY_LOG_PARTITION_LABEL "telemetry"
+#define TELEMETRY_LOG_PARTITION_SUBTYPE 0x40
+
+#define TELEMETRY_LOG_SECTOR_SIZE 4096
+#define TELEMETRY_LOG_RECORD_SIZE 64
+#define TELEMETRY_LOG_RECORD_HEADER_SIZE 12
+#define TELEMETRY_LOG_PAYLOAD_MAX (TELEMETRY_LOG_RECORD_SIZE - TELEMETRY_LOG_RECORD_HEADER_SIZE)
+#define TELEMETRY_LOG_RECORDS_PER_SECTOR (TELEMETRY_LOG_SECTOR_SIZE / TELEMETRY_LOG_RECORD_SIZE)
+
+// Record states. Flash bits only go from 1 to 0 without an erase, so a
+// record is acknowledged in place by clearing its state word.
+#define TELEMETRY_LOG_STATE_ERASED 0xFFFFFFFF
+#define TELEMETRY_LOG_STATE_PENDING 0x5A5A5A5A
+#define TELEMETRY_LOG_STATE_ACKED 0x00000000
+
+// Upper bound for sequence numbers, reserved in NVS in blocks so that they
+// keep increasing even if the log partition is erased
+#define TELEMETRY_LOG_NVS_NAMESPACE "telemetry_log"
+#define TELEMETRY_LOG_NVS_KEY "seq_limit"
+#define TELEMETRY_LOG_SEQ_RESERVE 256
+
+typedef struct {
+    uint32_t seq;
+    uint16_t len;
+    uint8_t payload[TELEMETRY_LOG_PAYLOAD_MAX];
+} telemetry_log_entry_t;
+
+typedef struct {
+    uint32_t pending;     // records not acknowledged yet
+    uint32_t capacity;    // records the partition can hold
+    uint32_t next_seq;
+    uint32_t dropped;     // pending records overwritten since boot
+} telemetry_log_stats_t;
+
+esp_err_t telemetry_log_init(void);
+esp_err_t telemetry_log_append(const void *data, size_t len, uint32_t *seq);
+int telemetry_log_peek(telemetry_log_entry_t *entries, int max);
+esp_err_t telemetry_log_ack(uint32_t last_seq);
+uint32_t telemetry_log_pending(void);
+void telemetry_log_get_stats(telemetry_log_stats_t *stats);
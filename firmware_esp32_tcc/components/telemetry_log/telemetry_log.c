@@ -0,0 +1,408 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+
+#include "telemetry_log.h"
+
+const static char *TAG = "telemetry_log";
+
+typedef struct {
+    uint32_t state;
+    uint32_t seq;
+    uint16_t len;
+    uint16_t crc;       // over seq, len and payload
+    uint8_t payload[TELEMETRY_LOG_PAYLOAD_MAX];
+} log_record_t;
+
+_Static_assert(sizeof(log_record_t) == TELEMETRY_LOG_RECORD_SIZE, "log record size");
+
+static const esp_partition_t *partition = NULL;
+static SemaphoreHandle_t log_mutex;
+static uint32_t slot_count;
+static uint32_t head;       // next slot to be written
+static uint32_t tail;       // oldest pending slot, equal to head when nothing is pending
+static uint32_t pending;
+static uint32_t next_seq = 1;
+static uint32_t seq_limit;
+static uint32_t dropped;
+
+// Copy of the cursor in RTC memory, a wake from deep sleep skips the scan
+#define LOG_CURSOR_MAGIC 0x544c4f47
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slot_count;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t pending;
+    uint32_t next_seq;
+    uint32_t seq_limit;
+    uint32_t dropped;
+} log_cursor_t;
+
+RTC_DATA_ATTR static log_cursor_t rtc_cursor;
+
+static void save_cursor(void) {
+    rtc_cursor = (log_cursor_t){
+        .magic = LOG_CURSOR_MAGIC,
+        .slot_count = slot_count,
+        .head = head,
+        .tail = tail,
+        .pending = pending,
+        .next_seq = next_seq,
+        .seq_limit = seq_limit,
+        .dropped = dropped,
+    };
+}
+
+static bool restore_cursor(void) {
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP || rtc_cursor.magic != LOG_CURSOR_MAGIC ||
+        rtc_cursor.slot_count != slot_count) {
+        return false;
+    }
+
+    head = rtc_cursor.head;
+    tail = rtc_cursor.tail;
+    pending = rtc_cursor.pending;
+    next_seq = rtc_cursor.next_seq;
+    seq_limit = rtc_cursor.seq_limit;
+    dropped = rtc_cursor.dropped;
+    return true;
+}
+
+static inline uint32_t next_slot(uint32_t slot) {
+    return (slot + 1) % slot_count;
+}
+
+static inline uint32_t slot_sector(uint32_t slot) {
+    return slot / TELEMETRY_LOG_RECORDS_PER_SECTOR;
+}
+
+static uint16_t record_crc(const log_record_t *record) {
+    uint16_t crc = esp_rom_crc16_le(0, (const uint8_t *)&record->seq, sizeof(record->seq) + sizeof(record->len));
+    return esp_rom_crc16_le(crc, record->payload, record->len);
+}
+
+static bool record_valid(const log_record_t *record) {
+    if (record->state != TELEMETRY_LOG_STATE_PENDING && record->state != TELEMETRY_LOG_STATE_ACKED) {
+        return false;
+    }
+    return record->len <= TELEMETRY_LOG_PAYLOAD_MAX && record->crc == record_crc(record);
+}
+
+static esp_err_t read_record(uint32_t slot, log_record_t *record) {
+    return esp_partition_read(partition, slot * TELEMETRY_LOG_RECORD_SIZE, record, sizeof(*record));
+}
+
+static bool slot_erased(uint32_t slot) {
+    log_record_t record;
+
+    if (read_record(slot, &record) != ESP_OK) {
+        return false;
+    }
+
+    const uint8_t *p = (const uint8_t *)&record;
+    for (size_t i = 0; i < sizeof(record); i++) {
+        if (p[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void load_seq_limit(void) {
+    nvs_handle_t handle;
+
+    seq_limit = 0;
+    if (nvs_open(TELEMETRY_LOG_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        nvs_get_u32(handle, TELEMETRY_LOG_NVS_KEY, &seq_limit);
+        nvs_close(handle);
+    }
+}
+
+static void reserve_seq(void) {
+    nvs_handle_t handle;
+
+    if (next_seq < seq_limit) {
+        return;
+    }
+
+    seq_limit = next_seq + TELEMETRY_LOG_SEQ_RESERVE;
+
+    esp_err_t err = nvs_open(TELEMETRY_LOG_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_u32(handle, TELEMETRY_LOG_NVS_KEY, seq_limit);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to reserve sequence numbers: %s", esp_err_to_name(err));
+    }
+}
+
+// Rebuilds head, tail and the pending count from the records on flash
+static esp_err_t scan_log(void) {
+    uint8_t *sector = malloc(TELEMETRY_LOG_SECTOR_SIZE);
+    bool found = false, found_pending = false;
+    uint32_t max_seq = 0, max_slot = 0;
+    uint32_t min_seq = 0, min_slot = 0;
+
+    if (sector == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    pending = 0;
+    for (uint32_t s = 0; s < slot_count / TELEMETRY_LOG_RECORDS_PER_SECTOR; s++) {
+        esp_err_t err = esp_partition_read(partition, s * TELEMETRY_LOG_SECTOR_SIZE, sector, TELEMETRY_LOG_SECTOR_SIZE);
+        if (err != ESP_OK) {
+            free(sector);
+            return err;
+        }
+
+        for (uint32_t i = 0; i < TELEMETRY_LOG_RECORDS_PER_SECTOR; i++) {
+            const log_record_t *record = (const log_record_t *)(sector + i * TELEMETRY_LOG_RECORD_SIZE);
+            uint32_t slot = s * TELEMETRY_LOG_RECORDS_PER_SECTOR + i;
+
+            if (!record_valid(record)) {
+                continue;
+            }
+
+            if (!found || record->seq > max_seq) {
+                found = true;
+                max_seq = record->seq;
+                max_slot = slot;
+            }
+
+            if (record->state == TELEMETRY_LOG_STATE_PENDING) {
+                pending++;
+                if (!found_pending || record->seq < min_seq) {
+                    found_pending = true;
+                    min_seq = record->seq;
+                    min_slot = slot;
+                }
+            }
+        }
+    }
+    free(sector);
+
+    head = found ? next_slot(max_slot) : 0;
+    // Skip slots left dirty by an interrupted write; a new sector is erased before use
+    while (head % TELEMETRY_LOG_RECORDS_PER_SECTOR != 0 && !slot_erased(head)) {
+        head = next_slot(head);
+    }
+    tail = found_pending ? min_slot : head;
+
+    next_seq = found ? max_seq + 1 : 1;
+    if (!found && next_seq < seq_limit) {
+        next_seq = seq_limit;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t telemetry_log_init(void) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, TELEMETRY_LOG_PARTITION_SUBTYPE,
+                                         TELEMETRY_LOG_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "Partition '%s' not found", TELEMETRY_LOG_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    slot_count = (partition->size / TELEMETRY_LOG_SECTOR_SIZE) * TELEMETRY_LOG_RECORDS_PER_SECTOR;
+    log_mutex = xSemaphoreCreateMutex();
+
+    if (!restore_cursor()) {
+        load_seq_limit();
+
+        esp_err_t err = scan_log();
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to scan log: %s", esp_err_to_name(err));
+            partition = NULL;
+            return err;
+        }
+        save_cursor();
+    }
+
+    ESP_LOGI(TAG, "%" PRIu32 " pending record(s), next sequence %" PRIu32 ", capacity %" PRIu32,
+             pending, next_seq, slot_count);
+    return ESP_OK;
+}
+
+// Erases the sector head is entering, dropping its records if the log is full
+static esp_err_t prepare_sector(void) {
+    uint32_t sector = slot_sector(head);
+    log_record_t record;
+
+    while (pending > 0 && slot_sector(tail) == sector) {
+        if (read_record(tail, &record) == ESP_OK && record_valid(&record) &&
+            record.state == TELEMETRY_LOG_STATE_PENDING) {
+            pending--;
+            dropped++;
+        }
+        tail = next_slot(tail);
+    }
+
+    return esp_partition_erase_range(partition, sector * TELEMETRY_LOG_SECTOR_SIZE, TELEMETRY_LOG_SECTOR_SIZE);
+}
+
+esp_err_t telemetry_log_append(const void *data, size_t len, uint32_t *seq) {
+    log_record_t record;
+    esp_err_t err = ESP_OK;
+
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (len > TELEMETRY_LOG_PAYLOAD_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+    if (head % TELEMETRY_LOG_RECORDS_PER_SECTOR == 0) {
+        uint32_t before = dropped;
+        err = prepare_sector();
+        if (dropped != before) {
+            ESP_LOGW(TAG, "Log full, dropped %" PRIu32 " unsent record(s)", dropped - before);
+        }
+    }
+
+    if (err == ESP_OK) {
+        reserve_seq();
+
+        memset(&record, 0xff, sizeof(record));
+        record.state = TELEMETRY_LOG_STATE_PENDING;
+        record.seq = next_seq;
+        record.len = len;
+        memcpy(record.payload, data, len);
+        record.crc = record_crc(&record);
+
+        err = esp_partition_write(partition, head * TELEMETRY_LOG_RECORD_SIZE, &record, sizeof(record));
+    }
+
+    if (err == ESP_OK) {
+        if (pending == 0) {
+            tail = head;
+        }
+        pending++;
+        if (seq) {
+            *seq = next_seq;
+        }
+        next_seq++;
+    } else {
+        ESP_LOGE(TAG, "Failed to append record: %s", esp_err_to_name(err));
+    }
+    // A failed write may leave the slot dirty, never reuse it before an erase
+    head = next_slot(head);
+    if (pending == 0) {
+        tail = head;
+    }
+    save_cursor();
+
+    xSemaphoreGive(log_mutex);
+    return err;
+}
+
+// Copies up to max pending records, oldest first, without consuming them
+int telemetry_log_peek(telemetry_log_entry_t *entries, int max) {
+    log_record_t record;
+    uint32_t slot, remaining;
+    int n = 0;
+
+    if (partition == NULL) {
+        return 0;
+    }
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+    slot = tail;
+    remaining = pending;
+    for (uint32_t i = 0; i < slot_count && n < max && remaining > 0; i++, slot = next_slot(slot)) {
+        if (read_record(slot, &record) != ESP_OK || !record_valid(&record) ||
+            record.state != TELEMETRY_LOG_STATE_PENDING) {
+            continue;
+        }
+
+        entries[n].seq = record.seq;
+        entries[n].len = record.len;
+        memcpy(entries[n].payload, record.payload, record.len);
+        n++;
+        remaining--;
+    }
+
+    xSemaphoreGive(log_mutex);
+    return n;
+}
+
+// Marks every pending record up to last_seq as delivered and advances the tail
+esp_err_t telemetry_log_ack(uint32_t last_seq) {
+    const uint32_t acked = TELEMETRY_LOG_STATE_ACKED;
+    log_record_t record;
+    esp_err_t err = ESP_OK;
+    uint32_t i;
+
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+    for (i = 0; i < slot_count && pending > 0; i++) {
+        err = read_record(tail, &record);
+        if (err != ESP_OK) {
+            break;
+        }
+
+        if (record_valid(&record) && record.state == TELEMETRY_LOG_STATE_PENDING) {
+            if (record.seq > last_seq) {
+                break;
+            }
+            err = esp_partition_write(partition, tail * TELEMETRY_LOG_RECORD_SIZE, &acked, sizeof(acked));
+            if (err != ESP_OK) {
+                break;
+            }
+            pending--;
+        }
+        tail = next_slot(tail);
+    }
+
+    if (i == slot_count && pending > 0) {
+        ESP_LOGE(TAG, "Lost track of %" PRIu32 " pending record(s)", pending);
+        pending = 0;
+    }
+    if (pending == 0) {
+        tail = head;
+    }
+    save_cursor();
+
+    xSemaphoreGive(log_mutex);
+    return err;
+}
+
+uint32_t telemetry_log_pending(void) {
+    return pending;
+}
+
+void telemetry_log_get_stats(telemetry_log_stats_t *stats) {
+    if (partition == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+    stats->pending = pending;
+    stats->capacity = slot_count;
+    stats->next_seq = next_seq;
+    stats->dropped = dropped;
+    xSemaphoreGive(log_mutex);
+}
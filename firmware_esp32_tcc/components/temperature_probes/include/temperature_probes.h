@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "ds18x20.h"
+
+#define TEMPERATURE_PROBES_MAX 4
+#define TEMPERATURE_PROBES_NVS_NAMESPACE "temp_probes"
+#define TEMPERATURE_PROBES_NVS_KEY "roms"
+
+// Probe 0 is the primary probe, used for TDS temperature compensation
+#define TEMPERATURE_PROBE_PRIMARY 0
+
+esp_err_t temperature_probes_init(gpio_num_t pin, ds18x20_resolution_t resolution, bool full_scan);
+esp_err_t temperature_probes_rescan(void);
+size_t temperature_probes_count(void);
+onewire_addr_t temperature_probes_get_addr(size_t index);
+esp_err_t temperature_probes_start(ds18x20_conversion_t *conv);
+esp_err_t temperature_probes_finish(ds18x20_conversion_t *conv, float *temperatures);
@@ -0,0 +1,210 @@
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "temperature_probes.h"
+
+const static char *TAG = "temperature_probes";
+
+static gpio_num_t probes_pin = GPIO_NUM_NC;
+static ds18x20_resolution_t probes_resolution = DS18X20_RESOLUTION_12_BIT;
+static onewire_addr_t probes[TEMPERATURE_PROBES_MAX];
+static size_t probes_count = 0;
+
+static esp_err_t load_probes(void) {
+    nvs_handle_t handle;
+    size_t size = sizeof(probes);
+
+    esp_err_t err = nvs_open(TEMPERATURE_PROBES_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_get_blob(handle, TEMPERATURE_PROBES_NVS_KEY, probes, &size);
+    nvs_close(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    probes_count = size / sizeof(probes[0]);
+    return probes_count > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static esp_err_t store_probes(void) {
+    nvs_handle_t handle;
+
+    esp_err_t err = nvs_open(TEMPERATURE_PROBES_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_set_blob(handle, TEMPERATURE_PROBES_NVS_KEY, probes, probes_count * sizeof(probes[0]));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    return err;
+}
+
+// A scratchpad read with a valid CRC proves the probe is still on the bus,
+// without walking the whole ROM search tree
+static bool probes_present(void) {
+    uint8_t scratchpad[8];
+
+    for (size_t i = 0; i < probes_count; i++) {
+        if (ds18x20_read_scratchpad(probes_pin, probes[i], scratchpad) != ESP_OK) {
+            ESP_LOGW(TAG, "Cached probe %08" PRIx32 "%08" PRIx32 " did not answer",
+                     (uint32_t)(probes[i] >> 32), (uint32_t)probes[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void configure_probes(void) {
+    for (size_t i = 0; i < probes_count; i++) {
+        esp_err_t err = ds18x20_set_resolution(probes_pin, probes[i], probes_resolution);
+        if (err != ESP_OK && err != ESP_ERR_NOT_SUPPORTED) {
+            ESP_LOGW(TAG, "Failed to set resolution of probe %d: %s", (int)i, esp_err_to_name(err));
+        }
+    }
+}
+
+static bool probes_contain(const onewire_addr_t *list, size_t count, onewire_addr_t addr) {
+    for (size_t i = 0; i < count; i++) {
+        if (list[i] == addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Searches the bus and merges the result into the probe table: known probes
+// that still answer keep their index (so the primary probe does not change
+// when one is added), new ones are appended. NVS is only written on change,
+// and a failed search leaves the table as it was.
+esp_err_t temperature_probes_rescan(void) {
+    onewire_addr_t found_addrs[TEMPERATURE_PROBES_MAX];
+    onewire_addr_t merged[TEMPERATURE_PROBES_MAX];
+    size_t found = 0;
+    size_t merged_count = 0;
+
+    esp_err_t err = ds18x20_scan_devices(probes_pin, found_addrs, TEMPERATURE_PROBES_MAX, &found);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to scan 1-Wire bus: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    if (found > TEMPERATURE_PROBES_MAX) {
+        ESP_LOGW(TAG, "Found %d probes, using the first %d", (int)found, TEMPERATURE_PROBES_MAX);
+        found = TEMPERATURE_PROBES_MAX;
+    }
+
+    for (size_t i = 0; i < probes_count; i++) {
+        if (probes_contain(found_addrs, found, probes[i])) {
+            merged[merged_count++] = probes[i];
+        } else {
+            ESP_LOGW(TAG, "Probe %08" PRIx32 "%08" PRIx32 " is gone",
+                     (uint32_t)(probes[i] >> 32), (uint32_t)probes[i]);
+        }
+    }
+    for (size_t i = 0; i < found; i++) {
+        if (!probes_contain(merged, merged_count, found_addrs[i])) {
+            merged[merged_count++] = found_addrs[i];
+        }
+    }
+
+    bool changed = merged_count != probes_count || memcmp(merged, probes, merged_count * sizeof(merged[0])) != 0;
+    memcpy(probes, merged, merged_count * sizeof(merged[0]));
+    probes_count = merged_count;
+
+    for (size_t i = 0; i < probes_count; i++) {
+        ESP_LOGI(TAG, "Probe %d: %08" PRIx32 "%08" PRIx32, (int)i,
+                 (uint32_t)(probes[i] >> 32), (uint32_t)probes[i]);
+    }
+
+    if (probes_count == 0) {
+        ESP_LOGE(TAG, "No temperature probe found on GPIO %d", probes_pin);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    configure_probes();
+
+    if (changed) {
+        err = store_probes();
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to store probe table: %s", esp_err_to_name(err));
+        }
+    }
+
+    return ESP_OK;
+}
+
+// The probes must be powered while this runs. With full_scan the bus is
+// searched even when the cached probes answer, which finds probes added
+// since; otherwise the search only runs when a cached probe is missing.
+esp_err_t temperature_probes_init(gpio_num_t pin, ds18x20_resolution_t resolution, bool full_scan) {
+    probes_pin = pin;
+    probes_resolution = resolution;
+
+    bool cached = load_probes() == ESP_OK;
+    if (cached && !full_scan && probes_present()) {
+        ESP_LOGI(TAG, "Using %d cached probe(s)", (int)probes_count);
+        configure_probes();
+        return ESP_OK;
+    }
+    if (!cached) {
+        probes_count = 0;
+    }
+
+    ESP_LOGI(TAG, "Scanning 1-Wire bus on GPIO %d", pin);
+    return temperature_probes_rescan();
+}
+
+size_t temperature_probes_count(void) {
+    return probes_count;
+}
+
+onewire_addr_t temperature_probes_get_addr(size_t index) {
+    return index < probes_count ? probes[index] : DS18X20_ANY;
+}
+
+// All probes convert at once after a single skip-ROM CONVERT_T, so the wait
+// does not grow with the number of probes
+esp_err_t temperature_probes_start(ds18x20_conversion_t *conv) {
+    if (probes_count == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ds18x20_measure_start(probes_pin, DS18X20_ANY, probes_resolution, conv);
+}
+
+// A probe that fails to read is reported as NAN without discarding the
+// others. The result is the one of the primary probe.
+esp_err_t temperature_probes_finish(ds18x20_conversion_t *conv, float *temperatures) {
+    esp_err_t primary_err = ESP_OK;
+
+    esp_err_t err = ds18x20_wait_conversion(conv);
+    if (err != ESP_OK) {
+        for (size_t i = 0; i < probes_count; i++) {
+            temperatures[i] = NAN;
+        }
+        return err;
+    }
+
+    for (size_t i = 0; i < probes_count; i++) {
+        err = ds18x20_read_temperature(probes_pin, probes[i], &temperatures[i]);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to read probe %d: %s", (int)i, esp_err_to_name(err));
+            temperatures[i] = NAN;
+            if (i == TEMPERATURE_PROBE_PRIMARY) {
+                primary_err = err;
+            }
+        }
+    }
+
+    return primary_err;
+}
@@ -1,7 +1,48 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include "freertos/FreeRTOS.h"
 
-void obtain_time(void);
+// Clocks before this year have not been set yet
+#define TIME_SYNC_MIN_YEAR 2025
+
+// SNTP servers, tried in order (up to CONFIG_LWIP_SNTP_MAX_SERVERS). Put a
+// LAN server first for deployments without internet access.
+#define TIME_SYNC_SERVERS { "pool.ntp.org", "time.google.com", "a.st1.ntp.br" }
+// Also take the NTP server offered by DHCP (CONFIG_LWIP_DHCP_GET_NTP_SRV)
+#define TIME_SYNC_DHCP_SERVER 0
+// Re-sync period; after the first sync the clock is slewed with adjtime()
+// instead of stepped, unless it is more than ~35 min off
+#define TIME_SYNC_INTERVAL_MS (60 * 60 * 1000)
+
+// Time published by the backend on devices/<id>/time, seconds since the
+// Unix epoch. Used while SNTP has not synced for two intervals.
+#define TIME_SYNC_BROKER_TIME 1
+#define TIME_SYNC_BROKER_COMMAND "time"
+
+// Last synced time, saved at most every TIME_SYNC_PERSIST_INTERVAL_S so that
+// a node powering up keeps a monotonic, roughly right clock until it syncs
+#define TIME_SYNC_NVS_NAMESPACE "time_sync"
+#define TIME_SYNC_NVS_KEY "epoch"
+#define TIME_SYNC_PERSIST_INTERVAL_S (6 * 3600)
+
+typedef void (*time_sync_cb_t)(void);
+
+typedef struct {
+    bool valid;             // synced since power on
+    bool estimated;         // clock restored from the saved epoch
+    uint32_t syncs;         // SNTP and broker syncs since boot
+    uint32_t broker_syncs;
+    int64_t last_sync_us;   // esp_timer time of the last sync, 0 if none
+} time_sync_status_t;
+
+void time_sync_init(void);
+void time_sync_start(time_sync_cb_t on_sync);
+bool time_sync_is_valid(void);
+bool time_sync_wait_valid(TickType_t timeout);
+void time_sync_broker_time(const char *data, int len);
+void time_sync_get_status(time_sync_status_t *status);
 void time_sync_set_timezone(const char *tz_string);
 void time_sync_get_localtime(time_t *now, struct tm *timeinfo);
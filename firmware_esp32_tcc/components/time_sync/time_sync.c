@@ -1,37 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+#include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_bit_defs.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "freertos/event_groups.h"
 
 #include "time_sync.h"
 
+#if TIME_SYNC_DHCP_SERVER && !CONFIG_LWIP_DHCP_GET_NTP_SRV
+#error "TIME_SYNC_DHCP_SERVER needs CONFIG_LWIP_DHCP_GET_NTP_SRV"
+#endif
+
+#define TIME_SYNC_VALID_BIT BIT0
+
 static const char *TAG = "time_sync";
 
-static void initialize_sntp(void)
+static const char *servers[] = TIME_SYNC_SERVERS;
+
+// The RTC clock keeps running through deep sleep and software resets, and
+// so does this flag
+RTC_DATA_ATTR static bool rtc_synced;
+
+static EventGroupHandle_t time_events;
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+static time_sync_status_t status;
+static time_sync_cb_t sync_cb;
+static int64_t last_sntp_us;
+static time_t last_saved;
+
+static bool year_valid(time_t t)
 {
-    ESP_LOGI(TAG, "Initializing SNTP");
+    struct tm timeinfo;
+
+    gmtime_r(&t, &timeinfo);
+    return timeinfo.tm_year >= (TIME_SYNC_MIN_YEAR - 1900);
+}
+
+static void save_epoch(time_t now)
+{
+    nvs_handle_t handle;
+
+    if (last_saved != 0 && now - last_saved < TIME_SYNC_PERSIST_INTERVAL_S) {
+        return;
+    }
+    if (nvs_open(TIME_SYNC_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_i64(handle, TIME_SYNC_NVS_KEY, now) == ESP_OK && nvs_commit(handle) == ESP_OK) {
+        last_saved = now;
+    }
+    nvs_close(handle);
+}
+
+static bool restore_epoch(void)
+{
+    nvs_handle_t handle;
+    int64_t epoch;
+    esp_err_t err;
+
+    if (nvs_open(TIME_SYNC_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    err = nvs_get_i64(handle, TIME_SYNC_NVS_KEY, &epoch);
+    nvs_close(handle);
+    if (err != ESP_OK || !year_valid(epoch)) {
+        return false;
+    }
+
+    struct timeval tv = { .tv_sec = epoch };
+    settimeofday(&tv, NULL);
+    return true;
+}
+
+// Runs after the new time was applied, from SNTP or the broker
+static void clock_synced(const struct timeval *tv, bool from_broker)
+{
+    bool first;
+
+    portENTER_CRITICAL(&status_lock);
+    first = !status.valid;
+    status.valid = true;
+    status.estimated = false;
+    status.syncs++;
+    if (from_broker) {
+        status.broker_syncs++;
+    }
+    status.last_sync_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&status_lock);
+
+    rtc_synced = true;
+    save_epoch(tv->tv_sec);
+
+    if (!first) {
+        return;
+    }
+
+    // Later syncs slew the clock instead of stepping it
+    sntp_set_sync_mode(SNTP_SYNC_MODE_SMOOTH);
+    xEventGroupSetBits(time_events, TIME_SYNC_VALID_BIT);
+    ESP_LOGI(TAG, "System time set by %s", from_broker ? "the broker" : "SNTP");
+    if (sync_cb) {
+        sync_cb();
+    }
+}
+
+static void time_sync_notification(struct timeval *tv)
+{
+    last_sntp_us = esp_timer_get_time();
+    clock_synced(tv, false);
+}
+
+// Restores the clock and sets SNTP up, before Wi-Fi starts so that DHCP can
+// hand out an NTP server
+void time_sync_init(void)
+{
+    time_t now;
+
+    time_events = xEventGroupCreate();
+
+    time(&now);
+    if (rtc_synced && year_valid(now)) {
+        status.valid = true;
+        xEventGroupSetBits(time_events, TIME_SYNC_VALID_BIT);
+        ESP_LOGI(TAG, "Clock kept from before the reset");
+    } else {
+        rtc_synced = false;
+        if (!year_valid(now) && restore_epoch()) {
+            status.estimated = true;
+            ESP_LOGI(TAG, "Clock restored from the last saved time, waiting for a sync");
+        }
+    }
+
     esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    esp_sntp_setservername(0, "pool.ntp.org");
+#if TIME_SYNC_DHCP_SERVER
+    // The DHCP server takes index 0
+    esp_sntp_servermode_dhcp(1);
+    const int first_server = 1;
+#else
+    const int first_server = 0;
+#endif
+    for (int i = 0; i < sizeof(servers) / sizeof(servers[0]) && first_server + i < SNTP_MAX_SERVERS; i++) {
+        esp_sntp_setservername(first_server + i, servers[i]);
+    }
+    sntp_set_sync_mode(status.valid ? SNTP_SYNC_MODE_SMOOTH : SNTP_SYNC_MODE_IMMED);
+    sntp_set_sync_interval(TIME_SYNC_INTERVAL_MS);
+    sntp_set_time_sync_notification_cb(time_sync_notification);
+}
+
+// Returns right away. on_sync runs once, in the SNTP or MQTT context, when
+// the clock first becomes valid after power on; re-syncs don't call it.
+void time_sync_start(time_sync_cb_t on_sync)
+{
+    ESP_LOGI(TAG, "Initializing SNTP");
+    sync_cb = on_sync;
     esp_sntp_init();
 }
 
-void obtain_time(void)
+bool time_sync_is_valid(void)
 {
-    initialize_sntp();
+    return status.valid;
+}
+
+bool time_sync_wait_valid(TickType_t timeout)
+{
+    return xEventGroupWaitBits(time_events, TIME_SYNC_VALID_BIT, false, true, timeout) & TIME_SYNC_VALID_BIT;
+}
 
-    time_t now = 0;
-    struct tm timeinfo = { 0 };
-    int retry = 0;
-    const int retry_count = 10;
+// Steps the clock until it is valid and slews it afterwards, like an SNTP
+// update would. Not through sntp_sync_time(), which would also run the SNTP
+// notification and count the broker time as an SNTP sync.
+static void apply_broker_time(const struct timeval *tv)
+{
+    struct timeval now;
 
-    while (timeinfo.tm_year < (2025 - 1900) && ++retry < retry_count) {
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-        vTaskDelay(pdMS_TO_TICKS(2000));
-        time(&now);
-        localtime_r(&now, &timeinfo);
+    if (time_sync_is_valid()) {
+        gettimeofday(&now, NULL);
+        int64_t delta_us = ((int64_t)tv->tv_sec - now.tv_sec) * 1000000 + (tv->tv_usec - now.tv_usec);
+        struct timeval delta = {
+            .tv_sec = delta_us / 1000000,
+            .tv_usec = delta_us % 1000000,
+        };
+        // adjtime() refuses offsets it can't slew away in reasonable time
+        if (adjtime(&delta, NULL) == 0) {
+            return;
+        }
     }
+    settimeofday(tv, NULL);
+}
+
+// Route handler for TIME_SYNC_BROKER_COMMAND, e.g. "1735689600.250"
+void time_sync_broker_time(const char *data, int len)
+{
+    char payload[32];
+    char *end;
 
-    esp_sntp_stop();
+    snprintf(payload, sizeof(payload), "%.*s", len, data);
+    double epoch = strtod(payload, &end);
+    if (end == payload || !year_valid((time_t)epoch)) {
+        ESP_LOGW(TAG, "Invalid broker time '%s'", payload);
+        return;
+    }
+
+    // SNTP is more precise, the broker only stands in while it is unreachable
+    if (last_sntp_us != 0 && esp_timer_get_time() - last_sntp_us < 2 * TIME_SYNC_INTERVAL_MS * 1000LL) {
+        return;
+    }
+
+    struct timeval tv = {
+        .tv_sec = (time_t)epoch,
+        .tv_usec = (suseconds_t)((epoch - floor(epoch)) * 1000000),
+    };
+    apply_broker_time(&tv);
+    clock_synced(&tv, true);
+}
+
+void time_sync_get_status(time_sync_status_t *out)
+{
+    portENTER_CRITICAL(&status_lock);
+    *out = status;
+    portEXIT_CRITICAL(&status_lock);
 }
 
 void time_sync_set_timezone(const char *tz_string)
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+#include "esp_adc/adc_oneshot.h"
+
+// ULP pre-sampling in deep sleep (CONFIG_ULP_SAMPLER_ENABLED): the ULP
+// coprocessor reads turbidity and TDS every ULP_SAMPLE_PERIOD_MS, keeps their
+// extremes in RTC memory and wakes the main cores when a reading drifts more
+// than its delta from the last full measurement.
+#define ULP_SAMPLE_PERIOD_MS (60 * 1000)
+// Raw ADC codes (12 bit, 12 dB), averaged over 1 << ULP_OVERSAMPLING_SHIFT conversions
+#define ULP_TURBIDITY_DELTA_RAW 200
+#define ULP_TDS_DELTA_RAW 150
+#define ULP_OVERSAMPLING_SHIFT 2
+
+// The ULP switches the sensor supplies around each sample, so they have to
+// be on RTC GPIOs (sensors_manager.h). The GPIO 17 and 19 of the current
+// board are not, see CONFIG_ULP_SAMPLER_RTC_SUPPLIES and the README.
+#define ULP_SETTLING_TIME_MS 100
+
+typedef enum {
+    ULP_CHANNEL_TURBIDITY,
+    ULP_CHANNEL_TDS,
+    ULP_CHANNEL_COUNT
+} ulp_channel_t;
+
+// Samples taken while the main cores slept, raw ADC codes
+typedef struct {
+    uint16_t samples;
+    uint16_t min[ULP_CHANNEL_COUNT];
+    uint16_t max[ULP_CHANNEL_COUNT];
+    int event;          // channel that crossed its delta and woke the node, or -1
+} ulp_sampler_summary_t;
+
+void ulp_sampler_init(void);
+void ulp_sampler_set_baseline(uint16_t turbidity_raw, uint16_t tds_raw);
+bool ulp_sampler_take_summary(ulp_sampler_summary_t *summary);
+void ulp_sampler_start(void);
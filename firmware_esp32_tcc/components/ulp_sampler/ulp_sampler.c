@@ -0,0 +1,347 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+#include "esp_adc/adc_oneshot.h"
+#include "esp_private/esp_sleep_internal.h"
+#include "soc/soc.h"
+#include "soc/rtc_io_reg.h"
+#include "esp32/ulp.h"
+
+#include "ulp_sampler.h"
+#include "sensors_manager.h"
+
+const static char *TAG = "ulp_sampler";
+
+// RTC slow memory words shared with the ULP program, which only uses their
+// low 16 bits. The program is loaded right after them.
+enum {
+    ULP_VAR_SAMPLES,
+    ULP_VAR_EVENT,      // channel + 1 that crossed its delta, 0 if none
+    ULP_VAR_CHANNELS,
+};
+
+enum {
+    ULP_FIELD_BASELINE,
+    ULP_FIELD_DELTA,
+    ULP_FIELD_MIN,
+    ULP_FIELD_MAX,
+    ULP_FIELD_COUNT,
+};
+
+#define ULP_VAR(channel, field) (ULP_VAR_CHANNELS + (channel) * ULP_FIELD_COUNT + (field))
+#define ULP_PROGRAM_OFFSET 16
+#define ULP_PROGRAM_MAX 128
+
+_Static_assert(ULP_VAR(ULP_CHANNEL_COUNT, 0) <= ULP_PROGRAM_OFFSET, "ULP variables overlap the program");
+
+// Program labels
+enum {
+    LABEL_SETTLE = 1,
+    LABEL_DONE,
+    LABEL_WAKE,
+    LABEL_CHANNELS,
+};
+
+enum {
+    LABEL_MIN_DONE,
+    LABEL_MAX_DONE,
+    LABEL_NEGATIVE,
+    LABEL_ABS,
+    LABEL_EVENT,
+    LABEL_CHANNEL_COUNT,
+};
+
+#define CHANNEL_LABEL(channel, label) (LABEL_CHANNELS + (channel) * LABEL_CHANNEL_COUNT + (label))
+
+// The ULP runs from the 8 MHz RTC clock, I_DELAY waits at most 0xffff cycles
+#define ULP_SETTLING_LOOPS ((ULP_SETTLING_TIME_MS * 8000 + 0xfffe) / 0xffff)
+
+static const adc_channel_t adc_channels[ULP_CHANNEL_COUNT] = {
+    [ULP_CHANNEL_TURBIDITY] = TURBIDITY_SENSOR_ADC_CHANNEL,
+    [ULP_CHANNEL_TDS] = TDS_SENSOR_ADC_CHANNEL,
+};
+
+static const gpio_num_t power_pins[ULP_CHANNEL_COUNT] = {
+    [ULP_CHANNEL_TURBIDITY] = TURBIDITY_SENSOR_POWER_GPIO,
+    [ULP_CHANNEL_TDS] = TDS_SENSOR_POWER_GPIO,
+};
+
+static const char *channel_names[ULP_CHANNEL_COUNT] = {
+    [ULP_CHANNEL_TURBIDITY] = "turbidity",
+    [ULP_CHANNEL_TDS] = "TDS",
+};
+
+static const uint16_t deltas[ULP_CHANNEL_COUNT] = {
+    ULP_TURBIDITY_DELTA_RAW,
+    ULP_TDS_DELTA_RAW,
+};
+
+RTC_DATA_ATTR static uint16_t baseline[ULP_CHANNEL_COUNT];
+RTC_DATA_ATTR static bool baseline_valid;
+RTC_DATA_ATTR static bool ulp_started;
+
+static ulp_sampler_summary_t summary;
+static bool summary_valid;
+
+#if CONFIG_ULP_SAMPLER_ENABLED
+static ulp_insn_t program[ULP_PROGRAM_MAX];
+static size_t program_len;
+static bool program_overflow;
+
+static void emit(const ulp_insn_t *insns, size_t n) {
+    if (program_len + n > ULP_PROGRAM_MAX) {
+        program_overflow = true;
+        return;
+    }
+    memcpy(&program[program_len], insns, n * sizeof(*insns));
+    program_len += n;
+}
+
+#define EMIT(...) do { \
+        const ulp_insn_t insns_[] = { __VA_ARGS__ }; \
+        emit(insns_, sizeof(insns_) / sizeof(insns_[0])); \
+    } while (0)
+
+// The ULP switches the supplies around each sample
+static void emit_power(bool on) {
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        int bit = rtc_io_number_get(power_pins[c]);
+        if (on) {
+            EMIT(I_WR_REG(RTC_GPIO_OUT_W1TS_REG, RTC_GPIO_OUT_DATA_W1TS_S + bit, RTC_GPIO_OUT_DATA_W1TS_S + bit, 1));
+        } else {
+            EMIT(I_WR_REG(RTC_GPIO_OUT_W1TC_REG, RTC_GPIO_OUT_DATA_W1TC_S + bit, RTC_GPIO_OUT_DATA_W1TC_S + bit, 1));
+        }
+    }
+}
+
+// Holding a digital GPIO on through deep sleep would keep the sensors
+// powered all night, which costs more than the ULP saves. The Kconfig
+// option only builds the sampler for boards that say they are wired for
+// it, this catches a pin map that disagrees.
+static bool supplies_switchable(void) {
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        if (!rtc_gpio_is_valid_gpio(power_pins[c])) {
+            ESP_LOGE(TAG, "CONFIG_ULP_SAMPLER_RTC_SUPPLIES is set but GPIO %d powering the %s sensor is not an RTC GPIO",
+                     power_pins[c], channel_names[c]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// R1 = averaged sample, R3 = 0 as the base of every load and store
+static void emit_channel(int c) {
+    EMIT(I_ADC(R1, 0, adc_channels[c]));
+    for (int i = 1; i < (1 << ULP_OVERSAMPLING_SHIFT); i++) {
+        EMIT(I_ADC(R2, 0, adc_channels[c]),
+             I_ADDR(R1, R1, R2));
+    }
+
+    EMIT(I_RSHI(R1, R1, ULP_OVERSAMPLING_SHIFT),
+         // A subtraction that borrows sets the overflow flag
+         I_LD(R2, R3, ULP_VAR(c, ULP_FIELD_MIN)),
+         I_SUBR(R0, R2, R1),
+         M_BXF(CHANNEL_LABEL(c, LABEL_MIN_DONE)),
+         I_ST(R1, R3, ULP_VAR(c, ULP_FIELD_MIN)),
+         M_LABEL(CHANNEL_LABEL(c, LABEL_MIN_DONE)),
+
+         I_LD(R2, R3, ULP_VAR(c, ULP_FIELD_MAX)),
+         I_SUBR(R0, R1, R2),
+         M_BXF(CHANNEL_LABEL(c, LABEL_MAX_DONE)),
+         I_ST(R1, R3, ULP_VAR(c, ULP_FIELD_MAX)),
+         M_LABEL(CHANNEL_LABEL(c, LABEL_MAX_DONE)),
+
+         // R0 = |sample - baseline|, wake up when it exceeds the delta
+         I_LD(R2, R3, ULP_VAR(c, ULP_FIELD_BASELINE)),
+         I_SUBR(R0, R1, R2),
+         M_BXF(CHANNEL_LABEL(c, LABEL_NEGATIVE)),
+         M_BX(CHANNEL_LABEL(c, LABEL_ABS)),
+         M_LABEL(CHANNEL_LABEL(c, LABEL_NEGATIVE)),
+         I_SUBR(R0, R2, R1),
+         M_LABEL(CHANNEL_LABEL(c, LABEL_ABS)),
+         I_LD(R2, R3, ULP_VAR(c, ULP_FIELD_DELTA)),
+         I_SUBR(R2, R2, R0),
+         M_BXF(CHANNEL_LABEL(c, LABEL_EVENT)));
+}
+
+static bool build_program(void) {
+    program_len = 0;
+    program_overflow = false;
+
+    EMIT(I_MOVI(R3, 0));
+    emit_power(true);
+    EMIT(I_MOVI(R2, ULP_SETTLING_LOOPS),
+         M_LABEL(LABEL_SETTLE),
+         I_DELAY(0xffff),
+         I_SUBI(R2, R2, 1),
+         I_MOVR(R0, R2),
+         M_BGE(LABEL_SETTLE, 1));
+
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        emit_channel(c);
+    }
+
+    EMIT(M_LABEL(LABEL_DONE),
+         I_LD(R0, R3, ULP_VAR_SAMPLES),
+         I_ADDI(R0, R0, 1),
+         I_ST(R0, R3, ULP_VAR_SAMPLES));
+    emit_power(false);
+    EMIT(I_LD(R0, R3, ULP_VAR_EVENT),
+         M_BGE(LABEL_WAKE, 1),
+         I_HALT());
+
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        EMIT(M_LABEL(CHANNEL_LABEL(c, LABEL_EVENT)),
+             I_MOVI(R0, c + 1),
+             I_ST(R0, R3, ULP_VAR_EVENT),
+             M_BX(LABEL_DONE));
+    }
+
+    // The main cores restart the ULP timer before the next sleep
+    EMIT(M_LABEL(LABEL_WAKE),
+         I_WAKE(),
+         I_END(),
+         I_HALT());
+
+    return !program_overflow;
+}
+
+static esp_err_t init_adc(void) {
+    static adc_oneshot_unit_handle_t adc_handle;
+    esp_err_t err;
+
+    if (adc_handle == NULL) {
+        adc_oneshot_unit_init_cfg_t unit_config = {
+            .unit_id = ADC_UNIT_1,
+            .ulp_mode = ADC_ULP_MODE_FSM,
+        };
+        err = adc_oneshot_new_unit(&unit_config, &adc_handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // Same attenuation as the continuous driver, see adc_manager
+    adc_oneshot_chan_cfg_t channel_config = {
+        .atten = ADC_ATTEN_DB_12,
+        .bitwidth = ADC_BITWIDTH_12,
+    };
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        err = adc_oneshot_config_channel(adc_handle, adc_channels[c], &channel_config);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // Keeps the SAR ADC powered in deep sleep
+    return esp_sleep_enable_adc_tsens_monitor(true);
+}
+
+// Hands the supplies to the ULP, off between samples
+static void power_on_sensors(void) {
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        rtc_gpio_init(power_pins[c]);
+        rtc_gpio_set_direction(power_pins[c], RTC_GPIO_MODE_OUTPUT_ONLY);
+        rtc_gpio_set_level(power_pins[c], 0);
+    }
+}
+
+static void release_sensors(void) {
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        rtc_gpio_deinit(power_pins[c]);
+    }
+}
+#endif
+
+// Stops the ULP and collects what it sampled, before anything else uses the
+// ADC or the sensor supplies
+void ulp_sampler_init(void) {
+#if CONFIG_ULP_SAMPLER_ENABLED
+    if (!ulp_started) {
+        return;
+    }
+    ulp_started = false;
+    ulp_timer_stop();
+    release_sensors();
+
+    summary.samples = RTC_SLOW_MEM[ULP_VAR_SAMPLES] & 0xffff;
+    summary.event = (int)(RTC_SLOW_MEM[ULP_VAR_EVENT] & 0xffff) - 1;
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        summary.min[c] = RTC_SLOW_MEM[ULP_VAR(c, ULP_FIELD_MIN)] & 0xffff;
+        summary.max[c] = RTC_SLOW_MEM[ULP_VAR(c, ULP_FIELD_MAX)] & 0xffff;
+    }
+    summary_valid = summary.samples > 0;
+
+    ESP_LOGI(TAG, "%u sample(s) in deep sleep, turbidity %u-%u, TDS %u-%u%s", summary.samples,
+             summary.min[ULP_CHANNEL_TURBIDITY], summary.max[ULP_CHANNEL_TURBIDITY],
+             summary.min[ULP_CHANNEL_TDS], summary.max[ULP_CHANNEL_TDS],
+             summary.event >= 0 ? ", woken by a threshold" : "");
+#endif
+}
+
+// Raw codes of the last full measurement, the reference for the deltas
+void ulp_sampler_set_baseline(uint16_t turbidity_raw, uint16_t tds_raw) {
+    baseline[ULP_CHANNEL_TURBIDITY] = turbidity_raw;
+    baseline[ULP_CHANNEL_TDS] = tds_raw;
+    baseline_valid = true;
+}
+
+// Hands out the samples of the last sleep once, for the next snapshot
+bool ulp_sampler_take_summary(ulp_sampler_summary_t *out) {
+    if (!summary_valid) {
+        return false;
+    }
+    *out = summary;
+    summary_valid = false;
+    return true;
+}
+
+// Called right before deep sleep
+void ulp_sampler_start(void) {
+#if CONFIG_ULP_SAMPLER_ENABLED
+    size_t size;
+    esp_err_t err;
+
+    if (!baseline_valid) {
+        ESP_LOGW(TAG, "No measurement to compare with yet, ULP not started");
+        return;
+    }
+    if (!supplies_switchable()) {
+        return;
+    }
+    if (!build_program()) {
+        ESP_LOGE(TAG, "ULP program does not fit in %d instructions", ULP_PROGRAM_MAX);
+        return;
+    }
+
+    err = init_adc();
+    if (err == ESP_OK) {
+        size = program_len;
+        err = ulp_process_macros_and_load(ULP_PROGRAM_OFFSET, program, &size);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set up the ULP: %s", esp_err_to_name(err));
+        return;
+    }
+
+    RTC_SLOW_MEM[ULP_VAR_SAMPLES] = 0;
+    RTC_SLOW_MEM[ULP_VAR_EVENT] = 0;
+    for (int c = 0; c < ULP_CHANNEL_COUNT; c++) {
+        RTC_SLOW_MEM[ULP_VAR(c, ULP_FIELD_BASELINE)] = baseline[c];
+        RTC_SLOW_MEM[ULP_VAR(c, ULP_FIELD_DELTA)] = deltas[c];
+        RTC_SLOW_MEM[ULP_VAR(c, ULP_FIELD_MIN)] = UINT16_MAX;
+        RTC_SLOW_MEM[ULP_VAR(c, ULP_FIELD_MAX)] = 0;
+    }
+
+    power_on_sensors();
+    ulp_set_wakeup_period(0, ULP_SAMPLE_PERIOD_MS * 1000);
+    esp_sleep_enable_ulp_wakeup();
+    ulp_run(ULP_PROGRAM_OFFSET);
+    ulp_started = true;
+    ESP_LOGI(TAG, "ULP sampling every %d s, %d instructions", ULP_SAMPLE_PERIOD_MS / 1000, (int)size);
+#endif
+}
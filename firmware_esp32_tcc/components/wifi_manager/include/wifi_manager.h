@@ -1,4 +1,46 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+// Reconnect backoff, doubled after each failed attempt up to the cap. Half of
+// each delay is random so that nodes don't re-associate in lockstep when an
+// access point reboots.
+#define WIFI_BACKOFF_INITIAL_MS 500
+#define WIFI_BACKOFF_MAX_MS (60 * 1000)
+// Failed attempts before falling back to SmartConfig, which listens for new
+// credentials for WIFI_SMARTCONFIG_TIMEOUT_MS and then resumes reconnecting
+#define WIFI_RECONNECT_BUDGET 8
+#define WIFI_SMARTCONFIG_TIMEOUT_MS (5 * 60 * 1000)
+
+// Last access point, kept in NVS and in RTC memory across deep sleep, so
+// that the next connect goes straight to its BSSID and channel without a scan
+#define WIFI_CACHE_NVS_NAMESPACE "wifi_manager"
+#define WIFI_CACHE_NVS_KEY "ap_cache"
+// Failed directed attempts before falling back to a full scan
+#define WIFI_FAST_CONNECT_ATTEMPTS 2
+
+typedef enum {
+    WIFI_STATE_CONNECTING,
+    WIFI_STATE_CONNECTED,
+    WIFI_STATE_BACKOFF,
+    WIFI_STATE_SMARTCONFIG,
+} wifi_state_t;
+
+typedef struct {
+    wifi_state_t state;
+    int64_t connect_time_us;    // from reset to the first IP
+    bool fast_connect;          // first IP came from a directed connect
+    uint32_t fallbacks;         // full scans after a failed directed connect
+    uint32_t attempts;          // connect attempts since boot
+    uint32_t failures;          // failed attempts since the last IP
+    uint32_t disconnects;       // links lost after getting an IP
+    uint32_t escalations;       // SmartConfig runs after the retry budget ran out
+    int64_t reconnect_time_us;  // from losing the link to the next IP, last reconnect
+} wifi_connect_stats_t;
+
 void initialise_wifi(void);
-bool is_wifi_connected(void);
\ No newline at end of file
+bool is_wifi_connected(void);
+bool wifi_wait_connected(TickType_t timeout);
+void wifi_get_connect_stats(wifi_connect_stats_t *stats);
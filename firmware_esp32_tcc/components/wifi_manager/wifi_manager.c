@@ -1,4 +1,6 @@
 #include <string.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
 #include "esp_smartconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -9,6 +11,10 @@
 #include "nvs_flash.h"
 #include "esp_netif.h"
 #include "esp_mac.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "nvs.h"
 
 #include "wifi_manager.h"
 
@@ -24,20 +30,294 @@ static const char *TAG = "wifi_manager";
 
 static wifi_config_t wifi_config;
 
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t valid;
+} wifi_ap_cache_t;
+
+RTC_DATA_ATTR static wifi_ap_cache_t rtc_ap_cache;
+static int fast_connect_failures;
+// connect_stats is shared by the event handler, the reconnect timer and the
+// SmartConfig task; the state is checked and changed under stats_lock
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static wifi_connect_stats_t connect_stats;
+static esp_timer_handle_t reconnect_timer;
+static int64_t link_lost_us;
+static volatile bool smartconfig_running;
+
 static void smartconfig_task(void * parm);
 
+static void set_state(wifi_state_t state)
+{
+    portENTER_CRITICAL(&stats_lock);
+    connect_stats.state = state;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+// Starts an attempt only if the state is still `from`, so two contexts
+// racing for the same transition connect once
+static bool connect_attempt(wifi_state_t from)
+{
+    bool start;
+
+    portENTER_CRITICAL(&stats_lock);
+    start = connect_stats.state == from;
+    if (start) {
+        connect_stats.state = WIFI_STATE_CONNECTING;
+        connect_stats.attempts++;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    if (start) {
+        esp_wifi_connect();
+    }
+    return start;
+}
+
+static void reconnect_timer_callback(void *arg)
+{
+    connect_attempt(WIFI_STATE_BACKOFF);
+}
+
+static uint32_t backoff_delay_ms(uint32_t failures)
+{
+    uint32_t delay = WIFI_BACKOFF_INITIAL_MS;
+
+    for (uint32_t i = 1; i < failures && delay < WIFI_BACKOFF_MAX_MS; i++) {
+        delay *= 2;
+    }
+    if (delay > WIFI_BACKOFF_MAX_MS) {
+        delay = WIFI_BACKOFF_MAX_MS;
+    }
+
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+static void start_smartconfig(void)
+{
+    set_state(WIFI_STATE_SMARTCONFIG);
+    if (!smartconfig_running) {
+        smartconfig_running = true;
+        xTaskCreate(smartconfig_task, "smartconfig_task", 4096, NULL, 3, NULL);
+    }
+}
+
+// Called after a failed attempt or a lost link
+static void schedule_reconnect(void)
+{
+    uint32_t failures;
+    bool escalate;
+
+    portENTER_CRITICAL(&stats_lock);
+    failures = ++connect_stats.failures;
+    escalate = failures > WIFI_RECONNECT_BUDGET;
+    if (escalate) {
+        connect_stats.escalations++;
+        connect_stats.failures = 0;
+    } else {
+        connect_stats.state = WIFI_STATE_BACKOFF;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    if (escalate) {
+        ESP_LOGW(TAG, "%" PRIu32 " failed attempts, starting SmartConfig", failures - 1);
+        start_smartconfig();
+        return;
+    }
+
+    uint32_t delay = backoff_delay_ms(failures);
+    ESP_LOGI(TAG, "Reconnecting in %" PRIu32 " ms (attempt %" PRIu32 "/%d)", delay,
+             failures, WIFI_RECONNECT_BUDGET);
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, (uint64_t)delay * 1000);
+}
+
+static void load_ap_cache(wifi_ap_cache_t *cache)
+{
+    nvs_handle_t handle;
+    size_t len = sizeof(*cache);
+
+    if (rtc_ap_cache.valid) {
+        *cache = rtc_ap_cache;
+        return;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    if (nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        if (nvs_get_blob(handle, WIFI_CACHE_NVS_KEY, cache, &len) != ESP_OK || len != sizeof(*cache)) {
+            memset(cache, 0, sizeof(*cache));
+        }
+        nvs_close(handle);
+    }
+    rtc_ap_cache = *cache;
+}
+
+static void store_ap_cache(const wifi_ap_cache_t *cache)
+{
+    nvs_handle_t handle;
+
+    // Only write flash when the access point changed
+    if (rtc_ap_cache.valid && memcmp(&rtc_ap_cache, cache, sizeof(*cache)) == 0) {
+        return;
+    }
+    rtc_ap_cache = *cache;
+
+    esp_err_t err = nvs_open(WIFI_CACHE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        if (cache->valid) {
+            err = nvs_set_blob(handle, WIFI_CACHE_NVS_KEY, cache, sizeof(*cache));
+        } else {
+            err = nvs_erase_key(handle, WIFI_CACHE_NVS_KEY);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+            }
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to store access point cache: %s", esp_err_to_name(err));
+    }
+}
+
+// Called once the station has an IP, remembers the access point it is on
+static void update_ap_cache(void)
+{
+    wifi_ap_record_t ap_info;
+    wifi_ap_cache_t cache = {0};
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return;
+    }
+
+    memcpy(cache.ssid, wifi_config.sta.ssid, sizeof(cache.ssid));
+    memcpy(cache.bssid, ap_info.bssid, sizeof(cache.bssid));
+    cache.channel = ap_info.primary;
+    cache.valid = 1;
+    store_ap_cache(&cache);
+}
+
+// Points the station at the cached access point, skipping the scan
+static bool apply_ap_cache(void)
+{
+    wifi_ap_cache_t cache;
+
+    load_ap_cache(&cache);
+    if (!cache.valid || memcmp(cache.ssid, wifi_config.sta.ssid, sizeof(cache.ssid)) != 0) {
+        return false;
+    }
+
+    memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(wifi_config.sta.bssid));
+    wifi_config.sta.bssid_set = true;
+    wifi_config.sta.channel = cache.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+
+    ESP_LOGI(TAG, "Directed connect to " MACSTR " on channel %d", MAC2STR(cache.bssid), cache.channel);
+    return true;
+}
+
+static void fall_back_to_scan(void)
+{
+    const wifi_ap_cache_t invalid = {0};
+
+    ESP_LOGW(TAG, "Cached access point not reachable, scanning all channels");
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+
+    store_ap_cache(&invalid);
+    portENTER_CRITICAL(&stats_lock);
+    connect_stats.fallbacks++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+#if CONFIG_WIFI_MANAGER_STATIC_IP
+static void set_static_ip(esp_netif_t *netif)
+{
+    esp_netif_ip_info_t ip_info = {0};
+    esp_netif_dns_info_t dns = {0};
+
+    ESP_ERROR_CHECK(esp_netif_dhcpc_stop(netif));
+
+    ip_info.ip.addr = esp_ip4addr_aton(CONFIG_WIFI_MANAGER_STATIC_IP_ADDR);
+    ip_info.netmask.addr = esp_ip4addr_aton(CONFIG_WIFI_MANAGER_STATIC_IP_NETMASK);
+    ip_info.gw.addr = esp_ip4addr_aton(CONFIG_WIFI_MANAGER_STATIC_IP_GW);
+    ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &ip_info));
+
+    dns.ip.u_addr.ip4.addr = esp_ip4addr_aton(CONFIG_WIFI_MANAGER_STATIC_IP_DNS);
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    ESP_ERROR_CHECK(esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns));
+}
+#endif
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        ESP_LOGI(TAG, "Wi-Fi STA started, attempting to connect...");
-        esp_wifi_connect();
+        if (connect_attempt(WIFI_STATE_CONNECTING)) {
+            ESP_LOGI(TAG, "Wi-Fi STA started, attempting to connect...");
+        }
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        ESP_LOGI(TAG, "Wi-Fi disconnected. Retrying...");
-        esp_wifi_connect();
+        wifi_event_sta_disconnected_t *evt = (wifi_event_sta_disconnected_t *)event_data;
+        wifi_state_t state;
+
         xEventGroupClearBits(s_wifi_event_group, CONNECTED_BIT);
+        portENTER_CRITICAL(&stats_lock);
+        state = connect_stats.state;
+        if (state == WIFI_STATE_CONNECTED) {
+            connect_stats.disconnects++;
+        }
+        portEXIT_CRITICAL(&stats_lock);
+        if (state == WIFI_STATE_CONNECTED) {
+            link_lost_us = esp_timer_get_time();
+        }
+        // SmartConfig drives the radio on its own until it gets credentials
+        if (state == WIFI_STATE_SMARTCONFIG) {
+            return;
+        }
+
+        ESP_LOGI(TAG, "Wi-Fi disconnected (reason %d)", evt->reason);
+        if (wifi_config.sta.bssid_set && ++fast_connect_failures >= WIFI_FAST_CONNECT_ATTEMPTS) {
+            fall_back_to_scan();
+        }
+        schedule_reconnect();
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        int64_t now_us = esp_timer_get_time();
+        bool first, reconnected;
+        uint32_t attempts;
+
         ESP_LOGI(TAG, "Wi-Fi connected and IP obtained.");
+        portENTER_CRITICAL(&stats_lock);
+        first = connect_stats.connect_time_us == 0;
+        reconnected = !first && link_lost_us;
+        if (first) {
+            connect_stats.connect_time_us = now_us;
+            connect_stats.fast_connect = wifi_config.sta.bssid_set;
+        } else if (reconnected) {
+            connect_stats.reconnect_time_us = now_us - link_lost_us;
+        }
+        attempts = connect_stats.failures + 1;
+        connect_stats.state = WIFI_STATE_CONNECTED;
+        connect_stats.failures = 0;
+        portEXIT_CRITICAL(&stats_lock);
+
+        // Only this handler writes the times, they can be read unlocked here
+        if (first) {
+            ESP_LOGI(TAG, "First IP %d ms after reset (%s)", (int)(connect_stats.connect_time_us / 1000),
+                     connect_stats.fast_connect ? "directed connect" : "full scan");
+        } else if (reconnected) {
+            ESP_LOGI(TAG, "Reconnected after %d ms and %" PRIu32 " attempt(s)",
+                     (int)(connect_stats.reconnect_time_us / 1000), attempts);
+        }
+        link_lost_us = 0;
+        fast_connect_failures = 0;
+        update_ap_cache();
         xEventGroupSetBits(s_wifi_event_group, CONNECTED_BIT);
     } else if (event_base == SC_EVENT && event_id == SC_EVENT_SCAN_DONE) {
         ESP_LOGI(TAG, "Scan done");
@@ -56,7 +336,12 @@ static void event_handler(void* arg, esp_event_base_t event_base,
 
         ESP_ERROR_CHECK( esp_wifi_disconnect() );
         ESP_ERROR_CHECK( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
-        esp_wifi_connect();
+        portENTER_CRITICAL(&stats_lock);
+        connect_stats.failures = 0;
+        portEXIT_CRITICAL(&stats_lock);
+        // If the SmartConfig task timed out first, its attempt with the old
+        // credentials fails and the retry picks up the new ones
+        connect_attempt(WIFI_STATE_SMARTCONFIG);
     } else if (event_base == SC_EVENT && event_id == SC_EVENT_SEND_ACK_DONE) {
         xEventGroupSetBits(s_wifi_event_group, ESPTOUCH_DONE_BIT);
     }
@@ -64,22 +349,24 @@ static void event_handler(void* arg, esp_event_base_t event_base,
 
 static void smartconfig_task(void * parm)
 {
-    EventBits_t uxBitsWifi, uxBitsSC; // Eventbits for WiFi connection and Smartconfig status
+    EventBits_t uxBitsSC;
+    // Without saved credentials there is nothing to go back to
+    TickType_t timeout = strlen((char *)wifi_config.sta.ssid) ? pdMS_TO_TICKS(WIFI_SMARTCONFIG_TIMEOUT_MS) : portMAX_DELAY;
+
     ESP_ERROR_CHECK( esp_smartconfig_set_type(SC_TYPE_ESPTOUCH) );
     smartconfig_start_config_t cfg = SMARTCONFIG_START_CONFIG_DEFAULT();
     ESP_ERROR_CHECK( esp_smartconfig_start(&cfg) );
-    while (1) {
-        uxBitsWifi = xEventGroupWaitBits(s_wifi_event_group, CONNECTED_BIT, false, false, portMAX_DELAY);
-        uxBitsSC = xEventGroupWaitBits(s_wifi_event_group, ESPTOUCH_DONE_BIT, true, false, portMAX_DELAY);
-        if (uxBitsWifi & CONNECTED_BIT) {
-            ESP_LOGI(TAG, "WiFi Connected to ap");
-        }
-        if (uxBitsSC & ESPTOUCH_DONE_BIT) {
-            ESP_LOGI(TAG, "SmartConfig complete");
-            esp_smartconfig_stop();
-            vTaskDelete(NULL);
-        }
+
+    uxBitsSC = xEventGroupWaitBits(s_wifi_event_group, ESPTOUCH_DONE_BIT, true, false, timeout);
+    esp_smartconfig_stop();
+
+    if (uxBitsSC & ESPTOUCH_DONE_BIT) {
+        ESP_LOGI(TAG, "SmartConfig complete");
+    } else if (connect_attempt(WIFI_STATE_SMARTCONFIG)) {
+        ESP_LOGW(TAG, "SmartConfig timed out, reconnecting with the saved credentials");
     }
+    smartconfig_running = false;
+    vTaskDelete(NULL);
 }
 
 bool is_wifi_connected(void)
@@ -88,12 +375,26 @@ bool is_wifi_connected(void)
     return (bits & CONNECTED_BIT) != 0;
 }
 
+bool wifi_wait_connected(TickType_t timeout)
+{
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, CONNECTED_BIT, false, true, timeout);
+    return (bits & CONNECTED_BIT) != 0;
+}
+
+void wifi_get_connect_stats(wifi_connect_stats_t *stats)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *stats = connect_stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
 void init_smartconfig(void)
 {
+    set_state(WIFI_STATE_SMARTCONFIG);
     ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK( esp_wifi_start() );
 
-    xTaskCreate(smartconfig_task, "smartconfig_task", 4096, NULL, 3, NULL);
+    start_smartconfig();
 }
 
 void initialise_wifi(void)
@@ -103,9 +404,18 @@ void initialise_wifi(void)
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
     assert(sta_netif);
+#if CONFIG_WIFI_MANAGER_STATIC_IP
+    set_static_ip(sta_netif);
+#endif
 
     s_wifi_event_group = xEventGroupCreate();
 
+    const esp_timer_create_args_t timer_args = {
+        .callback = reconnect_timer_callback,
+        .name = "wifi_reconnect",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+
     ESP_ERROR_CHECK( esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL) );
     ESP_ERROR_CHECK( esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL) );
     ESP_ERROR_CHECK( esp_event_handler_register(SC_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL) );
@@ -121,26 +431,18 @@ void initialise_wifi(void)
         init_smartconfig();
     } else {
         ESP_LOGI(TAG, "Connecting to saved Wi-Fi: SSID=%s", wifi_config.sta.ssid);
+        if (!apply_ap_cache()) {
+            wifi_config.sta.bssid_set = false;
+            wifi_config.sta.channel = 0;
+            wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        }
+        set_state(WIFI_STATE_CONNECTING);
         ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
         ESP_ERROR_CHECK( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
         ESP_ERROR_CHECK( esp_wifi_start() );
 
         esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
-
-        int max_retries = 20; // Timeout of 10 seconds (20 * 500 ms)
-        int retries = 0;
-
-        while (!is_wifi_connected() && retries < max_retries) {
-            ESP_LOGI(TAG, "Attempting to connect... Retry %d/%d", retries + 1, max_retries);
-            vTaskDelay(pdMS_TO_TICKS(500));
-            retries++;
-        }
-
-        if (is_wifi_connected()) {
-            ESP_LOGI(TAG, "Connected to Wi-Fi successfully!");
-        } else {
-            ESP_LOGW(TAG, "Failed to connect to Wi-Fi. Starting SmartConfig...");
-            init_smartconfig();
-        }
+        // Returns right away, retries and the SmartConfig fallback are
+        // handled by the reconnect state machine
     }
 }
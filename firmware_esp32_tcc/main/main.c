@@ -9,13 +9,19 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_mac.h"
-#include "esp_pm.h"
 
 #include "wifi_manager.h"
 #include "ota.h"
 #include "mqtt_service.h"
 #include "sensors_manager.h"
+#include "adc_manager.h"
 #include "device_info.h"
+#include "telemetry.h"
+#include "time_sync.h"
+#include "sleep_manager.h"
+#include "batch_policy.h"
+#include "ulp_sampler.h"
+#include "pm_policy.h"
 
 static const char *TAG = "main";
 
@@ -31,35 +37,47 @@ void app_main(void)
         err = nvs_flash_init();
     }
 
-#if CONFIG_PM_ENABLE
-    esp_pm_config_t pm_config = {
-        .max_freq_mhz = 80,
-        .min_freq_mhz = 80,
-#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
-        .light_sleep_enable = true,
-#endif
-    };
-    ESP_ERROR_CHECK( esp_pm_configure(&pm_config) );
-#endif // CONFIG_PM_ENABLE
+    sleep_manager_init();
 
-    initialise_wifi();
+    ulp_sampler_init();
+
+    pm_policy_init();
 
-    while (!is_wifi_connected()) {
-        ESP_LOGI(TAG, "Waiting for Wi-Fi connection...");
-        vTaskDelay(pdMS_TO_TICKS(500));
-    };
+    // Before the sensors date their first reading
+    time_sync_init();
+
+    // Nothing below waits for the network. Wi-Fi, MQTT and SNTP come up in
+    // the background while the sensors take their first reading; readings
+    // are dated when the clock is set and queued until the broker is reached.
+    device_info_init();
 
-    adc_mutex = xSemaphoreCreateMutex();
-    if (adc_mutex == NULL) {
-        ESP_LOGE(TAG, "Failed to create ADC mutex");
+    adc_manager_init();
+
+    batch_policy_init();
+
+    telemetry_init();
+
+    init_sensors_task();
+
+    // In batching mode a timer wake only turns the radio on when the reading
+    // asks for it, see batch_policy_should_upload()
+    if (telemetry_can_batch() && !sleep_manager_wait_network()) {
         return;
     }
 
-    device_info_init();
+    initialise_wifi();
 
     mqtt_app_start();
 
-    init_sensors_task();
+    telemetry_start();
+
+    batch_policy_register_routes();
+
+#if TIME_SYNC_BROKER_TIME
+    mqtt_route_add(TIME_SYNC_BROKER_COMMAND, time_sync_broker_time);
+#endif
+
+    time_sync_start(sensors_time_synced);
 
     init_ota();
 }
\ No newline at end of file